@@ -0,0 +1,149 @@
+/* Benchmark support: CPU pinning, statistics and event counters */
+
+// GNU extensions used: sched_getcpu, sched_setaffinity
+#define _GNU_SOURCE 1
+
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench.h"
+
+/* z for a two-sided 95% interval */
+#define Z95 1.96
+
+const char *const bench_event_names[BENCH_EVENTS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses",
+    "dtlb_misses"};
+
+/* Descriptors of the open counters, -1 for those not open */
+static int event_fds[BENCH_EVENTS] = {-1, -1, -1, -1, -1};
+
+int bench_pin_cpu(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        return -1;
+    return cpu;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Median of n sorted values */
+static double sorted_median(const double *x, size_t n) {
+    return (n % 2 == 1) ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2.0;
+}
+
+void bench_summarize(double *x, size_t n, bench_summary_t *sum) {
+    memset(sum, 0, sizeof(*sum));
+    sum->n = n;
+    if (n == 0)
+        return;
+
+    qsort(x, n, sizeof(double), compare_double);
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++)
+        total += x[i];
+    sum->min = x[0];
+    sum->max = x[n - 1];
+    sum->mean = total / (double)n;
+    sum->median = sorted_median(x, n);
+
+    double *dev = malloc(n * sizeof(double));
+    if (dev != NULL) {
+        for (size_t i = 0; i < n; i++)
+            dev[i] = fabs(x[i] - sum->median);
+        qsort(dev, n, sizeof(double), compare_double);
+        sum->mad = sorted_median(dev, n);
+        free(dev);
+    }
+
+    /* The number of samples below the median is binomial(n, 1/2), so
+       the order statistics (n -+ z sqrt(n)) / 2 bound it, counting
+       from 1 */
+    double half = Z95 * sqrt((double)n) / 2.0;
+    double lo = floor((double)n / 2.0 - half);
+    double hi = ceil((double)n / 2.0 + half + 1.0);
+    sum->ci_lo = x[lo < 1.0 ? 0 : (size_t)lo - 1];
+    sum->ci_hi = x[hi > (double)n ? n - 1 : (size_t)hi - 1];
+}
+
+unsigned bench_events_open(void) {
+    unsigned mask = 0;
+#ifdef __linux__
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[BENCH_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    for (int i = 0; i < BENCH_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        event_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (event_fds[i] >= 0)
+            mask |= 1u << i;
+    }
+#endif
+    return mask;
+}
+
+void bench_events_start(void) {
+#ifdef __linux__
+    for (int i = 0; i < BENCH_EVENTS; i++) {
+        if (event_fds[i] >= 0) {
+            ioctl(event_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(event_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void bench_events_stop(uint64_t counts[BENCH_EVENTS]) {
+    for (int i = 0; i < BENCH_EVENTS; i++) {
+        counts[i] = 0;
+#ifdef __linux__
+        if (event_fds[i] >= 0) {
+            ioctl(event_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(event_fds[i], &counts[i], sizeof(counts[i])) !=
+                sizeof(counts[i]))
+                counts[i] = 0;
+        }
+#endif
+    }
+}
+
+void bench_events_close(void) {
+    for (int i = 0; i < BENCH_EVENTS; i++) {
+        if (event_fds[i] >= 0)
+            close(event_fds[i]);
+        event_fds[i] = -1;
+    }
+}
@@ -0,0 +1,46 @@
+/* Routines for benchmarking: pinning to a CPU, robust statistics of
+   repeated measurements, and hardware event counters */
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pin the calling thread to the CPU it is running on.  Returns the CPU,
+   or -1 if the affinity could not be set */
+int bench_pin_cpu(void);
+
+/* Summary of a set of samples */
+typedef struct {
+    size_t n;
+    double min, max, mean;
+    double median;
+    double mad;          /* Median absolute deviation from the median */
+    double ci_lo, ci_hi; /* 95% confidence interval of the median */
+} bench_summary_t;
+
+/* Summarize n samples.  Sorts x in place.  The confidence interval is
+   distribution-free, between two order statistics of the samples, so it
+   widens to the extremes when n is small (below 6) */
+void bench_summarize(double *x, size_t n, bench_summary_t *sum);
+
+/* Hardware events counted in user mode: cycles, instructions, cache
+   misses, branch misses and data TLB load misses */
+#define BENCH_EVENTS 5
+extern const char *const bench_event_names[BENCH_EVENTS];
+
+/* Open counters for the calling thread.  Returns a mask with bit i set
+   if event i can be counted, 0 where perf_event_open(2) is unavailable */
+unsigned bench_events_open(void);
+
+/* Zero the counters and start counting */
+void bench_events_start(void);
+
+/* Stop counting and store the counts since bench_events_start, 0 for
+   events that are not counted */
+void bench_events_stop(uint64_t counts[BENCH_EVENTS]);
+
+/* Close the counters */
+void bench_events_close(void);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * classgen.c - Fit the size classes of mm.c to the requests of a set of
+ * traces for the CS:APP Malloc Lab Driver, and write them as a header.
+ *
+ * Usage: classgen [-t <tree_min>] [-o <out.h>] <trace>...
+ *
+ * mm.c gives every block size up to 128 bytes a class of its own, and
+ * puts every block of tree_min bytes or more (2048 by default) in the
+ * tree class. The NUM_RANGE classes in between each hold a range of
+ * sizes. classgen counts the block sizes that the traces' malloc and
+ * realloc requests need in that span, and splits them into NUM_RANGE
+ * runs of sizes that differ as little as possible: the sum over all
+ * requests of the squared distance, in log2 of the size, from the mean
+ * of their class is minimal. A class then holds blocks of similar
+ * relative size, so a first fit within it wastes little.
+ *
+ * The header defines RANGE_CLASS_BOUND_9 to RANGE_CLASS_BOUND_14, the
+ * smallest block size of each class after the first range class, class
+ * 8; build mm.c with -DSIZE_CLASS_TABLE='"<out.h>"' to use it.
+ */
+
+#define _XOPEN_SOURCE 700 // for getopt
+
+#include "tracefile.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* As in mm.c: alignment, header size, and the largest slab request */
+#define DSIZE 16
+#define WSIZE 8
+#define SLAB_MAX 128
+
+/* Range classes between the exact classes and the tree class, from
+   class 8 on */
+#define NUM_RANGE 6
+#define FIRST_RANGE 8
+
+/* Smallest block in a range class, and the largest tree_min allowed,
+   since the tree class must hold a chunk */
+#define RANGE_MIN (SLAB_MAX + DSIZE)
+#define TREE_MIN_MAX 4096
+
+/* Block sizes that can fall in a range class */
+#define MAX_SIZES (TREE_MIN_MAX / DSIZE)
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t <tree_min>] [-o <out.h>] <trace>...\n",
+            prog);
+    fprintf(stderr, "  -t <n>  Smallest block of the tree class (default "
+                    "2048, a multiple of 16 up to 4096)\n");
+    fprintf(stderr, "  -o <f>  Write the header to f instead of stdout\n");
+    exit(1);
+}
+
+/*
+ * count_trace - adds the block size of every request of a trace that
+ * lands in a range class to counts, indexed by size / DSIZE
+ */
+static void count_trace(const trace_t *trace, size_t tree_min,
+                        double *counts) {
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        double n;
+        if (op->type == ALLOC || op->type == REALLOC) {
+            n = 1.0;
+        } else if (op->type == ALLOC_BATCH) {
+            n = (double)op->count;
+        } else {
+            continue;
+        }
+        if (op->size <= SLAB_MAX || op->size >= tree_min) {
+            continue;
+        }
+        /* adjust_size in mm.c: a header word, rounded to DSIZE */
+        size_t asize = (op->size + WSIZE + DSIZE - 1) / DSIZE * DSIZE;
+        if (asize < tree_min) {
+            counts[asize / DSIZE] += n;
+        }
+    }
+}
+
+/*
+ * fit_classes - splits the sizes[0..m) with weights w into at most
+ * NUM_RANGE runs of least total squared log2 deviation from their run's
+ * mean, and stores the index of the first size of each run after the
+ * first in starts. Returns the number of runs.
+ */
+static int fit_classes(const size_t *sizes, const double *w, int m,
+                       int *starts) {
+    /* Prefix sums of w, w*x and w*x^2, with x = log2(size) */
+    static double sw[MAX_SIZES + 1], sx[MAX_SIZES + 1], sxx[MAX_SIZES + 1];
+    static double cost[NUM_RANGE + 1][MAX_SIZES + 1];
+    static int cut[NUM_RANGE + 1][MAX_SIZES + 1];
+
+    for (int i = 0; i < m; i++) {
+        double x = log2((double)sizes[i]);
+        sw[i + 1] = sw[i] + w[i];
+        sx[i + 1] = sx[i] + w[i] * x;
+        sxx[i + 1] = sxx[i] + w[i] * x * x;
+    }
+
+    /* cost[k][j]: best split of the first j sizes into k runs */
+    int runs = m < NUM_RANGE ? m : NUM_RANGE;
+    for (int j = 0; j <= m; j++) {
+        cost[0][j] = (j == 0) ? 0.0 : DBL_MAX;
+    }
+    for (int k = 1; k <= runs; k++) {
+        for (int j = 0; j <= m; j++) {
+            cost[k][j] = DBL_MAX;
+            for (int i = k - 1; i < j; i++) {
+                if (cost[k - 1][i] == DBL_MAX) {
+                    continue;
+                }
+                double n = sw[j] - sw[i];
+                double s = sx[j] - sx[i];
+                double dev = (n > 0.0) ? (sxx[j] - sxx[i]) - s * s / n : 0.0;
+                if (cost[k - 1][i] + dev < cost[k][j]) {
+                    cost[k][j] = cost[k - 1][i] + dev;
+                    cut[k][j] = i;
+                }
+            }
+        }
+    }
+
+    for (int k = runs, j = m; k > 1; k--) {
+        j = cut[k][j];
+        starts[k - 2] = j;
+    }
+    return runs;
+}
+
+int main(int argc, char **argv) {
+    size_t tree_min = 2048;
+    const char *outname = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:o:h")) != -1) {
+        switch (c) {
+        case 't':
+            tree_min = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            outname = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+    if (tree_min % DSIZE != 0 || tree_min <= RANGE_MIN ||
+        tree_min > TREE_MIN_MAX) {
+        fprintf(stderr, "%s: -t %zu is not a multiple of %d in (%d, %d]\n",
+                argv[0], tree_min, DSIZE, RANGE_MIN, TREE_MIN_MAX);
+        return 1;
+    }
+
+    static double counts[MAX_SIZES];
+    for (int i = optind; i < argc; i++) {
+        trace_t *trace = read_trace(argv[i], 0);
+        count_trace(trace, tree_min, counts);
+        free_trace(trace);
+    }
+
+    /* The sizes that occur, in order */
+    static size_t sizes[MAX_SIZES];
+    static double w[MAX_SIZES];
+    double total = 0.0;
+    int m = 0;
+    for (size_t s = RANGE_MIN; s < tree_min; s += DSIZE) {
+        if (counts[s / DSIZE] > 0.0) {
+            sizes[m] = s;
+            w[m] = counts[s / DSIZE];
+            total += w[m];
+            m++;
+        }
+    }
+
+    /* Classes that get no run start at tree_min, and hold nothing */
+    size_t bounds[NUM_RANGE];
+    int starts[NUM_RANGE];
+    int runs = fit_classes(sizes, w, m, starts);
+    for (int k = 0; k < NUM_RANGE; k++) {
+        bounds[k] = (k + 1 < runs) ? sizes[starts[k]] : tree_min;
+    }
+
+    FILE *out = stdout;
+    if (outname != NULL && (out = fopen(outname, "w")) == NULL) {
+        perror(outname);
+        return 1;
+    }
+    fprintf(out, "/*\n * Size-class bounds for mm.c, written by classgen "
+                 "from %d trace%s.\n",
+            argc - optind, argc - optind == 1 ? "" : "s");
+    fprintf(out, " * Requests, in %% of the %.0f between %d and %zu "
+                 "bytes, per range class:\n *\n",
+            total, RANGE_MIN, tree_min - 1);
+    size_t lo = RANGE_MIN;
+    for (int k = 0; k < NUM_RANGE; k++) {
+        double n = 0.0;
+        for (size_t s = lo; s < bounds[k]; s += DSIZE) {
+            n += counts[s / DSIZE];
+        }
+        if (bounds[k] > lo) {
+            fprintf(out, " *   %5zu to %5zu  %5.1f%%\n", lo, bounds[k] - 1,
+                    total > 0.0 ? 100.0 * n / total : 0.0);
+        }
+        lo = bounds[k];
+    }
+    fprintf(out, " */\n\n#ifndef MM_SIZECLASSES_H_\n"
+                 "#define MM_SIZECLASSES_H_ 1\n\n");
+    for (int k = 0; k < NUM_RANGE; k++) {
+        fprintf(out, "#define RANGE_CLASS_BOUND_%d %zu\n", FIRST_RANGE + 1 + k,
+                bounds[k]);
+    }
+    fprintf(out, "\n#endif /* sizeclasses.h */\n");
+
+    if (out != stdout && fclose(out) != 0) {
+        perror(outname);
+        return 1;
+    }
+    return 0;
+}
@@ -10,6 +10,7 @@
  */
 
 #define _XOPEN_SOURCE 700
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -63,9 +64,9 @@ double mhz(int verbose) {
     return val;
 }
 
-/* Use nanosecond timer */
-struct timespec last_time;
-struct timespec new_time;
+/* Use nanosecond timer, one per thread */
+static _Thread_local struct timespec last_time;
+static _Thread_local struct timespec new_time;
 
 /* Use thread clock */
 #define CLKT CLOCK_THREAD_CPUTIME_ID
@@ -106,3 +107,55 @@ double get_counter(void) {
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/* Use the time stamp counter where the processor has one */
+unsigned long long get_stamp(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL +
+           (unsigned long long)now.tv_nsec;
+#endif
+}
+
+/* Count ticks over 10 ms of the monotonic clock */
+#define STAMP_CALIBRATE_NSECS 10000000LL
+
+double stamp_nsecs(void) {
+    static double nsecs = 0.0;
+    if (nsecs == 0.0) {
+        struct timespec start, now;
+        long long elapsed;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        unsigned long long first = get_stamp();
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (long long)(now.tv_sec - start.tv_sec) * 1000000000LL +
+                      (long long)(now.tv_nsec - start.tv_nsec);
+        } while (elapsed < STAMP_CALIBRATE_NSECS);
+        unsigned long long ticks = get_stamp() - first;
+        nsecs = (ticks == 0) ? 1.0 : (double)elapsed / (double)ticks;
+    }
+    return nsecs;
+}
+
+/* Take the best of this many back-to-back pairs */
+#define STAMP_OVERHEAD_PAIRS 1000
+
+unsigned long long stamp_overhead(void) {
+    static bool measured = false;
+    static unsigned long long overhead;
+    if (!measured) {
+        overhead = ~0ULL;
+        for (int i = 0; i < STAMP_OVERHEAD_PAIRS; i++) {
+            unsigned long long start = get_stamp();
+            unsigned long long ticks = get_stamp() - start;
+            if (ticks < overhead)
+                overhead = ticks;
+        }
+        measured = true;
+    }
+    return overhead;
+}
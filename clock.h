@@ -23,4 +23,15 @@ void start_counter(void);
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter(void);
 
+/* Stamps: time stamps cheap enough to time a single short call */
+/* Read the time stamp counter, or a nanosecond clock where there is none */
+unsigned long long get_stamp(void);
+
+/* Nanoseconds per stamp tick, measured against the clock on first use */
+double stamp_nsecs(void);
+
+/* Fewest ticks between two back-to-back get_stamp calls, to subtract from
+   each timed call.  Measured on first use */
+unsigned long long stamp_overhead(void);
+
 #endif
@@ -115,17 +115,32 @@
 #define MAXFILL 2048
 #define MAXFILL_SPARSE 1024
 
+/*
+ * Untimed runs of each trace before the timed runs of mdriver -B
+ */
+#define BENCH_WARMUP 3
+
 /*
  * Alignment requirement in bytes (either 4, 8, or 16)
  */
 #define ALIGNMENT 16
 
+/*
+ * Maximum number of regions from mem_map that can exist at once
+ */
+#define MAX_MAP_REGIONS 4096
+
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
  * Maximum heap size in bytes
  */
 #define MAX_DENSE_HEAP (100 * (1UL << 20)) /* 100 MB */
 
+/*
+ * Size in bytes of the area, just above the heap, for regions from mem_map
+ */
+#define MAX_DENSE_MAP (100 * (1UL << 20)) /* 100 MB */
+
 /*
  * Starting address of the memory allocated for the heap by mmap
  */
@@ -138,6 +153,12 @@
  */
 #define MAX_SPARSE_HEAP (1UL << 62) /* 1 EB */
 
+/*
+ * Size in bytes of the emulated area, just above the heap, for regions
+ * from mem_map
+ */
+#define MAX_SPARSE_MAP (1UL << 62) /* 1 EB */
+
 /*
  * Initial address of emulated heap
  */
@@ -149,9 +170,11 @@
 #define SPARSE_PAGE_SIZE (1 << 10)
 
 /*
- * Maximum target load for hash table
+ * Slots in the page table per page.  The table is open addressed, so it
+ * must stay well below full; it has a power of 2 slots, at least this
+ * many per page.
  */
-#define HASH_LOAD 10.0
+#define PAGE_TABLE_SLOTS 2
 
 /***************** Parameters for looking up reference throughput *********/
 /*
@@ -27,16 +27,17 @@ static unsigned long int min_reps = MIN_REPS;
 static unsigned long int min_ticks = MIN_TICKS;
 static double min_time = 0;
 
-static unsigned long int *cache_buf = NULL;
+/* Each thread samples on its own, so several can time at once */
+static _Thread_local unsigned long int *cache_buf = NULL;
 
-static double *values = NULL;
-static unsigned long int samplecount = 0;
+static _Thread_local double *values = NULL;
+static _Thread_local unsigned long int samplecount = 0;
 
 #define KEEP_VALS 0
 #define KEEP_SAMPLES 0
 
 #if KEEP_SAMPLES
-static double *samples = NULL;
+static _Thread_local double *samples = NULL;
 #endif
 
 /* Initialize the minimum time threshold */
@@ -20,16 +20,26 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <pthread.h>
+#include <sys/wait.h>
+
 #ifdef USE_MSAN
 #include <sanitizer/msan_interface.h>
 #endif
 
+#ifdef THREAD_SAFE
+#include <sched.h>
+#endif
+
+#include "bench.h"
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
@@ -94,6 +104,142 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+/*
+ * Hooks of replay_op, for the replays that keep their blocks elsewhere
+ * than in an array over all ids, or that time each call. Either callback
+ * may be NULL.
+ */
+typedef struct {
+    /* Returns the slot holding the block of an id, claiming one first if
+       claim is set, or NULL if the id has no block */
+    char **(*slot)(void *arg, unsigned int id, bool claim);
+    /* Records the size of the block now in a slot, 0 once it is freed and
+       the slot holds NULL, and returns the size it had before */
+    size_t (*resize)(void *arg, char **slot, size_t size);
+    void *arg;                /* passed to both */
+    bool timed;               /* time each call with get_stamp */
+    unsigned long long ticks; /* stamp ticks of the last call, if timed */
+    size_t size;              /* bytes the last call asked for or freed */
+} op_hooks_t;
+
+/*
+ * Log-bucketed histogram of call latencies, in stamp ticks. Each power of
+ * two is split into LAT_SUB_BUCKETS buckets, so a percentile read from it
+ * is within 25% of the true value.
+ */
+#define LAT_SUB_BITS 2
+#define LAT_SUB_BUCKETS (1u << LAT_SUB_BITS)
+#define LAT_BUCKETS (64u << LAT_SUB_BITS)
+
+typedef struct {
+    unsigned long long count;                /* calls timed */
+    unsigned long long max;                  /* slowest call */
+    unsigned long long buckets[LAT_BUCKETS]; /* calls per latency bucket */
+} histogram_t;
+
+/* Request size classes: up to 16, 32, ..., 64K bytes, and larger */
+#define LAT_MIN_CLASS_BITS 4
+#define LAT_CLASSES 14
+
+/* Number of opcodes in traceopcode_t, and of those that take one size */
+#define LAT_OPS (FREE_BATCH + 1)
+#define LAT_SIZED_OPS (REALLOC + 1)
+
+/* Latencies of one trace's calls, per opcode and per size class */
+typedef struct {
+    histogram_t ops[LAT_OPS];
+    histogram_t classes[LAT_SIZED_OPS][LAT_CLASSES];
+} latency_t;
+
+/* A heap snapshot taken in the utilization pass (-H) */
+typedef struct {
+    unsigned int op;    /* ops replayed before it was taken */
+    size_t live_bytes;  /* bytes the trace had allocated then */
+    mm_snapshot_t snap; /* its page_used is allocated with it */
+} heapsnap_t;
+
+/* Repeated timings of one trace (-B), summarized */
+typedef struct {
+    bench_summary_t secs;                 /* secs per run */
+    bench_summary_t events[BENCH_EVENTS]; /* event counts per run (-E) */
+} bench_t;
+
+/* Ops read from a streamed trace at a time, and timed replays of it
+   after the first (-R) */
+#define STREAM_WINDOW 65536
+#define STREAM_RUNS 3
+#define LIVE_EMPTY UINT_MAX /* id of a free slot of a livemap_t */
+
+/* A live block of a streamed trace. The block comes first, so the slot
+   that replay_op is given is the live_t itself */
+typedef struct {
+    char *block;
+    unsigned int id;
+    size_t size;
+} live_t;
+
+/*
+ * Live blocks of a streamed trace by id, in an open-addressing table with
+ * linear probing. It grows with the live blocks, not with the trace.
+ */
+typedef struct {
+    live_t *slots;
+    size_t mask;  /* number of slots - 1, a power of 2 minus 1 */
+    size_t count; /* live blocks */
+    size_t peak;  /* most live blocks at once */
+} livemap_t;
+
+/* State of a streamed replay */
+typedef struct {
+    op_hooks_t hooks;        /* the live blocks, for replay_op */
+    livemap_t live;
+    traceop_t *ops;          /* the current window of ops */
+    void **batch;            /* scratch pointers for batch requests */
+    unsigned int max_batch;  /* room in batch */
+    size_t total_size;       /* payload bytes live */
+} stream_t;
+
+#ifdef THREAD_SAFE
+/* Runs of each parallel replay, and waits for another thread's operation
+   before a waiting thread yields the CPU */
+#define PAR_RUNS 3
+#define PAR_SPINS 64
+
+/* One operation of one copy of the trace, in a thread's work list */
+typedef struct {
+    unsigned int copy;
+    unsigned int op;
+} par_item_t;
+
+/*
+ * Shared state of a parallel replay. Each operation waits until the
+ * progress count of every block id it touches equals its sequence number
+ * on that id, and bumps the counts once it has run.
+ */
+typedef struct {
+    trace_t *trace;
+    unsigned int threads;
+    unsigned int copies;     /* copies of the trace being replayed */
+    bool shard;              /* one copy, split among the threads by id */
+    unsigned int *seq_start; /* per operation, its first entry in seqs */
+    unsigned int *seqs;      /* sequence numbers on each id touched */
+    unsigned int *progress;  /* operations run per copy and id */
+    char **blocks;           /* block pointers per copy and id */
+    pthread_barrier_t barrier;
+} par_t;
+
+/* A replay thread and its work list */
+typedef struct {
+    par_t *par;
+    pthread_t tid;
+    par_item_t *items;
+    size_t num_items;
+    void **batch; /* scratch pointers for batch requests */
+    double start; /* when the thread started its work list, in secs */
+    double end;   /* and when it finished it */
+} par_thread_t;
+#endif
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set from the trace parameters */
@@ -108,6 +254,16 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    size_t peak_heap;  /* largest heap size in the util pass (0 for libc) */
+    size_t final_heap; /* resident heap bytes after the util pass */
+    size_t sbrk_calls; /* calls of mem_sbrk in the util pass */
+    double sbrk_secs;  /* time spent in mem_sbrk in the util pass */
+    bool has_counters;   /* did mm_get_stats fill in counters? */
+    mm_stats_t counters; /* mm_get_stats at the end of the util pass */
+    latency_t *latency;  /* per-call latencies, if run with -L */
+    heapsnap_t *snaps;   /* heap snapshots, if run with -H */
+    bench_t *bench;      /* repeated timings, if run with -B */
+    size_t num_snaps;
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -120,6 +276,13 @@ typedef struct {
     double tput; /* average throughput expressed in Kops/s */
 } sum_stats_t;
 
+/* The traces of a run, and their stats, shared by the pool's tasks */
+typedef struct {
+    char **tracefiles;
+    trace_t **traces;
+    stats_t *stats;
+} suite_t;
+
 /********************
  * For debugging.  If debug-mode is on, then we have each block start
  * at a "random" place (a hash of the index), and copy random data
@@ -146,6 +309,19 @@ static unsigned int verbose = REF_ONLY ? 0 : 1; /* verbosity level */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool latency_mode = false; /* Time each call of a trace (-L) */
+static bool stream_mode = false;  /* Stream each trace from its file (-R) */
+static unsigned int snap_every = 0; /* Snapshot the heap every n ops (-H) */
+static unsigned int bench_reps = 0; /* Timed runs of each trace (-B) */
+static bool bench_events = false;   /* Count hardware events in them (-E) */
+static const char *bench_json = NULL; /* File to write them to (-J) */
+static int bench_cpu = -1;          /* CPU the runs are pinned to */
+static unsigned bench_mask = 0;     /* Events that could be counted */
+#ifdef THREAD_SAFE
+static unsigned int par_threads = 0; /* Threads replaying at once (-P) */
+static bool par_shard = false;       /* Shard each trace among them (-S) */
+static unsigned int par_cross = 0;   /* Percent of frees moved (-X) */
+#endif
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -201,14 +377,40 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctness, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, size_t tracenum);
+static double eval_mm_util(trace_t *trace, size_t tracenum, stats_t *stats);
+static inline __attribute__((always_inline)) void
+replay_op(const traceop_t *op, char **blocks, void **batch, op_hooks_t *hooks);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_bench(speed_t *params, stats_t *stats);
+static void eval_mm_latency(trace_t *trace, latency_t *latency);
+#ifdef THREAD_SAFE
+static double eval_mm_parallel(trace_t *trace, unsigned int threads,
+                               double *thread_tput);
+static void run_parallel(size_t n, char **tracefiles, stats_t *stats);
+#endif
 static double compute_scaled_score(double value, double min, double max);
 
+/* Routines that run the traces in parallel where they can */
+static void run_pool(size_t n, void (*task)(size_t, void *), void *arg);
+static trace_t **load_traces(size_t n, char **tracefiles);
+static void eval_libc_task(size_t i, void *arg);
+static bool check_trace(trace_t *trace);
+static void check_forked(size_t n, trace_t **traces, stats_t *stats);
+
+/* Routines that replay traces too large to load, from their files */
+static void eval_mm_stream(const char *tracefile, size_t tracenum,
+                           stats_t *stats);
+static void run_streams(size_t n, char **tracefiles, stats_t *stats);
+
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
 static void printresultsdbg(size_t n, stats_t *stats, sum_stats_t *sumstats);
 static void printresultssparse(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void printtracestats(size_t n, stats_t *stats);
+static void printlatency(size_t n, stats_t *stats);
+static void printsnapshots(size_t n, stats_t *stats);
+static void printbench(size_t n, stats_t *stats);
+static void writebenchjson(const char *fname, size_t n, stats_t *stats);
 static void usage(const char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -245,6 +447,7 @@ static void debugTraceStatus(void)
 		case 1: state = "correctness second time"; break;
 		case 2: state = "utilization"; break;
 		case 3: state = "throughput"; break;
+		case 4: state = "latency"; break;
 		default: state = "unknown"; break;
 	}
 	printf("Currently testing %s in trace %s at op %d\n", state, trace_file, trace_line);
@@ -255,7 +458,8 @@ static void debugTraceStatus(void)
  * num_tracefiles, if there's a timeout)
  */
 static void run_tests(size_t num_tracefiles, char **tracefiles,
-                      stats_t *mm_stats, speed_t *speed_params) {
+                      trace_t **traces, stats_t *mm_stats,
+                      speed_t *speed_params) {
     volatile size_t i;
     range_set_t *volatile ranges = 0;
 
@@ -265,9 +469,9 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
         mem_init(sparse_mode);
         ranges = new_range_set();
 
-        // NOTE: If times out, then it will reread the trace file
-
-        trace_t *trace = read_trace(tracefiles[i], verbose);
+        /* The traces were loaded up front; each is freed once run */
+        trace_t *trace = traces[i];
+        traces[i] = NULL;
         mm_stats[i].filename = tracefiles[i];
         mm_stats[i].weight = trace->weight;
         mm_stats[i].ops = trace->num_ops;
@@ -310,7 +514,7 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fflush(stderr);
             }
 			trace_state = 2;
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1) {
@@ -318,9 +522,25 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
                 fflush(stderr);
             }
 			trace_state = 3;
-            mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+            if (sparse_mode)
+                mm_stats[i].secs = 1.0;
+            else if (bench_reps > 0)
+                mm_stats[i].secs = eval_mm_bench(speed_params, &mm_stats[i]);
+            else
+                mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+
+            if (latency_mode && !sparse_mode) {
+                if (verbose > 1) {
+                    fputs(", latency", stderr);
+                    fflush(stderr);
+                }
+                trace_state = 4;
+                mm_stats[i].latency = calloc(1, sizeof(latency_t));
+                if (mm_stats[i].latency == NULL)
+                    unix_error("latency calloc in run_tests failed");
+                eval_mm_latency(trace, mm_stats[i].latency);
+            }
         }
 #endif
         if (verbose > 0) {
@@ -343,6 +563,201 @@ static void run_tests(size_t num_tracefiles, char **tracefiles,
     }
 }
 
+/* Pool of worker threads, handing out task indices in order */
+typedef struct {
+    void (*task)(size_t, void *);
+    void *arg;
+    size_t n;
+    size_t next; /* next task to hand out */
+} pool_t;
+
+/*
+ * pool_worker - thread routine of run_pool. The timeout is left to the
+ *    main thread, which is the one that can jump out of a run.
+ */
+static void *pool_worker(void *ptr) {
+    pool_t *pool = ptr;
+    sigset_t mask;
+    size_t i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+           pool->n)
+        pool->task(i, pool->arg);
+    return NULL;
+}
+
+/*
+ * run_pool - runs task(i, arg) for every i below n, on as many threads
+ *    as there are online CPUs, and returns once all have run. With one
+ *    CPU the tasks run in order on the calling thread.
+ */
+static void run_pool(size_t n, void (*task)(size_t, void *), void *arg) {
+    pool_t pool = {task, arg, n, 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t t, workers = cpus > 1 ? (size_t)cpus : 1;
+
+    if (workers > n)
+        workers = n;
+    if (workers <= 1) {
+        for (size_t i = 0; i < n; i++)
+            task(i, arg);
+        return;
+    }
+
+    pthread_t *tids = calloc(workers, sizeof(pthread_t));
+    if (tids == NULL)
+        unix_error("calloc in run_pool failed");
+    for (t = 0; t < workers; t++)
+        if (pthread_create(&tids[t], NULL, pool_worker, &pool))
+            app_error("pthread_create failed in run_pool");
+    for (t = 0; t < workers; t++)
+        pthread_join(tids[t], NULL);
+    free(tids);
+}
+
+/*
+ * load_task - pool task of load_traces, reading trace i
+ */
+static void load_task(size_t i, void *arg) {
+    suite_t *suite = arg;
+    suite->traces[i] = read_trace(suite->tracefiles[i], verbose);
+}
+
+/*
+ * load_traces - reads the n trace files on the pool, and returns them
+ */
+static trace_t **load_traces(size_t n, char **tracefiles) {
+    suite_t suite = {tracefiles, calloc(n, sizeof(trace_t *)), NULL};
+
+    if (suite.traces == NULL)
+        unix_error("calloc in load_traces failed");
+    run_pool(n, load_task, &suite);
+    return suite.traces;
+}
+
+/*
+ * eval_libc_task - pool task that checks libc malloc on trace i, and if
+ *    it is valid, times it. fsec times each thread on its own CPU clock.
+ */
+static void eval_libc_task(size_t i, void *arg) {
+    suite_t *suite = arg;
+    trace_t *trace = suite->traces[i];
+    stats_t *stats = &suite->stats[i];
+    speed_t speed_params = {trace, NULL};
+
+    stats->filename = suite->tracefiles[i];
+    stats->weight = trace->weight;
+    stats->ops = trace->num_ops;
+    stats->valid = eval_libc_valid(trace);
+    if (stats->valid) {
+        stats->secs = fsec(eval_libc_speed, &speed_params);
+        stats->tput = stats->ops / (stats->secs * 1000.0);
+    }
+    if (verbose > 1) {
+        fprintf(stderr,
+                "[%zu] Checked libc malloc for correctness and performance "
+                "on %s.\n",
+                i, stats->filename);
+        fflush(stderr);
+    }
+}
+
+/*
+ * check_trace - checks mm malloc for correctness on a trace, twice on a
+ *    fresh heap as run_tests does
+ */
+static bool check_trace(trace_t *trace) {
+    range_set_t *ranges;
+    bool ok;
+
+    mem_init(sparse_mode);
+    trace_file = (char *)trace->filename;
+    trace_state = 0;
+    ranges = new_range_set();
+    ok = eval_mm_valid(trace, ranges);
+    free_range_set(ranges);
+
+    trace_state = 1;
+    ranges = new_range_set();
+    ok = ok && eval_mm_valid(trace, ranges);
+    free_range_set(ranges);
+    mem_deinit();
+    return ok;
+}
+
+/*
+ * check_forked - checks each trace with check_trace in a child process of
+ *    its own, as many at a time as there are online CPUs. A trace is valid
+ *    if its child exits with status 0; one that crashes fails alone.
+ */
+static void check_forked(size_t n, trace_t **traces, stats_t *stats) {
+    pid_t *volatile pids = calloc(n, sizeof(pid_t));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t limit = cpus > 1 ? (size_t)cpus : 1;
+    volatile size_t next = 0, running = 0;
+    size_t i;
+    pid_t pid;
+    int status;
+
+    if (pids == NULL)
+        unix_error("calloc in check_forked failed");
+    for (i = 0; i < n; i++) {
+        stats[i].filename = traces[i]->filename;
+        stats[i].weight = traces[i]->weight;
+        stats[i].ops = traces[i]->num_ops;
+    }
+
+    /* On a timeout, the traces not checked yet fail */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        for (i = 0; i < n; i++) {
+            if (pids[i] > 0) {
+                kill(pids[i], SIGKILL);
+                waitpid(pids[i], NULL, 0);
+            }
+        }
+        free(pids);
+        return;
+    }
+
+    while (next < n || running > 0) {
+        if (next < n && running < limit) {
+            fflush(stdout);
+            fflush(stderr);
+            if ((pid = fork()) < 0)
+                unix_error("fork in check_forked failed");
+            if (pid == 0) {
+                bool ok = check_trace(traces[next]);
+                fflush(stdout);
+                fflush(stderr);
+                _exit(ok ? 0 : 1);
+            }
+            pids[next++] = pid;
+            running++;
+            continue;
+        }
+
+        if ((pid = waitpid(-1, &status, 0)) < 0)
+            unix_error("waitpid in check_forked failed");
+        for (i = 0; i < n && pids[i] != pid; i++)
+            ;
+        if (i == n)
+            continue;
+        pids[i] = 0;
+        running--;
+        stats[i].valid = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (!stats[i].valid)
+            errors++;
+        if (WIFSIGNALED(status))
+            fprintf(stderr, "ERROR [trace %s]: killed by signal %d (%s)\n",
+                    stats[i].filename, WTERMSIG(status),
+                    strsignal(WTERMSIG(status)));
+    }
+    free(pids);
+}
+
 /**************
  * Main routine
  **************/
@@ -375,7 +790,7 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDLRTH:B:EJ:P:SX:")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -440,6 +855,51 @@ int main(int argc, char **argv) {
             tab_mode = true;
             break;
 
+        case 'L': /* Time each call */
+            latency_mode = true;
+            break;
+
+        case 'R': /* Stream each trace instead of loading it */
+            stream_mode = true;
+            break;
+
+        case 'H': /* Snapshot the heap every n ops of the util pass */
+            snap_every = atoui_or_usage(optarg, "-H", argv[0]);
+            break;
+
+        case 'B': /* Time each trace n times, after warmup runs */
+            bench_reps = atoui_or_usage(optarg, "-B", argv[0]);
+            break;
+
+        case 'E': /* Count hardware events in those runs */
+            bench_events = true;
+            break;
+
+        case 'J': /* Write those runs to a JSON file */
+            bench_json = optarg;
+            break;
+
+#ifdef THREAD_SAFE
+        case 'P': /* Replay each trace on several threads at once */
+            par_threads = atoui_or_usage(optarg, "-P", argv[0]);
+            break;
+
+        case 'S': /* Shard each trace instead of copying it */
+            par_shard = true;
+            break;
+
+        case 'X': /* Percent of frees that another thread runs */
+            par_cross = atoui_or_usage(optarg, "-X", argv[0]);
+            if (par_cross > 100)
+                app_error("'-X' takes a percentage from 0 to 100");
+            break;
+#else
+        case 'P':
+        case 'S':
+        case 'X':
+            app_error("'-%c' needs the thread-safe driver, mdriver-mt", c);
+#endif
+
         case 'h': /* Print usage message */
             usage(argv[0]);
             exit(0);
@@ -474,6 +934,26 @@ int main(int argc, char **argv) {
         init_random_data();
     }
 
+    /* A streamed trace is never held in memory, so the runs that need
+       all of it cannot be made */
+    if (stream_mode &&
+        (run_libc || onetime_flag || latency_mode || snap_every > 0))
+        app_error("'-R' cannot be combined with '-l', '-c', '-L' or '-H'");
+#ifdef THREAD_SAFE
+    if (stream_mode && par_threads > 0)
+        app_error("'-R' cannot be combined with '-P'");
+    if (bench_reps > 0 && par_threads > 0)
+        app_error("'-B' cannot be combined with '-P'");
+#endif
+    if (bench_reps > 0 && (stream_mode || onetime_flag))
+        app_error("'-B' cannot be combined with '-R' or '-c'");
+    if ((bench_events || bench_json != NULL) && bench_reps == 0)
+        app_error("'-E' and '-J' need '-B'");
+
+    /* Load every trace before running any, on the pool */
+    trace_t **traces =
+        stream_mode ? NULL : load_traces(num_tracefiles, tracefiles);
+
     /* Initialize the timeout */
     if (set_timeout > 0) {
         Signal(SIGALRM, timeout_handler);
@@ -492,34 +972,10 @@ int main(int argc, char **argv) {
         if (libc_stats == NULL)
             unix_error("libc_stats calloc in main failed");
 
-        /* Evaluate the libc malloc package using the K-best scheme */
-        for (size_t i = 0; i < num_tracefiles; i++) {
-            trace_t *trace = read_trace(tracefiles[i], verbose);
-            libc_stats[i].filename = tracefiles[i];
-            libc_stats[i].weight = trace->weight;
-            libc_stats[i].ops = trace->num_ops;
-
-            if (verbose > 1) {
-                fprintf(stderr,
-                        "[%zu/%zu] Checking libc malloc for correctness", i,
-                        num_tracefiles);
-                fflush(stderr);
-            }
-            libc_stats[i].valid = eval_libc_valid(trace);
-            if (libc_stats[i].valid) {
-                speed_params.trace = trace;
-                if (verbose > 1) {
-                    fputs(" and performance", stderr);
-                    fflush(stderr);
-                }
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
-            }
-            free_trace(trace);
-            if (verbose > 1) {
-                fputs(".\n", stderr);
-                fflush(stderr);
-            }
-        }
+        /* Evaluate the libc malloc package using the K-best scheme. Its
+           runs share no state but libc's, so they run on the pool */
+        suite_t suite = {tracefiles, traces, libc_stats};
+        run_pool(num_tracefiles, eval_libc_task, &suite);
 
         /* Display the libc results in a compact table and return the
            summary statistics */
@@ -569,16 +1025,45 @@ int main(int argc, char **argv) {
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_tracefiles, tracefiles, mm_stats, &speed_params);
+    /* Timed runs stay on one CPU, so they keep its caches, and are not
+       moved between CPUs of different speeds. Only this thread is pinned,
+       since the pool's threads were started before */
+    if (bench_reps > 0) {
+        bench_cpu = bench_pin_cpu();
+        if (bench_cpu < 0)
+            fprintf(stderr, "Warning: could not pin the benchmark to a "
+                            "CPU\n");
+        if (bench_events && (bench_mask = bench_events_open()) == 0)
+            fprintf(stderr, "Warning: hardware event counters are not "
+                            "available\n");
+    }
+
+    /* The mm runs share the heap, so they run one at a time, except that
+       several traces given with -c are each checked in a child process */
+    if (stream_mode) {
+        run_streams(num_tracefiles, tracefiles, mm_stats);
+    } else {
+        if (onetime_flag && num_tracefiles > 1)
+            check_forked(num_tracefiles, traces, mm_stats);
+        else
+            run_tests(num_tracefiles, tracefiles, traces, mm_stats,
+                      &speed_params);
+        for (size_t i = 0; i < num_tracefiles; i++)
+            if (traces[i] != NULL)
+                free_trace(traces[i]);
+        free(traces);
+    }
 
     /* Display the mm results in a compact table */
     if (verbose) {
         if (onetime_flag) {
             assert(tracefiles != NULL);
-            bool ok = mm_stats[num_tracefiles - 1].valid;
-            printf("%s: tracefile \"%s\": mm malloc behaves %scorrectly.\n",
-                   ok ? "ok" : "FAIL", tracefiles[num_tracefiles - 1],
-                   ok ? "" : "in");
+            for (size_t i = 0; i < num_tracefiles; i++) {
+                bool ok = mm_stats[i].valid;
+                printf("%s: tracefile \"%s\": mm malloc behaves "
+                       "%scorrectly.\n",
+                       ok ? "ok" : "FAIL", tracefiles[i], ok ? "" : "in");
+            }
         } else {
             puts("\nResults for mm malloc:");
 #if !defined DEBUG
@@ -586,6 +1071,14 @@ int main(int argc, char **argv) {
                 printresults(num_tracefiles, mm_stats, &mm_sum_stats);
             else
                 printresultssparse(num_tracefiles, mm_stats, &mm_sum_stats);
+            if (verbose > 1)
+                printtracestats(num_tracefiles, mm_stats);
+            if (latency_mode)
+                printlatency(num_tracefiles, mm_stats);
+            if (snap_every > 0)
+                printsnapshots(num_tracefiles, mm_stats);
+            if (bench_reps > 0)
+                printbench(num_tracefiles, mm_stats);
 #else
             printresultsdbg(num_tracefiles, mm_stats, &mm_sum_stats);
 #endif
@@ -600,6 +1093,16 @@ int main(int argc, char **argv) {
                (float)(mm_sum_stats.tput / libc_sum_stats.tput));
     }
 
+    if (bench_json != NULL)
+        writebenchjson(bench_json, num_tracefiles, mm_stats);
+    bench_events_close();
+
+#ifdef THREAD_SAFE
+    /* Optionally measure how the traces scale on several threads */
+    if (par_threads > 0 && !onetime_flag && !sparse_mode)
+        run_parallel(num_tracefiles, tracefiles, mm_stats);
+#endif
+
     /* temporaries used to compute the performance index */
     double avg_mm_util = 0.0;
     double avg_mm_harm_throughput = 0.0;
@@ -662,7 +1165,7 @@ int main(int argc, char **argv) {
         perfindex_checkpoint = 0.0;
         printf("Terminated with %d errors\n", errors);
 
-    } else if (num_tracefiles > 1) {
+    } else if (num_tracefiles > 1 && !onetime_flag) {
         /* p1 - utilization */
         p1 = UTIL_WEIGHT *
              compute_scaled_score(avg_mm_util, MIN_SPACE, MAX_SPACE);
@@ -794,9 +1297,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within a
+       region mapped with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, size)) {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      (void *)lo, (void *)hi, (void *)mem_heap_lo(),
                      (void *)mem_heap_hi());
@@ -987,8 +1492,8 @@ static bool check_index(const trace_t *trace, unsigned int opnum,
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
-    unsigned int i;
-    unsigned int index;
+    unsigned int i, k;
+    unsigned int index, count;
     size_t size;
     char *newp;
     char *oldp;
@@ -1008,6 +1513,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++) {
         index = trace->ops[i].index;
+        count = trace->ops[i].count;
         size = trace->ops[i].size;
 		trace_line = i;
 
@@ -1119,6 +1625,37 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             mm_free(p);
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+            /* Call the student's batch malloc */
+            if (mm_malloc_batch(size, count, trace->batch) != count) {
+                malloc_error(trace, i, "mm_malloc_batch failed");
+                return false;
+            }
+
+            /* Check and remember each block, as for mm_malloc */
+            for (k = 0; k < count; k++) {
+                p = trace->batch[k];
+                if (add_range(ranges, p, size, trace, i, index + k) == 0)
+                    return false;
+                trace->blocks[index + k] = p;
+                trace->block_sizes[index + k] = size;
+                randomize_block(trace, index + k);
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            for (k = 0; k < count; k++) {
+                if (!check_index(trace, i, index + k)) {
+                    allCheck = false;
+                }
+                p = trace->blocks[index + k];
+                remove_range(ranges, p);
+                trace->batch[k] = p;
+            }
+            mm_free_batch(trace->batch, count);
+            break;
+
         default:
             app_error("Invalid request type in eval_mm_valid");
         }
@@ -1127,21 +1664,45 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
     return allCheck;
 }
 
+/*
+ * take_snapshot - adds a snapshot of the heap, after op ops of the trace
+ *    with live_bytes allocated, to the trace's stats. A package that
+ *    cannot walk its heap gets none.
+ */
+static void take_snapshot(stats_t *stats, unsigned int op,
+                          size_t live_bytes) {
+    size_t max_pages = mem_heapsize() / mem_pagesize() + 1;
+    unsigned *pages = calloc(max_pages, sizeof(unsigned));
+    if (pages == NULL)
+        unix_error("page map calloc in take_snapshot failed");
+
+    heapsnap_t hs = {op, live_bytes, {.page_used = pages,
+                                      .max_pages = max_pages}};
+    if (!mm_get_snapshot(&hs.snap)) {
+        free(pages);
+        return;
+    }
+    stats->snaps =
+        realloc(stats->snaps, (stats->num_snaps + 1) * sizeof(heapsnap_t));
+    if (stats->snaps == NULL)
+        unix_error("snapshot realloc in take_snapshot failed");
+    stats->snaps[stats->num_snaps++] = hs;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size the heap reached while running the student's malloc
+ *   package on the trace.  The heap may shrink again, so the peak and
+ *   the final resident heap size are also recorded in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, size_t tracenum) {
-    unsigned int i;
-    unsigned int index;
+static double eval_mm_util(trace_t *trace, size_t tracenum, stats_t *stats) {
+    unsigned int i, k;
+    unsigned int index, count;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
@@ -1210,6 +1771,35 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
             total_size -= size;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            size = trace->ops[i].size;
+
+            if (mm_malloc_batch(size, count, trace->batch) != count) {
+                app_error("trace %zd: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember regions and sizes */
+            for (k = 0; k < count; k++) {
+                trace->blocks[index + k] = trace->batch[k];
+                trace->block_sizes[index + k] = size;
+                total_size += size;
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            for (k = 0; k < count; k++) {
+                trace->batch[k] = trace->blocks[index + k];
+                total_size -= trace->block_sizes[index + k];
+            }
+
+            mm_free_batch(trace->batch, count);
+            break;
+
         default:
             app_error("trace %zd: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1218,9 +1808,145 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
         /* update the high-water mark */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
+
+        if (snap_every > 0 && (i + 1) % snap_every == 0)
+            take_snapshot(stats, i + 1, total_size);
+    }
+    if (snap_every > 0 && trace->num_ops % snap_every != 0)
+        take_snapshot(stats, trace->num_ops, total_size);
+
+    stats->peak_heap = mem_heap_peak();
+    stats->final_heap = mem_resident();
+    stats->sbrk_calls = mem_sbrk_calls();
+    stats->sbrk_secs = mem_sbrk_secs();
+    stats->has_counters = mm_get_stats(&stats->counters);
+    return ((double)max_total_size / (double)stats->peak_heap);
+}
+
+/*
+ * op_slot - returns the slot of the block of an id, from the hooks if
+ *    they keep the blocks and from the array of blocks otherwise
+ */
+static inline char **op_slot(op_hooks_t *hooks, char **blocks,
+                             unsigned int id, bool claim) {
+    if (hooks != NULL && hooks->slot != NULL)
+        return hooks->slot(hooks->arg, id, claim);
+    return &blocks[id];
+}
+
+/*
+ * op_resize - tells the hooks the size of the block now in a slot, and
+ *    returns the size it had, 0 if they do not keep sizes
+ */
+static inline size_t op_resize(op_hooks_t *hooks, char **slot, size_t size) {
+    if (hooks != NULL && hooks->resize != NULL)
+        return hooks->resize(hooks->arg, slot, size);
+    return 0;
+}
+
+/*
+ * op_start, op_stop - read the stamps around a call to the mm malloc
+ *    package if the hooks time calls
+ */
+static inline unsigned long long op_start(const op_hooks_t *hooks) {
+    return (hooks != NULL && hooks->timed) ? get_stamp() : 0;
+}
+
+static inline void op_stop(op_hooks_t *hooks, unsigned long long start) {
+    if (hooks != NULL && hooks->timed)
+        hooks->ticks = get_stamp() - start;
+}
+
+/*
+ * replay_op - Runs one trace operation on the mm malloc package. This is
+ *    the request interpreter of every replay that does no checking. The
+ *    blocks are kept in blocks, indexed by id, unless hooks says where;
+ *    batch has room for the largest batch. With hooks, only the call to
+ *    the package itself is timed. It is always inlined, so the timed
+ *    replays, which pass no hooks, pay nothing for them.
+ */
+static inline __attribute__((always_inline)) void
+replay_op(const traceop_t *op, char **blocks, void **batch, op_hooks_t *hooks) {
+    unsigned int k;
+    unsigned long long start;
+    size_t size = op->size;
+    char **slot;
+    char *p;
+
+    switch (op->type) {
+
+    case ALLOC: /* mm_malloc */
+        slot = op_slot(hooks, blocks, op->index, true);
+        start = op_start(hooks);
+        p = mm_malloc(op->size);
+        op_stop(hooks, start);
+        if (p == NULL)
+            app_error("mm_malloc error in replay_op");
+        *slot = p;
+        op_resize(hooks, slot, op->size);
+        break;
+
+    case REALLOC: /* mm_realloc */
+        slot = op_slot(hooks, blocks, op->index, true);
+        setUBCheck(false);
+        start = op_start(hooks);
+        p = mm_realloc(*slot, op->size);
+        op_stop(hooks, start);
+        if (p == NULL && op->size != 0)
+            app_error("mm_realloc error in replay_op");
+        setUBCheck(true);
+        *slot = p;
+        op_resize(hooks, slot, op->size);
+        break;
+
+    case FREE: /* mm_free */
+        slot = NULL;
+        if (op->index != (unsigned int)-1)
+            slot = op_slot(hooks, blocks, op->index, false);
+        p = (slot == NULL) ? NULL : *slot;
+        start = op_start(hooks);
+        mm_free(p);
+        op_stop(hooks, start);
+        size = 0;
+        if (slot != NULL) {
+            *slot = NULL;
+            size = op_resize(hooks, slot, 0);
+        }
+        break;
+
+    case ALLOC_BATCH: /* mm_malloc_batch */
+        start = op_start(hooks);
+        if (mm_malloc_batch(op->size, op->count, batch) != op->count)
+            app_error("mm_malloc_batch error in replay_op");
+        op_stop(hooks, start);
+        for (k = 0; k < op->count; k++) {
+            slot = op_slot(hooks, blocks, op->index + k, true);
+            *slot = batch[k];
+            op_resize(hooks, slot, op->size);
+        }
+        break;
+
+    case FREE_BATCH: /* mm_free_batch */
+        for (k = 0; k < op->count; k++) {
+            slot = op_slot(hooks, blocks, op->index + k, false);
+            batch[k] = NULL;
+            if (slot != NULL) {
+                batch[k] = *slot;
+                *slot = NULL;
+                op_resize(hooks, slot, 0);
+            }
+        }
+        start = op_start(hooks);
+        mm_free_batch(batch, op->count);
+        op_stop(hooks, start);
+        break;
+
+    default:
+        app_error("Nonexistent request type in replay_op");
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (hooks != NULL)
+        hooks->size = size;
 }
 
 /*
@@ -1228,9 +1954,7 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr) {
-    unsigned int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
+    unsigned int i;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1242,43 +1966,697 @@ static void eval_mm_speed(void *ptr) {
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++) {
 		trace_line = i;
-        switch (trace->ops[i].type) {
+        replay_op(&trace->ops[i], trace->blocks, trace->batch, NULL);
+	}
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * eval_mm_bench - Times bench_reps runs of eval_mm_speed, after
+ *    BENCH_WARMUP untimed ones, counting hardware events in each if -E
+ *    opened them. Summarizes them in stats and returns the median secs.
+ */
+static double eval_mm_bench(speed_t *params, stats_t *stats) {
+    unsigned int r, w;
+    int e;
+    uint64_t counts[BENCH_EVENTS];
+
+    for (w = 0; w < BENCH_WARMUP; w++)
+        eval_mm_speed(params);
+
+    double *secs = calloc(bench_reps, sizeof(double));
+    double *events = calloc((size_t)bench_reps * BENCH_EVENTS, sizeof(double));
+    stats->bench = calloc(1, sizeof(bench_t));
+    if (secs == NULL || events == NULL || stats->bench == NULL)
+        unix_error("calloc in eval_mm_bench failed");
+
+    for (r = 0; r < bench_reps; r++) {
+        bench_events_start();
+        start_timer();
+        eval_mm_speed(params);
+        secs[r] = get_timer();
+        bench_events_stop(counts);
+        for (e = 0; e < BENCH_EVENTS; e++)
+            events[(size_t)e * bench_reps + r] = (double)counts[e];
+    }
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
-            break;
+    bench_summarize(secs, bench_reps, &stats->bench->secs);
+    for (e = 0; e < BENCH_EVENTS; e++)
+        bench_summarize(&events[(size_t)e * bench_reps], bench_reps,
+                        &stats->bench->events[e]);
+    free(secs);
+    free(events);
+    return stats->bench->secs.median;
+}
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index == (unsigned int)-1) {
-                block = 0;
-            } else {
-                block = trace->blocks[index];
-            }
-            mm_free(block);
-            break;
+/*
+ * latency_bucket - Returns the histogram bucket of a latency: the
+ *    latency itself while it is small, and otherwise its power of two
+ *    together with the LAT_SUB_BITS bits after the leading one.
+ */
+static unsigned int latency_bucket(unsigned long long ticks) {
+    if (ticks < LAT_SUB_BUCKETS)
+        return (unsigned int)ticks;
+    unsigned int msb = 63u - (unsigned int)__builtin_clzll(ticks);
+    unsigned int sub =
+        (unsigned int)(ticks >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
 
-        default:
-            app_error("Nonexistent request type in eval_mm_speed");
-        }
-	}
+/*
+ * latency_bucket_max - Returns the largest latency that falls in a
+ *    histogram bucket, the inverse of latency_bucket.
+ */
+static unsigned long long latency_bucket_max(unsigned int bucket) {
+    if (bucket < LAT_SUB_BUCKETS)
+        return bucket;
+    unsigned int shift = (bucket >> LAT_SUB_BITS) - 1;
+    unsigned long long lo = (unsigned long long)(LAT_SUB_BUCKETS +
+                                                 (bucket & (LAT_SUB_BUCKETS - 1)))
+                            << shift;
+    return lo + (1ULL << shift) - 1;
 }
 
+/*
+ * add_latency - Records one call in a histogram.
+ */
+static void add_latency(histogram_t *hist, unsigned long long ticks) {
+    hist->count++;
+    hist->buckets[latency_bucket(ticks)]++;
+    if (ticks > hist->max)
+        hist->max = ticks;
+}
+
+/*
+ * latency_class - Returns the size class of a request.
+ */
+static unsigned int latency_class(size_t size) {
+    unsigned int bits = LAT_MIN_CLASS_BITS;
+    while (bits < LAT_MIN_CLASS_BITS + LAT_CLASSES - 1 &&
+           size > ((size_t)1 << bits))
+        bits++;
+    return bits - LAT_MIN_CLASS_BITS;
+}
+
+/*
+ * latency_resize - resize hook of the latency pass, which keeps the size
+ *    of each block so that a free is classed by the size it frees
+ */
+static size_t latency_resize(void *arg, char **slot, size_t size) {
+    trace_t *trace = arg;
+    size_t *old = &trace->block_sizes[slot - trace->blocks];
+    size_t was = *old;
+    *old = size;
+    return was;
+}
+
+/*
+ * eval_mm_latency - Replays a trace once, timing each call to the mm
+ *    malloc package with get_stamp. As with fcyc's compensation for timer
+ *    overhead, the cost of reading the stamps themselves is subtracted
+ *    from every call.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *latency) {
+    unsigned int i;
+    unsigned long long ticks;
+    unsigned long long overhead = stamp_overhead();
+    op_hooks_t hooks = {NULL, latency_resize, trace, true, 0, 0};
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    /* Interpret each trace request */
+    for (i = 0; i < trace->num_ops; i++) {
+        trace_line = i;
+        traceopcode_t type = trace->ops[i].type;
+        replay_op(&trace->ops[i], trace->blocks, trace->batch, &hooks);
+
+        ticks = (hooks.ticks > overhead) ? hooks.ticks - overhead : 0;
+        add_latency(&latency->ops[type], ticks);
+        if (type < LAT_SIZED_OPS)
+            add_latency(&latency->classes[type][latency_class(hooks.size)],
+                        ticks);
+    }
+}
+
+/*
+ * live_slot - returns the first slot to probe for a block id
+ */
+static size_t live_slot(const livemap_t *map, unsigned int id) {
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 32) & map->mask;
+}
+
+/*
+ * live_init - sets up an empty table of live blocks with room for slots
+ *    blocks, a power of 2
+ */
+static void live_init(livemap_t *map, size_t slots) {
+    map->slots = malloc(slots * sizeof(live_t));
+    if (map->slots == NULL)
+        unix_error("malloc in live_init failed");
+    for (size_t i = 0; i < slots; i++)
+        map->slots[i].id = LIVE_EMPTY;
+    map->mask = slots - 1;
+    map->count = 0;
+    map->peak = 0;
+}
+
+/*
+ * live_find - returns the live block with an id, or NULL
+ */
+static live_t *live_find(livemap_t *map, unsigned int id) {
+    for (size_t i = live_slot(map, id);; i = (i + 1) & map->mask) {
+        if (map->slots[i].id == id)
+            return &map->slots[i];
+        if (map->slots[i].id == LIVE_EMPTY)
+            return NULL;
+    }
+}
+
+/*
+ * live_add - returns the slot of a block id, claiming one if it is not
+ *    live. The table doubles once it is half full.
+ */
+static live_t *live_add(livemap_t *map, unsigned int id) {
+    if (2 * (map->count + 1) > map->mask + 1) {
+        livemap_t old = *map;
+        live_init(map, 2 * (old.mask + 1));
+        map->peak = old.peak;
+        for (size_t i = 0; i <= old.mask; i++)
+            if (old.slots[i].id != LIVE_EMPTY)
+                *live_add(map, old.slots[i].id) = old.slots[i];
+        free(old.slots);
+    }
+
+    size_t i = live_slot(map, id);
+    while (map->slots[i].id != id && map->slots[i].id != LIVE_EMPTY)
+        i = (i + 1) & map->mask;
+    if (map->slots[i].id == LIVE_EMPTY) {
+        map->slots[i].id = id;
+        map->slots[i].block = NULL;
+        map->slots[i].size = 0;
+        if (++map->count > map->peak)
+            map->peak = map->count;
+    }
+    return &map->slots[i];
+}
+
+/*
+ * live_remove - frees the slot of a live block. The blocks probed past it
+ *    are shifted back, so no probe ever stops short of its block.
+ */
+static void live_remove(livemap_t *map, live_t *slot) {
+    size_t hole = (size_t)(slot - map->slots);
+    size_t i = hole;
+
+    for (;;) {
+        i = (i + 1) & map->mask;
+        if (map->slots[i].id == LIVE_EMPTY)
+            break;
+        /* A block may fill the hole if the hole lies on its probe path */
+        size_t home = live_slot(map, map->slots[i].id);
+        if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+    map->slots[hole].id = LIVE_EMPTY;
+    map->count--;
+}
+
+/*
+ * stream_slot - slot hook of a streamed replay: the block of an id is
+ *    found in the table of live blocks, or added to it
+ */
+static char **stream_slot(void *arg, unsigned int id, bool claim) {
+    stream_t *stream = arg;
+    live_t *live = claim ? live_add(&stream->live, id)
+                         : live_find(&stream->live, id);
+    return (live == NULL) ? NULL : &live->block;
+}
+
+/*
+ * stream_resize - resize hook of a streamed replay. Keeps the payload
+ *    bytes live, as eval_mm_util does, and drops a block from the table
+ *    once it is gone.
+ */
+static size_t stream_resize(void *arg, char **slot, size_t size) {
+    stream_t *stream = arg;
+    live_t *live = (live_t *)slot;
+    size_t was = live->size;
+    stream->total_size += size - was;
+    live->size = size;
+    if (live->block == NULL)
+        live_remove(&stream->live, live);
+    return was;
+}
+
+/*
+ * stream_replay - Replays a trace once from its file, STREAM_WINDOW ops
+ *    at a time, without loading it, and measures utilization as
+ *    eval_mm_util does. Returns the secs spent in the calls to the mm
+ *    malloc package, from replay_op's stamps less their own overhead, as
+ *    in eval_mm_latency; reading the trace and keeping the table of live
+ *    blocks are not counted.
+ */
+static double stream_replay(const char *tracefile, size_t tracenum,
+                            stats_t *stats) {
+    trace_t header;
+    trace_stream_t *file = open_trace_stream(tracefile, verbose, &header);
+    stream_t stream;
+    size_t max_total_size = 0;
+    unsigned int i, n, done = 0;
+    unsigned long long ticks = 0;
+    unsigned long long overhead = stamp_overhead();
+
+    stats->filename = tracefile;
+    stats->weight = header.weight;
+    stats->ops = header.num_ops;
+
+    stream.hooks = (op_hooks_t){stream_slot, stream_resize, &stream, true,
+                                0, 0};
+    live_init(&stream.live, 1024);
+    stream.ops = malloc(STREAM_WINDOW * sizeof(traceop_t));
+    if (stream.ops == NULL)
+        unix_error("malloc in stream_replay failed");
+    stream.batch = NULL;
+    stream.max_batch = 0;
+    stream.total_size = 0;
+
+    /* initialize the heap and the mm malloc package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %zd: mm_init failed in stream_replay", tracenum);
+
+    while ((n = read_trace_window(file, stream.ops, STREAM_WINDOW)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (stream.ops[i].type == ALLOC_BATCH ||
+                stream.ops[i].type == FREE_BATCH) {
+                if (stream.ops[i].count > stream.max_batch) {
+                    stream.max_batch = stream.ops[i].count;
+                    free(stream.batch);
+                    stream.batch = malloc(stream.max_batch * sizeof(void *));
+                    if (stream.batch == NULL)
+                        unix_error("malloc in stream_replay failed");
+                }
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            trace_line = done + i;
+            replay_op(&stream.ops[i], NULL, stream.batch, &stream.hooks);
+            if (stream.hooks.ticks > overhead)
+                ticks += stream.hooks.ticks - overhead;
+            if (stream.total_size > max_total_size)
+                max_total_size = stream.total_size;
+        }
+        done += n;
+    }
+
+    stats->valid = true;
+    stats->peak_heap = mem_heap_peak();
+    stats->final_heap = mem_resident();
+    stats->sbrk_calls = mem_sbrk_calls();
+    stats->sbrk_secs = mem_sbrk_secs();
+    stats->has_counters = mm_get_stats(&stats->counters);
+    stats->util = (double)max_total_size / (double)stats->peak_heap;
+    if (verbose > 2)
+        fprintf(stderr, " %u operations.  %zu blocks live at most.", done,
+                stream.live.peak);
+
+    free(stream.live.slots);
+    free(stream.ops);
+    free(stream.batch);
+    close_trace_stream(file);
+    return (double)ticks * stamp_nsecs() * 1e-9;
+}
+
+/*
+ * eval_mm_stream - Streams a trace with stream_replay once untimed, to
+ *    warm up, and then STREAM_RUNS times, taking the fastest run as fsec
+ *    takes its fastest sample. There is no correctness check; the blocks
+ *    are not filled or compared. In sparse mode it runs once, untimed.
+ */
+static void eval_mm_stream(const char *tracefile, size_t tracenum,
+                           stats_t *stats) {
+    double secs = stream_replay(tracefile, tracenum, stats);
+
+    if (sparse_mode) {
+        stats->secs = 1.0;
+    } else {
+        stats->secs = DBL_MAX;
+        for (unsigned int r = 0; r < STREAM_RUNS; r++) {
+            secs = stream_replay(tracefile, tracenum, stats);
+            if (secs < stats->secs)
+                stats->secs = secs;
+        }
+    }
+    stats->tput = stats->ops / (stats->secs * 1000.0);
+}
+
+/*
+ * run_streams - replays each trace from its file with eval_mm_stream
+ */
+static void run_streams(size_t n, char **tracefiles, stats_t *stats) {
+    for (size_t i = 0; i < n; i++) {
+        mem_init(sparse_mode);
+        trace_file = tracefiles[i];
+        trace_state = 3;
+        if (verbose > 1) {
+            fprintf(stderr, "[%zu/%zu] Streaming mm malloc", i, n);
+            fflush(stderr);
+        }
+        eval_mm_stream(tracefiles[i], i, &stats[i]);
+        if (verbose > 0) {
+            putc('.', stderr);
+            if (verbose > 1)
+                putc('\n', stderr);
+            fflush(stderr);
+        }
+        mem_deinit();
+    }
+}
+
+#ifdef THREAD_SAFE
+/*
+ * par_now - returns the monotonic clock in secs
+ */
+static double par_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/*
+ * par_touched - returns the number of block ids that operation i of a
+ *    trace touches, from trace->ops[i].index on
+ */
+static unsigned int par_touched(const trace_t *trace, unsigned int i) {
+    const traceop_t *op = &trace->ops[i];
+    if (op->type == ALLOC_BATCH || op->type == FREE_BATCH)
+        return op->count;
+    if (op->type == FREE && op->index == (unsigned int)-1)
+        return 0;
+    return 1;
+}
+
+/*
+ * par_is_cross - decides whether the free at operation i of a copy runs
+ *    on the next thread instead of its owner. The choice is a hash of
+ *    both, so every run and every thread count frees the same blocks.
+ */
+static bool par_is_cross(unsigned int copy, unsigned int i) {
+    unsigned int h = i * 2654435761u ^ (copy + 1) * 40503u;
+    h ^= h >> 15;
+    h *= 2246822519u;
+    h ^= h >> 13;
+    return h % 100 < par_cross;
+}
+
+/*
+ * par_owner - returns the thread that runs operation i of a copy of the
+ *    trace: the copy's own thread, or in shard mode the thread of the
+ *    operation's first block id. Cross-thread frees go to the next one.
+ */
+static unsigned int par_owner(const par_t *par, unsigned int copy,
+                              unsigned int i) {
+    const traceop_t *op = &par->trace->ops[i];
+    unsigned int owner;
+
+    if (!par->shard)
+        owner = copy;
+    else if (op->index == (unsigned int)-1)
+        owner = i % par->threads;
+    else
+        owner = op->index % par->threads;
+
+    if ((op->type == FREE || op->type == FREE_BATCH) &&
+        par_is_cross(copy, i))
+        owner = (owner + 1) % par->threads;
+    return owner;
+}
+
+/*
+ * par_prepare - splits the operations of par->copies copies of a trace
+ *    among par->threads threads, and numbers the operations on each
+ *    block id so the threads can wait for each other's
+ */
+static void par_prepare(par_t *par, par_thread_t *threads) {
+    trace_t *trace = par->trace;
+    unsigned int i, k, t, copy, index, count, total = 0;
+    unsigned int *next_seq;
+
+    par->seq_start = malloc(trace->num_ops * sizeof(unsigned int));
+    next_seq = calloc(trace->num_ids, sizeof(unsigned int));
+    if (par->seq_start == NULL || next_seq == NULL)
+        unix_error("malloc in par_prepare failed");
+    for (i = 0; i < trace->num_ops; i++) {
+        par->seq_start[i] = total;
+        total += par_touched(trace, i);
+    }
+    par->seqs = malloc((total + 1) * sizeof(unsigned int));
+    if (par->seqs == NULL)
+        unix_error("malloc in par_prepare failed");
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        count = par_touched(trace, i);
+        for (k = 0; k < count; k++)
+            par->seqs[par->seq_start[i] + k] = next_seq[index + k]++;
+    }
+    free(next_seq);
+
+    size_t slots = (size_t)par->copies * trace->num_ids;
+    par->progress = malloc(slots * sizeof(unsigned int));
+    par->blocks = malloc(slots * sizeof(char *));
+    if (par->progress == NULL || par->blocks == NULL)
+        unix_error("malloc in par_prepare failed");
+
+    /* Deal the operations out in trace order, so each thread's list is
+       sorted by operation and the waits cannot form a cycle */
+    for (t = 0; t < par->threads; t++) {
+        threads[t].par = par;
+        threads[t].num_items = 0;
+    }
+    for (i = 0; i < trace->num_ops; i++)
+        for (copy = 0; copy < par->copies; copy++)
+            threads[par_owner(par, copy, i)].num_items++;
+    for (t = 0; t < par->threads; t++) {
+        threads[t].items = malloc(threads[t].num_items * sizeof(par_item_t));
+        threads[t].batch = malloc(trace->max_batch * sizeof(void *));
+        if (threads[t].items == NULL || threads[t].batch == NULL)
+            unix_error("malloc in par_prepare failed");
+        threads[t].num_items = 0;
+    }
+    for (i = 0; i < trace->num_ops; i++) {
+        for (copy = 0; copy < par->copies; copy++) {
+            par_thread_t *thread = &threads[par_owner(par, copy, i)];
+            thread->items[thread->num_items].copy = copy;
+            thread->items[thread->num_items].op = i;
+            thread->num_items++;
+        }
+    }
+}
+
+/*
+ * par_release - frees what par_prepare allocated
+ */
+static void par_release(par_t *par, par_thread_t *threads) {
+    for (unsigned int t = 0; t < par->threads; t++) {
+        free(threads[t].items);
+        free(threads[t].batch);
+    }
+    free(par->seq_start);
+    free(par->seqs);
+    free(par->progress);
+    free(par->blocks);
+}
+
+/*
+ * par_replay - thread routine of eval_mm_parallel. Runs the thread's
+ *    operations with replay_op, each once the operations before it on the
+ *    same block ids have run, on whichever thread.
+ */
+static void *par_replay(void *ptr) {
+    par_thread_t *thread = ptr;
+    par_t *par = thread->par;
+    const trace_t *trace = par->trace;
+    unsigned int k, spins;
+
+    pthread_barrier_wait(&par->barrier);
+    thread->start = par_now();
+
+    for (size_t n = 0; n < thread->num_items; n++) {
+        unsigned int i = thread->items[n].op;
+        size_t base = (size_t)thread->items[n].copy * trace->num_ids;
+        unsigned int *progress = par->progress + base + trace->ops[i].index;
+        const unsigned int *seqs = par->seqs + par->seq_start[i];
+        unsigned int count = par_touched(trace, i);
+
+        for (k = 0; k < count; k++) {
+            spins = 0;
+            while (__atomic_load_n(&progress[k], __ATOMIC_ACQUIRE) != seqs[k])
+                if (++spins % PAR_SPINS == 0)
+                    sched_yield();
+        }
+        replay_op(&trace->ops[i], par->blocks + base, thread->batch, NULL);
+        for (k = 0; k < count; k++)
+            __atomic_store_n(&progress[k], seqs[k] + 1, __ATOMIC_RELEASE);
+    }
+
+    thread->end = par_now();
+    return NULL;
+}
+
+/*
+ * eval_mm_parallel - replays copies of a trace, or shards of one copy,
+ *    on threads threads against a fresh heap, PAR_RUNS times. Returns
+ *    the best wall time, and sets each thread's throughput in that run.
+ */
+static double eval_mm_parallel(trace_t *trace, unsigned int threads,
+                               double *thread_tput) {
+    par_t par;
+    par_thread_t *thread = calloc(threads, sizeof(par_thread_t));
+    double start, end, best = DBL_MAX;
+    unsigned int run, t;
+
+    if (thread == NULL)
+        unix_error("calloc in eval_mm_parallel failed");
+    par.trace = trace;
+    par.threads = threads;
+    par.shard = par_shard;
+    par.copies = par_shard ? 1 : threads;
+    par_prepare(&par, thread);
+
+    for (run = 0; run < PAR_RUNS; run++) {
+        size_t slots = (size_t)par.copies * trace->num_ids;
+        memset(par.progress, 0, slots * sizeof(unsigned int));
+        memset(par.blocks, 0, slots * sizeof(char *));
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_parallel");
+
+        pthread_barrier_init(&par.barrier, NULL, threads + 1);
+        for (t = 0; t < threads; t++)
+            if (pthread_create(&thread[t].tid, NULL, par_replay, &thread[t]))
+                app_error("pthread_create failed in eval_mm_parallel");
+        pthread_barrier_wait(&par.barrier);
+        for (t = 0; t < threads; t++)
+            pthread_join(thread[t].tid, NULL);
+        pthread_barrier_destroy(&par.barrier);
+
+        /* The wall time runs from the first thread's start to the last
+           one's end, whenever the main thread got to run */
+        start = DBL_MAX;
+        end = 0;
+        for (t = 0; t < threads; t++) {
+            if (thread[t].start < start)
+                start = thread[t].start;
+            if (thread[t].end > end)
+                end = thread[t].end;
+        }
+        if (end - start < best) {
+            best = end - start;
+            for (t = 0; t < threads; t++)
+                thread_tput[t] = (double)thread[t].num_items /
+                                 ((thread[t].end - thread[t].start) * 1000.0);
+        }
+    }
+
+    par_release(&par, thread);
+    free(thread);
+    return best;
+}
+
+/*
+ * run_parallel - measures how each valid trace scales when par_threads
+ *    threads replay it at once, and prints the results
+ */
+static void run_parallel(size_t n, char **tracefiles, stats_t *stats) {
+    double *thread_tput = calloc(par_threads, sizeof(double));
+    double single_secs, secs, ops, single_tput, tput, eff;
+    double min_tput, max_tput;
+    unsigned int t;
+    size_t i;
+
+    if (thread_tput == NULL)
+        unix_error("calloc in run_parallel failed");
+
+    printf("\nParallel replay on %u threads (%s, %u%% of frees on another "
+           "thread):\n",
+           par_threads, par_shard ? "shards of each trace" : "a copy each",
+           par_cross);
+    if (tab_mode)
+        printf("threads\t1-thread Kops/s\tKops/s\tmin thread Kops/s\t"
+               "max thread Kops/s\tefficiency\ttrace\n");
+    else
+        printf("%7s%10s%10s%20s%7s  %s\n", "threads", "1-thread", "Kops/s",
+               "per thread min-max", "eff", "trace");
+
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+
+        /* A copy per thread shares one heap, so skip the traces whose
+           copies would not fit in it together */
+        if (!par_shard && stats[i].peak_heap * par_threads > MAX_DENSE_HEAP) {
+            if (tab_mode)
+                printf("%u\t-\t-\t-\t-\t-\t%s\n", par_threads,
+                       stats[i].filename);
+            else
+                printf("%7u%10s%10s%20s%7s  %s (heap too small)\n",
+                       par_threads, "-", "-", "-", "-", stats[i].filename);
+            continue;
+        }
+
+        mem_init(false);
+        trace_t *trace = read_trace(tracefiles[i], verbose);
+        if (verbose > 1) {
+            fprintf(stderr, "[%zu/%zu] Replaying mm malloc on %u threads\n", i,
+                    n, par_threads);
+            fflush(stderr);
+        }
+
+        /* The same run on one thread is the baseline */
+        single_secs = eval_mm_parallel(trace, 1, thread_tput);
+        secs = eval_mm_parallel(trace, par_threads, thread_tput);
+
+        ops = (double)trace->num_ops * (par_shard ? 1 : par_threads);
+        single_tput = trace->num_ops / (single_secs * 1000.0);
+        tput = ops / (secs * 1000.0);
+        eff = tput / (par_threads * single_tput);
+        min_tput = DBL_MAX;
+        max_tput = 0;
+        for (t = 0; t < par_threads; t++) {
+            if (thread_tput[t] < min_tput)
+                min_tput = thread_tput[t];
+            if (thread_tput[t] > max_tput)
+                max_tput = thread_tput[t];
+        }
+
+        if (tab_mode)
+            printf("%u\t%.0f\t%.0f\t%.0f\t%.0f\t%.2f\t%s\n", par_threads,
+                   single_tput, tput, min_tput, max_tput, eff,
+                   stats[i].filename);
+        else
+            printf("%7u%10.0f%10.0f%11.0f-%-8.0f%6.0f%%  %s\n", par_threads,
+                   single_tput, tput, min_tput, max_tput, eff * 100,
+                   stats[i].filename);
+        if (verbose > 1 && !tab_mode) {
+            printf("%27s", "threads:");
+            for (t = 0; t < par_threads; t++)
+                printf(" %.0f", thread_tput[t]);
+            printf("\n");
+        }
+
+        free_trace(trace);
+        mem_deinit();
+    }
+    free(thread_tput);
+}
+#endif /* THREAD_SAFE */
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1286,7 +2664,7 @@ static void eval_mm_speed(void *ptr) {
  *
  */
 static bool eval_libc_valid(trace_t *trace) {
-    unsigned int i;
+    unsigned int i, k;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1321,6 +2699,22 @@ static bool eval_libc_valid(trace_t *trace) {
             }
             break;
 
+        case ALLOC_BATCH: /* libc has no batch malloc */
+            for (k = 0; k < trace->ops[i].count; k++) {
+                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                    malloc_error(trace, i, "libc malloc failed: %s",
+                                 strerror(errno));
+                }
+                trace->blocks[trace->ops[i].index + k] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* libc has no batch free */
+            for (k = 0; k < trace->ops[i].count; k++) {
+                free(trace->blocks[trace->ops[i].index + k]);
+            }
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1335,7 +2729,7 @@ static bool eval_libc_valid(trace_t *trace) {
  *    of traces.
  */
 static void eval_libc_speed(void *ptr) {
-    unsigned int i;
+    unsigned int i, k;
     unsigned int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1372,6 +2766,22 @@ static void eval_libc_speed(void *ptr) {
                 free(0);
             }
             break;
+
+        case ALLOC_BATCH: /* libc has no batch malloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            for (k = 0; k < trace->ops[i].count; k++) {
+                if ((p = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[index + k] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* libc has no batch free */
+            index = trace->ops[i].index;
+            for (k = 0; k < trace->ops[i].count; k++)
+                free(trace->blocks[index + k]);
+            break;
         }
     }
 }
@@ -1400,10 +2810,11 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tpeakKB\tfinalKB\tops\tmsecs\tKops/s"
+               "\ttrace\n");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %8s %8s %7s%8s%8s  %s\n", "valid", "util",
+               "peak KB", "final KB", "ops", "msecs", "Kops/s", "trace");
     }
     for (i = 0; i < n; i++) {
         if (stats[i].valid) {
@@ -1450,6 +2861,17 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
                     printf(" %8s", "--");
             }
 
+            /* Peak and final heap size (not measured for libc) */
+            if (tab_mode) {
+                printf("%zu\t%zu\t", stats[i].peak_heap / 1024,
+                       stats[i].final_heap / 1024);
+            } else if (stats[i].peak_heap != 0) {
+                printf("%9zu%9zu", stats[i].peak_heap / 1024,
+                       stats[i].final_heap / 1024);
+            } else {
+                printf("%9s%9s", "--", "--");
+            }
+
             /* Ops + Time */
             double msecs = sparse_mode ? 0.0 : stats[i].secs * 1000.0;
             double kops = sparse_mode ? 0.0 : stats[i].tput;
@@ -1478,11 +2900,11 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
             }
         } else {
             if (tab_mode) {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             } else {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%9s%9s%10s%7s%10s %s\n",
                        stats[i].weight != 0 ? "*" : "", "no", "-", "-", "-",
-                       "-", stats[i].filename);
+                       "-", "-", "-", stats[i].filename);
             }
         }
     }
@@ -1496,7 +2918,7 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         sumstats->tput = 0;
     } else if (errors > 0) {
         if (!tab_mode) {
-            printf("     %8s%10s%7s\n", "-", "-", "-");
+            printf("     %8s%18s%10s%7s\n", "-", "", "-", "-");
         }
         sumstats->util = 0;
         sumstats->ops = 0;
@@ -1513,13 +2935,14 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
         if (sparse_mode)
             sumsecs = 0;
         if (tab_mode) {
-            // "valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace"
-            printf("Sum\t%d\t%d\t%.1f\t%.0f\t%.2f\n", sum_perf_weight,
+            // "valid\tthru?\tutil?\tutil\tpeakKB\tfinalKB\tops\tmsecs\tKops\ttrace"
+            printf("Sum\t%d\t%d\t%.1f\t\t\t%.0f\t%.2f\n", sum_perf_weight,
                    sum_util_weight, sumutil * 100.0, sumops, sumsecs * 1000.0);
-            printf("Avg\t\t\t%.1f\t\t\t\n", util * 100.0);
+            printf("Avg\t\t\t%.1f\t\t\t\t\t\n", util * 100.0);
         } else {
-            printf("%2d %2d  %7.1f%%%8.0f%10.3f\n", sum_util_weight,
-                   sum_perf_weight, util * 100.0, sumops, sumsecs * 1000.0);
+            printf("%2d %2d  %7.1f%%%18s%8.0f%10.3f\n", sum_util_weight,
+                   sum_perf_weight, util * 100.0, "", sumops,
+                   sumsecs * 1000.0);
         }
 
         sumstats->util = util;
@@ -1736,6 +3159,527 @@ static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats) {
     }
 }
 
+/*
+ * class_name - names a size class of mm_stats_t by its upper bound: the
+ * block size of one of the exact classes 0 to 7, else "<" the size of the
+ * next class, or "more" for the last. Returns NULL for an empty class.
+ */
+static const char *class_name(const mm_stats_t *c, size_t j, char *buf,
+                              size_t len) {
+    size_t top = c->class_max[j];
+    if (top == 0)
+        return NULL;
+    if (top == SIZE_MAX)
+        return "more";
+    if (j < 8)
+        snprintf(buf, len, "%zu", top);
+    else if ((top + 16) % 1024 == 0)
+        snprintf(buf, len, "<%zuK", (top + 16) / 1024);
+    else
+        snprintf(buf, len, "<%zu", top + 16);
+    return buf;
+}
+
+/*
+ * printtracestats - prints what the mm malloc package did internally
+ * during the utilization pass of each trace, as mm_get_stats counted it.
+ * A package built without its counters only gets the sbrk columns.
+ */
+static void printtracestats(size_t n, stats_t *stats) {
+    /* Upper bounds of the size classes, see MM_STATS_CLASSES in mm.h */
+    const char *class_names[MM_STATS_CLASSES] = {NULL};
+    char class_bufs[MM_STATS_CLASSES][24];
+    size_t i, j;
+
+    bool any = false;
+    for (i = 0; i < n; i++) {
+        if (!any && stats[i].valid && stats[i].has_counters) {
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                class_names[j] = class_name(&stats[i].counters, j,
+                                            class_bufs[j],
+                                            sizeof(class_bufs[j]));
+            }
+        }
+        any = any || (stats[i].valid && stats[i].has_counters);
+    }
+
+    if (any) {
+        puts("\nAllocator work in the utilization pass:");
+        if (tab_mode) {
+            printf("mallocs\tfrees\tfits\tvisits_per_fit\ttree_fits\tsplits"
+                   "\treallocs\tcopy_kb\ttrace\n");
+        } else {
+            printf("  %9s%9s%9s%7s%8s%9s%9s%9s  %s\n", "mallocs", "frees",
+                   "fits", "visits", "tree", "splits", "reallocs", "copy KB",
+                   "trace");
+        }
+        for (i = 0; i < n; i++) {
+            if (!stats[i].valid || !stats[i].has_counters)
+                continue;
+            mm_stats_t *c = &stats[i].counters;
+            size_t mallocs = 0, frees = 0;
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                mallocs += c->mallocs[j];
+                frees += c->frees[j];
+            }
+            double visits = (c->fit_searches == 0)
+                                ? 0.0
+                                : (double)c->fit_visits /
+                                      (double)c->fit_searches;
+            size_t copy_kb = c->realloc_copy_bytes / 1024;
+            if (tab_mode) {
+                printf("%zu\t%zu\t%zu\t%.2f\t%zu\t%zu\t%zu\t%zu\t%s\n",
+                       mallocs, frees, c->fit_searches, visits,
+                       c->tree_searches, c->splits, c->reallocs, copy_kb,
+                       stats[i].filename);
+            } else {
+                printf("  %9zu%9zu%9zu%7.2f%8zu%9zu%9zu%9zu  %s\n", mallocs,
+                       frees, c->fit_searches, visits, c->tree_searches,
+                       c->splits, c->reallocs, copy_kb, stats[i].filename);
+            }
+        }
+
+        puts("\nAllocations per size class (% of mallocs):");
+        if (tab_mode) {
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                if (class_names[j] != NULL)
+                    printf("%s\t", class_names[j]);
+            }
+            printf("trace\n");
+        } else {
+            printf("  ");
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                if (class_names[j] != NULL)
+                    printf("%5s", class_names[j]);
+            }
+            printf("  trace\n");
+        }
+        for (i = 0; i < n; i++) {
+            if (!stats[i].valid || !stats[i].has_counters)
+                continue;
+            mm_stats_t *c = &stats[i].counters;
+            size_t mallocs = 0;
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                mallocs += c->mallocs[j];
+            }
+            printf(tab_mode ? "" : "  ");
+            for (j = 0; j < MM_STATS_CLASSES; j++) {
+                if (class_names[j] == NULL)
+                    continue;
+                double pct = (mallocs == 0) ? 0.0
+                                            : 100.0 * (double)c->mallocs[j] /
+                                                  (double)mallocs;
+                printf(tab_mode ? "%.1f\t" : "%5.1f", pct);
+            }
+            printf(tab_mode ? "%s\n" : "  %s\n", stats[i].filename);
+        }
+
+        puts("\nCoalescing of freed blocks, by free neighbours:");
+        if (tab_mode) {
+            printf("none\tnext\tprev\tboth\ttrace\n");
+        } else {
+            printf("  %9s%9s%9s%9s  %s\n", "none", "next", "prev", "both",
+                   "trace");
+        }
+        for (i = 0; i < n; i++) {
+            if (!stats[i].valid || !stats[i].has_counters)
+                continue;
+            size_t *merges = stats[i].counters.coalesces;
+            if (tab_mode) {
+                printf("%zu\t%zu\t%zu\t%zu\t%s\n", merges[0], merges[1],
+                       merges[2], merges[3], stats[i].filename);
+            } else {
+                printf("  %9zu%9zu%9zu%9zu  %s\n", merges[0], merges[1],
+                       merges[2], merges[3], stats[i].filename);
+            }
+        }
+    }
+
+    puts("\nHeap growth in the utilization pass:");
+    if (tab_mode) {
+        printf("extends\textend_kb\tsbrks\tsbrk_ms\ttrace\n");
+    } else {
+        printf("  %9s%10s%9s%10s  %s\n", "extends", "extend KB", "sbrks",
+               "sbrk ms", "trace");
+    }
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        mm_stats_t *c = &stats[i].counters;
+        double msecs = sparse_mode ? 0.0 : stats[i].sbrk_secs * 1000.0;
+        char extends[32] = "-", extend_kb[32] = "-";
+        if (stats[i].has_counters) {
+            snprintf(extends, sizeof(extends), "%zu", c->extends);
+            snprintf(extend_kb, sizeof(extend_kb), "%zu",
+                     c->extend_bytes / 1024);
+        }
+        if (tab_mode) {
+            printf("%s\t%s\t%zu\t%.3f\t%s\n", extends, extend_kb,
+                   stats[i].sbrk_calls, msecs, stats[i].filename);
+        } else {
+            printf("  %9s%10s%9zu%10.3f  %s\n", extends, extend_kb,
+                   stats[i].sbrk_calls, msecs, stats[i].filename);
+        }
+    }
+}
+
+/*
+ * latency_percentile - Returns an upper bound on the latency, in ns, of
+ *    the given fraction of the calls in a histogram.
+ */
+static double latency_percentile(const histogram_t *hist, double fraction) {
+    unsigned long long rank =
+        (unsigned long long)(fraction * (double)hist->count + 0.999999);
+    unsigned long long seen = 0;
+    unsigned int b;
+    if (rank == 0)
+        rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+    unsigned long long ticks = latency_bucket_max(b);
+    if (ticks > hist->max)
+        ticks = hist->max;
+    return (double)ticks * stamp_nsecs();
+}
+
+/*
+ * printhistogram - prints the percentiles of one histogram
+ */
+static void printhistogram(const histogram_t *hist, const char *name,
+                           const char *filename) {
+    double p50 = latency_percentile(hist, 0.5);
+    double p99 = latency_percentile(hist, 0.99);
+    double p999 = latency_percentile(hist, 0.999);
+    double max = (double)hist->max * stamp_nsecs();
+    if (tab_mode) {
+        printf("%s\t%s\t%llu\t%.0f\t%.0f\t%.0f\t%.0f\n", filename, name,
+               hist->count, p50, p99, p999, max);
+    } else {
+        printf("  %-14s%10llu%9.0f%9.0f%9.0f%10.0f\n", name, hist->count,
+               p50, p99, p999, max);
+    }
+}
+
+/*
+ * printlatency - prints the latency percentiles of each trace's calls,
+ *    per opcode and, below each opcode that takes a size, per size class
+ */
+static void printlatency(size_t n, stats_t *stats) {
+    static const char *op_names[LAT_OPS] = {"malloc", "free", "realloc",
+                                            "malloc_batch", "free_batch"};
+    size_t i;
+    unsigned int op, cls;
+    char name[32];
+
+    printf("\nLatency of each call in ns, less %llu ticks of timing "
+           "overhead:\n",
+           stamp_overhead());
+    if (tab_mode)
+        printf("trace\tcall\tcalls\tp50\tp99\tp99.9\tmax\n");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].latency == NULL)
+            continue;
+        latency_t *latency = stats[i].latency;
+        if (!tab_mode) {
+            printf("%s\n", stats[i].filename);
+            printf("  %-14s%10s%9s%9s%9s%10s\n", "call", "calls", "p50",
+                   "p99", "p99.9", "max");
+        }
+        for (op = 0; op < LAT_OPS; op++) {
+            if (latency->ops[op].count == 0)
+                continue;
+            printhistogram(&latency->ops[op], op_names[op],
+                           stats[i].filename);
+            if (op >= LAT_SIZED_OPS)
+                continue;
+            for (cls = 0; cls < LAT_CLASSES; cls++) {
+                histogram_t *hist = &latency->classes[op][cls];
+                if (hist->count == 0)
+                    continue;
+                size_t bytes = (size_t)1 << (cls + LAT_MIN_CLASS_BITS);
+                const char *cmp = (cls + 1 == LAT_CLASSES) ? ">" : "<=";
+                if (cls + 1 == LAT_CLASSES)
+                    bytes /= 2;
+                const char *prefix = tab_mode ? op_names[op] : "  ";
+                const char *sep = tab_mode ? "/" : "";
+                if (bytes >= 1024)
+                    snprintf(name, sizeof(name), "%s%s%s%zuK", prefix, sep,
+                             cmp, bytes / 1024);
+                else
+                    snprintf(name, sizeof(name), "%s%s%s%zu", prefix, sep,
+                             cmp, bytes);
+                printhistogram(hist, name, stats[i].filename);
+            }
+        }
+    }
+}
+
+/*
+ * page_map - draws the page map of a snapshot in width characters, each
+ *    for a run of pages: '.' if none of its bytes are in use, '#' if all
+ *    are, else the digit of the tenths in use. buf holds width + 1.
+ */
+static void page_map(const mm_snapshot_t *snap, char *buf, size_t width) {
+    size_t pages = snap->num_pages < snap->max_pages ? snap->num_pages
+                                                     : snap->max_pages;
+    size_t page_size = mem_pagesize();
+    size_t c;
+
+    for (c = 0; c < width; c++) {
+        size_t used = 0, bytes = 0;
+        for (size_t p = c * pages / width; p < (c + 1) * pages / width; p++) {
+            size_t left = snap->heap_bytes - p * page_size;
+            used += snap->page_used[p];
+            bytes += left < page_size ? left : page_size;
+        }
+        if (used == 0)
+            buf[c] = '.';
+        else if (used == bytes)
+            buf[c] = '#';
+        else {
+            size_t tenths = used * 10 / bytes;
+            buf[c] = (char)('0' + (tenths < 1 ? 1 : tenths > 9 ? 9 : tenths));
+        }
+    }
+    buf[width] = '\0';
+}
+
+/*
+ * printsnapshots - prints the heap snapshots of each trace's utilization
+ *    pass: how its bytes divide into live payload, used and free, how the
+ *    free bytes are spread, a map of the pages in use, and the free blocks
+ *    of each size class. Blocks waiting on quick-lists and free slab slots
+ *    are held, and count as free but not as free blocks.
+ */
+static void printsnapshots(size_t n, stats_t *stats) {
+    const char *class_names[MM_STATS_CLASSES] = {NULL};
+    char class_bufs[MM_STATS_CLASSES][24];
+    char map[64 + 1];
+    size_t i, j, k;
+
+    for (i = 0; i < n; i++) {
+        if (stats[i].num_snaps > 0) {
+            for (j = 0; j < MM_STATS_CLASSES; j++)
+                class_names[j] =
+                    class_name(&stats[i].counters, j, class_bufs[j],
+                               sizeof(class_bufs[j]));
+            break;
+        }
+    }
+
+    printf("\nHeap snapshots every %u ops of the utilization pass, "
+           "in KB:\n",
+           snap_every);
+    if (tab_mode) {
+        printf("trace\top\theap\tlive\tused\tfree\theld\tlargest\tfrag");
+        for (j = 0; j < MM_STATS_CLASSES; j++)
+            if (class_names[j] != NULL)
+                printf("\tfree_%s", class_names[j]);
+        printf("\tpages\n");
+    }
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].num_snaps == 0)
+            continue;
+        if (!tab_mode) {
+            printf("%s\n", stats[i].filename);
+            printf("  %9s%8s%8s%8s%8s%8s%9s%7s  %s\n", "op", "heap", "live",
+                   "used", "free", "held", "largest", "frag", "pages");
+        }
+        for (k = 0; k < stats[i].num_snaps; k++) {
+            heapsnap_t *hs = &stats[i].snaps[k];
+            mm_snapshot_t *snap = &hs->snap;
+            size_t held = snap->quick_bytes + snap->slab_bytes;
+            double kb = 1024.0;
+            size_t unheld = snap->heap_bytes - snap->used_bytes - held;
+            if (tab_mode) {
+                char *full = malloc(snap->num_pages + 1);
+                if (full == NULL)
+                    unix_error("page map malloc in printsnapshots failed");
+                page_map(snap, full, snap->num_pages);
+                printf("%s\t%u\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.3f",
+                       stats[i].filename, hs->op,
+                       (double)snap->heap_bytes / kb,
+                       (double)hs->live_bytes / kb,
+                       (double)snap->used_bytes / kb, (double)unheld / kb,
+                       (double)held / kb, (double)snap->largest_free / kb,
+                       snap->frag);
+                for (j = 0; j < MM_STATS_CLASSES; j++)
+                    if (class_names[j] != NULL)
+                        printf("\t%zu", snap->free_blocks[j]);
+                printf("\t%s\n", full);
+                free(full);
+            } else {
+                size_t width = snap->num_pages < 64 ? snap->num_pages : 64;
+                page_map(snap, map, width);
+                printf("  %9u%8zu%8zu%8zu%8zu%8zu%9.1f%6.1f%%  %s\n", hs->op,
+                       snap->heap_bytes / 1024, hs->live_bytes / 1024,
+                       snap->used_bytes / 1024, unheld / 1024, held / 1024,
+                       (double)snap->largest_free / kb, 100.0 * snap->frag,
+                       map);
+            }
+        }
+        if (tab_mode)
+            continue;
+
+        printf("  %9s", "free/cls");
+        for (j = 0; j < MM_STATS_CLASSES; j++)
+            if (class_names[j] != NULL)
+                printf("%6s", class_names[j]);
+        printf("\n");
+        for (k = 0; k < stats[i].num_snaps; k++) {
+            printf("  %9u", stats[i].snaps[k].op);
+            for (j = 0; j < MM_STATS_CLASSES; j++)
+                if (class_names[j] != NULL)
+                    printf("%6zu", stats[i].snaps[k].snap.free_blocks[j]);
+            printf("\n");
+        }
+    }
+}
+
+/*
+ * printbench - prints the spread of each trace's timed runs (-B): the
+ *    median time, its median absolute deviation, absolute and as a
+ *    percentage, the 95% confidence interval of the median, and the
+ *    throughput of the median run. With -E, the median of each event
+ *    counted, per op.
+ */
+static void printbench(size_t n, stats_t *stats) {
+    static const char *short_names[BENCH_EVENTS] = {
+        "cycles", "instrs", "cache", "branch", "dtlb"};
+    size_t i;
+    int e;
+
+    printf("\nBenchmark of %u runs of each trace after %d warmup runs",
+           bench_reps, BENCH_WARMUP);
+    if (bench_cpu >= 0)
+        printf(", on CPU %d", bench_cpu);
+    printf(bench_mask != 0 ? "; events per op:\n" : ":\n");
+    if (tab_mode) {
+        printf("trace\truns\tmedian_ms\tmad_ms\tci_lo_ms\tci_hi_ms\tkops");
+        for (e = 0; e < BENCH_EVENTS; e++)
+            if (bench_mask & (1u << e))
+                printf("\t%s", bench_event_names[e]);
+        printf("\n");
+    } else {
+        printf("  %9s%9s%6s%19s%9s", "median ms", "MAD ms", "MAD", "95% CI ms",
+               "Kops/s");
+        for (e = 0; e < BENCH_EVENTS; e++)
+            if (bench_mask & (1u << e))
+                printf("%9s", short_names[e]);
+        printf("  trace\n");
+    }
+    for (i = 0; i < n; i++) {
+        bench_t *bench = stats[i].bench;
+        if (!stats[i].valid || bench == NULL)
+            continue;
+        bench_summary_t *secs = &bench->secs;
+        double ops = (double)stats[i].ops;
+        if (tab_mode) {
+            printf("%s\t%zu\t%.4f\t%.4f\t%.4f\t%.4f\t%.0f",
+                   stats[i].filename, secs->n, secs->median * 1e3,
+                   secs->mad * 1e3, secs->ci_lo * 1e3, secs->ci_hi * 1e3,
+                   stats[i].tput);
+            for (e = 0; e < BENCH_EVENTS; e++)
+                if (bench_mask & (1u << e))
+                    printf("\t%.4f", bench->events[e].median / ops);
+            printf("\n");
+        } else {
+            printf("  %9.3f%9.3f%5.1f%%%9.3f -%8.3f%9.0f", secs->median * 1e3,
+                   secs->mad * 1e3, 100.0 * secs->mad / secs->median,
+                   secs->ci_lo * 1e3, secs->ci_hi * 1e3, stats[i].tput);
+            for (e = 0; e < BENCH_EVENTS; e++)
+                if (bench_mask & (1u << e))
+                    printf("%9.3f", bench->events[e].median / ops);
+            printf("  %s\n", stats[i].filename);
+        }
+    }
+}
+
+/*
+ * json_string - writes s to fp as a JSON string
+ */
+static void json_string(FILE *fp, const char *s) {
+    putc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * json_summary - writes a summary of samples to fp as a JSON object,
+ *    with scale applied to each value
+ */
+static void json_summary(FILE *fp, const bench_summary_t *sum,
+                         double scale) {
+    fprintf(fp,
+            "{\"median\": %.9g, \"mad\": %.9g, \"ci95\": [%.9g, %.9g], "
+            "\"min\": %.9g, \"max\": %.9g, \"mean\": %.9g}",
+            sum->median * scale, sum->mad * scale, sum->ci_lo * scale,
+            sum->ci_hi * scale, sum->min * scale, sum->max * scale,
+            sum->mean * scale);
+}
+
+/*
+ * writebenchjson - writes the timed runs of each trace (-B) to fname, or
+ *    to stdout if it is "-", as one JSON object: the settings, and per
+ *    trace its validity, utilization, and summaries of the secs of its
+ *    runs and of each event counted, with medians per op.
+ */
+static void writebenchjson(const char *fname, size_t n, stats_t *stats) {
+    FILE *fp = strcmp(fname, "-") == 0 ? stdout : fopen(fname, "w");
+    size_t i;
+    int e;
+    bool first;
+
+    if (fp == NULL)
+        unix_error("Could not open the JSON file");
+    fprintf(fp, "{\n  \"reps\": %u,\n  \"warmup\": %d,\n  \"cpu\": %d,\n",
+            bench_reps, BENCH_WARMUP, bench_cpu);
+    fprintf(fp, "  \"events\": [");
+    for (e = 0, first = true; e < BENCH_EVENTS; e++) {
+        if (bench_mask & (1u << e)) {
+            fprintf(fp, "%s\"%s\"", first ? "" : ", ", bench_event_names[e]);
+            first = false;
+        }
+    }
+    fprintf(fp, "],\n  \"traces\": [");
+    for (i = 0; i < n; i++) {
+        bench_t *bench = stats[i].bench;
+        fprintf(fp, "%s\n    {\"trace\": ", i == 0 ? "" : ",");
+        json_string(fp, stats[i].filename);
+        fprintf(fp, ", \"valid\": %s, \"ops\": %u",
+                stats[i].valid ? "true" : "false", stats[i].ops);
+        if (!stats[i].valid || bench == NULL) {
+            fprintf(fp, "}");
+            continue;
+        }
+        fprintf(fp, ", \"util\": %.6f, \"kops\": %.1f,\n     \"secs\": ",
+                stats[i].util, stats[i].tput);
+        json_summary(fp, &bench->secs, 1.0);
+        for (e = 0; e < BENCH_EVENTS; e++) {
+            if (!(bench_mask & (1u << e)))
+                continue;
+            fprintf(fp, ",\n     \"%s\": ", bench_event_names[e]);
+            json_summary(fp, &bench->events[e], 1.0);
+            fprintf(fp, ",\n     \"%s_per_op\": %.6g", bench_event_names[e],
+                    bench->events[e].median / (double)stats[i].ops);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    if (fp != stdout && fclose(fp) != 0)
+        unix_error("Could not write the JSON file");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1770,7 +3714,8 @@ void unix_error(const char *fmt, ...) {
 void malloc_error(const trace_t *trace, unsigned int opnum, const char *fmt,
                   ...) {
 
-    errors++;
+    /* libc runs report from the pool's threads */
+    __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
     fprintf(stderr, "ERROR [trace %s, line %d]: ", trace->filename,
             trace->ops[opnum].lineno);
 
@@ -1959,13 +3904,18 @@ static unsigned int atoui_or_usage(const char *arg, const char *option,
  * usage - Explain the command line arguments
  */
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlVCdDELRS] [-B <n>] [-H <n>] [-J <file>] "
+            "[-P <n>] [-X <pct>] [-f <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> twice, check for "
                     "correctness only.\n");
+    fprintf(stderr, "\t           Repeat to check several files in parallel "
+                    "processes.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
@@ -1973,5 +3923,23 @@ static void usage(const char *prog) {
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-L         Print latency percentiles of each call\n");
+    fprintf(stderr, "\t-H <n>     Print a snapshot of the heap every n "
+                    "ops of each trace\n");
+    fprintf(stderr, "\t-B <n>     Time each trace n times after %d "
+                    "warmup runs, on one CPU\n",
+            BENCH_WARMUP);
+    fprintf(stderr, "\t-E         With -B, count hardware events in "
+                    "each run\n");
+    fprintf(stderr, "\t-J <file>  With -B, write the runs to <file> as "
+                    "JSON (- for stdout)\n");
+    fprintf(stderr, "\t-R         Stream each trace from its file instead "
+                    "of loading it\n");
+    fprintf(stderr, "\t-P <n>     Replay copies of each trace on n threads "
+                    "(mdriver-mt)\n");
+    fprintf(stderr, "\t-S         With -P, split each trace among the "
+                    "threads by block id\n");
+    fprintf(stderr, "\t-X <pct>   With -P, run pct%% of frees on another "
+                    "thread\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -36,12 +36,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef USE_ASAN
@@ -59,11 +61,17 @@ void markGlobalsUninit(void);
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
-    unsigned char initSet[SPARSE_PAGE_SIZE / 8];
-    unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
+    struct MBLK *next; /* Link for the list of released pages */
+    uint64_t initSet[SPARSE_PAGE_SIZE / 64]; /* Bit i: byte i was written */
+    unsigned char bytes[SPARSE_PAGE_SIZE];   /* Page contents */
 } mem_block_t;
 
+/* A region of the map area handed out by mem_map */
+typedef struct {
+    unsigned char *start; /* Page aligned */
+    size_t len;           /* Whole pages */
+} mem_region_t;
+
 /* private global variables */
 static bool sparse = false;    /* Use sparse memory emulation */
 static unsigned char *heap;    /* Starting address of heap */
@@ -71,19 +79,36 @@ static unsigned char *mem_brk; /* Current position of break */
 static unsigned char
     *mem_brk_chunk; /* ditto, rounded up to a whole allocation chunk */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static size_t mem_peak; /* Largest heap plus mapped size since the reset */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
+static pthread_mutex_t brk_lock =
+    PTHREAD_MUTEX_INITIALIZER; /* Serializes updates of the break and map */
+
+/* Regions mapped outside the heap, within [map_area, map_area_end) */
+static unsigned char *map_area;     /* Start of the map area */
+static unsigned char *map_area_end; /* End of the map area */
+static unsigned char *map_top;      /* End of the highest region */
+static mem_region_t regions[MAX_MAP_REGIONS]; /* Sorted by address */
+static size_t num_regions = 0;                /* Number of live regions */
+static size_t mapped_bytes = 0;               /* Their total length */
+
+/* Calls of mem_sbrk since the last reset, and the time spent in them */
+static size_t sbrk_calls = 0;
+static double sbrk_secs = 0.0;
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *released_pages = NULL; /* Pages given back, for reuse */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static size_t table_mask = 0;              /* Slots in page table, minus 1 */
+static mem_block_t *last_page = NULL;      /* Page of the last access */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -112,7 +137,20 @@ const char *__msan_default_options(void) {
  */
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
+static size_t page_room(const void *addr);
+static size_t find_slot(size_t id);
+static void remove_slot(size_t slot);
+static void move_page(size_t slot, size_t first, void *dst);
 static void *get_mem(const void *addr, size_t, bool);
+static void *sbrk_unlocked(intptr_t incr);
+static void move_pages(void *lo, void *hi, void *dst);
+static bool is_emulated(const void *addr, size_t len);
+static void update_peak(void);
+static size_t find_region(const void *addr);
+static unsigned char *find_gap(size_t len, size_t *pos);
+static void set_region(size_t pos, unsigned char *start, size_t len);
+static void remove_region(size_t pos);
+static bool drop_mapping(void *addr, size_t len);
 static void print_stats(void);
 
 /*
@@ -151,23 +189,25 @@ void mem_init(bool do_sparse) {
     if (sparse) {
         /* Want sparse total allocation to approximately match the dense heap
          * size */
-        /* Account for both page itself and its amortized contribution to the
-         * page table */
-        double fbytes_per_page =
-            sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
-        num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = (size_t)((double)num_pages / HASH_LOAD);
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
-                      num_pages * sizeof(mem_block_t) +     // Pages
-                      sizeof(uint64_t);                     // Padding
+        /* Account for both page itself and its slots in the page table */
+        size_t bytes_per_page =
+            sizeof(mem_block_t) + PAGE_TABLE_SLOTS * sizeof(mem_block_t *);
+        num_pages = MAX_DENSE_HEAP / bytes_per_page;
+        size_t slots = 1;
+        while (slots < PAGE_TABLE_SLOTS * num_pages)
+            slots *= 2;
+        table_mask = slots - 1;
+        mmap_length = slots * sizeof(mem_block_t *) +   // Page table
+                      num_pages * sizeof(mem_block_t) + // Pages
+                      sizeof(uint64_t);                 // Padding
         setUBCheck(true);
     } else {
         /* Dense allocation */
         next_free_page = NULL;
         num_pages = 0;
         page_table = NULL;
-        num_buckets = 0;
-        mmap_length = MAX_DENSE_HEAP;
+        table_mask = 0;
+        mmap_length = MAX_DENSE_HEAP + MAX_DENSE_MAP;
     }
 
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
@@ -175,7 +215,8 @@ void mem_init(bool do_sparse) {
        exposed to student code.  The dense heap is used directly by
        student code.  We manage a pseudo-break within the dense heap
        by mapping it PROT_NONE initially and then changing pages to
-       PROT_READ|PROT_WRITE upon calls to mem_sbrk.  */
+       PROT_READ|PROT_WRITE upon calls to mem_sbrk.  The map area for
+       mem_map follows the dense heap in the same mapping.  */
     int prot = sparse ? PROT_READ | PROT_WRITE : PROT_NONE;
     void *addr = mmap(start,                       /* suggested start*/
                       mmap_length,                 /* length */
@@ -200,13 +241,22 @@ void mem_init(bool do_sparse) {
         page_table = (mem_block_t **)addr;
         heap = SPARSE_HEAP_START;
         mem_max_addr = heap + MAX_SPARSE_HEAP;
+        map_area_end = mem_max_addr + MAX_SPARSE_MAP;
     } else {
         heap = addr;
-        mem_max_addr = heap + mmap_length;
+        mem_max_addr = heap + MAX_DENSE_HEAP;
+        map_area_end = mem_max_addr + MAX_DENSE_MAP;
     }
     stats_printed = false;
     mem_brk = heap;
     mem_brk_chunk = heap;
+    map_area = mem_max_addr;
+    map_top = map_area;
+    num_regions = 0;
+    mapped_bytes = 0;
+    mem_peak = 0;
+    sbrk_calls = 0;
+    sbrk_secs = 0.0;
 }
 
 /*
@@ -216,9 +266,11 @@ void mem_deinit(void) {
     print_stats();
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    released_pages = NULL;
     num_free_pages = 0;
     page_table = NULL;
-    num_buckets = 0;
+    table_mask = 0;
+    last_page = NULL;
 }
 
 /*
@@ -228,16 +280,18 @@ void mem_reset_brk(void) {
     print_stats();
     if (sparse) {
         /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
+        size_t ptb = (table_mask + 1) * sizeof(mem_block_t *);
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        released_pages = NULL;
+        last_page = NULL;
         num_free_pages = num_pages;
     } else {
         /* In order to make subsequent calls to mem_sbrk cost
            approximately what they did on the first pass, overwrite
            the entire heap with a fresh PROT_NONE mapping.  */
-        if (mmap(heap, MAX_DENSE_HEAP, PROT_NONE,
+        if (mmap(heap, mmap_length, PROT_NONE,
                  MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
                  0) == MAP_FAILED) {
             fprintf(stderr, "FAILURE.  deallocation of heap failed (%s)\n",
@@ -251,23 +305,75 @@ void mem_reset_brk(void) {
     }
     mem_brk = heap;
     mem_brk_chunk = heap;
+    map_top = map_area;
+    num_regions = 0;
+    mapped_bytes = 0;
+    mem_peak = 0;
+    sbrk_calls = 0;
+    sbrk_secs = 0.0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap, and the pages above the new break are
+ * returned to the system.  Safe to call from several threads at once.
  */
 void *mem_sbrk(intptr_t incr) {
+    struct timespec start, end;
+    pthread_mutex_lock(&brk_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void *old_brk = sbrk_unlocked(incr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sbrk_calls++;
+    sbrk_secs += (double)(end.tv_sec - start.tv_sec) +
+                 (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+    pthread_mutex_unlock(&brk_lock);
+    return old_brk;
+}
+
+/*
+ * sbrk_unlocked - body of mem_sbrk; the caller must hold brk_lock
+ */
+static void *sbrk_unlocked(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     if (incr < 0) {
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-        errno = EINVAL;
-        return (void *)-1;
+        if ((size_t)-incr > (size_t)(mem_brk - heap)) {
+            fprintf(stderr,
+                    "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                    "bytes, below its start\n",
+                    (long)-incr);
+            errno = EINVAL;
+            return (void *)-1;
+        }
+        unsigned char *new_brk = old_brk + incr;
+        unsigned char *new_brk_chunk =
+            round_address_up(new_brk, mem_pagesize());
+        if (!sparse && new_brk_chunk < mem_brk_chunk) {
+            /* A fresh PROT_NONE mapping drops the pages, as in
+             * mem_reset_brk, so they no longer count as resident. */
+            if (mmap(new_brk_chunk, (size_t)(mem_brk_chunk - new_brk_chunk),
+                     PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0) == MAP_FAILED) {
+                fprintf(stderr,
+                        "ERROR: releasing %zd bytes at %p failed (%s)\n",
+                        mem_brk_chunk - new_brk_chunk, (void *)new_brk_chunk,
+                        strerror(errno));
+                return (void *)-1;
+            }
+        }
+#ifdef USE_ASAN
+        if (!sparse) {
+            __asan_poison_memory_region(new_brk, (size_t)-incr);
+        }
+#endif
+        if (sparse) {
+            move_pages(new_brk, old_brk, NULL);
+        }
+        mem_brk_chunk = new_brk_chunk;
+        mem_brk = new_brk;
+        return old_brk;
     }
     if (mem_brk + incr > mem_max_addr) {
         ptrdiff_t alloc = mem_brk - heap + incr;
@@ -311,9 +417,53 @@ void *mem_sbrk(intptr_t incr) {
 
     mem_brk_chunk = new_brk_chunk;
     mem_brk = new_brk;
+    update_peak();
     return old_brk;
 }
 
+/*
+ * mem_release - give the whole pages in [addr, addr + len) back to the
+ * system.  The range stays part of the heap or region, but its contents
+ * are lost.
+ */
+void mem_release(void *addr, size_t len) {
+    unsigned char *lo = addr;
+    unsigned char *hi = lo + len;
+    assert(lo >= heap && hi <= map_area_end);
+    if (sparse) {
+        move_pages(lo, hi, NULL);
+        return;
+    }
+    lo = round_address_up(lo, mem_pagesize());
+    hi = round_address_down(hi, mem_pagesize());
+    if (lo >= hi) {
+        return;
+    }
+    /* The pages read back as zero the next time they are touched */
+    if (madvise(lo, (size_t)(hi - lo), MADV_DONTNEED) == -1) {
+        fprintf(stderr, "ERROR: releasing %zd bytes at %p failed (%s)\n",
+                hi - lo, (void *)lo, strerror(errno));
+        return;
+    }
+#ifdef USE_MSAN
+    /* Released memory is as good as uninitialized */
+    __msan_allocated_memory(lo, (size_t)(hi - lo));
+#endif
+}
+
+/*
+ * mem_zero_filled - whether memory new to the heap or to a region, or
+ * released, reads as zero.  Sparse pages come back uninitialized, and
+ * MSan poisons fresh memory.
+ */
+bool mem_zero_filled(void) {
+#ifdef USE_MSAN
+    return false;
+#else
+    return !sparse;
+#endif
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -335,6 +485,263 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heap_peak - returns the largest size of the heap and the mapped
+ * regions together since the last reset
+ */
+size_t mem_heap_peak(void) {
+    return mem_peak;
+}
+
+/*
+ * mem_resident - returns the number of heap and mapped bytes backed by
+ * memory
+ */
+size_t mem_resident(void) {
+    if (sparse) {
+        return (num_pages - num_free_pages) * SPARSE_PAGE_SIZE;
+    }
+    /* Ask the kernel which pages are present, a batch at a time */
+    unsigned char vec[1024];
+    size_t pagesize = mem_pagesize();
+    unsigned char *ranges[2][2] = {{heap, mem_brk_chunk}, {map_area, map_top}};
+    size_t resident = 0;
+    for (size_t r = 0; r < 2; r++) {
+        unsigned char *lo = ranges[r][0];
+        size_t npages = (size_t)(ranges[r][1] - lo) / pagesize;
+        for (size_t i = 0; i < npages; i += sizeof(vec)) {
+            size_t n = npages - i < sizeof(vec) ? npages - i : sizeof(vec);
+            if (mincore(lo + i * pagesize, n * pagesize, vec) == -1) {
+                return mem_heapsize() + mapped_bytes;
+            }
+            for (size_t j = 0; j < n; j++) {
+                resident += vec[j] & 1;
+            }
+        }
+    }
+    return resident * pagesize;
+}
+
+/*
+ * mem_map - map a region of at least len bytes outside the heap, and
+ * return its page-aligned start
+ */
+void *mem_map(size_t len) {
+    pthread_mutex_lock(&brk_lock);
+    size_t pos;
+    len = (size_t)round_address_up((void *)len, mem_pagesize());
+    unsigned char *addr = NULL;
+    if (len != 0 && num_regions < MAX_MAP_REGIONS) {
+        addr = find_gap(len, &pos);
+    }
+    if (addr == NULL) {
+        fprintf(stderr,
+                "ERROR: mem_map failed.  No room for a region of %zu bytes\n",
+                len);
+        pthread_mutex_unlock(&brk_lock);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (!sparse && mprotect(addr, len, PROT_READ | PROT_WRITE) == -1) {
+        fprintf(stderr,
+                "ERROR: making %zu bytes at %p accessible failed (%s)\n", len,
+                (void *)addr, strerror(errno));
+        pthread_mutex_unlock(&brk_lock);
+        return (void *)-1;
+    }
+#ifdef USE_ASAN
+    if (!sparse) {
+        __asan_unpoison_memory_region(addr, len);
+    }
+#endif
+#ifdef USE_MSAN
+    if (!sparse) {
+        __msan_allocated_memory(addr, len);
+    }
+#endif
+    memmove(&regions[pos + 1], &regions[pos],
+            (num_regions - pos) * sizeof(mem_region_t));
+    num_regions++;
+    set_region(pos, addr, len);
+    mapped_bytes += len;
+    update_peak();
+    pthread_mutex_unlock(&brk_lock);
+    return addr;
+}
+
+/*
+ * mem_unmap - unmap a whole region returned by mem_map or mem_remap
+ */
+int mem_unmap(void *addr) {
+    pthread_mutex_lock(&brk_lock);
+    size_t pos = find_region(addr);
+    if (pos == num_regions) {
+        fprintf(stderr, "ERROR: mem_unmap failed.  %p is not a region\n",
+                addr);
+        pthread_mutex_unlock(&brk_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t len = regions[pos].len;
+    bool ok = drop_mapping(addr, len);
+    remove_region(pos);
+    mapped_bytes -= len;
+    pthread_mutex_unlock(&brk_lock);
+    return ok ? 0 : -1;
+}
+
+/*
+ * mem_remap - resize a region to at least len bytes.  The region grows or
+ * shrinks in place if it can; otherwise its pages are moved, not copied,
+ * to a new place.  Returns the new start of the region.
+ */
+void *mem_remap(void *addr, size_t len) {
+    pthread_mutex_lock(&brk_lock);
+    size_t pos = find_region(addr);
+    len = (size_t)round_address_up((void *)len, mem_pagesize());
+    if (pos == num_regions || len == 0) {
+        fprintf(stderr, "ERROR: mem_remap failed.  %p is not a region\n",
+                addr);
+        pthread_mutex_unlock(&brk_lock);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+    unsigned char *start = regions[pos].start;
+    size_t old_len = regions[pos].len;
+    unsigned char *limit =
+        (pos + 1 < num_regions) ? regions[pos + 1].start : map_area_end;
+
+    if (len <= old_len) {
+        /* Shrink in place */
+        if (len < old_len && !drop_mapping(start + len, old_len - len)) {
+            pthread_mutex_unlock(&brk_lock);
+            return (void *)-1;
+        }
+        set_region(pos, start, len);
+        mapped_bytes -= old_len - len;
+    } else if ((size_t)(limit - start) >= len) {
+        /* Grow in place */
+        if (!sparse && mprotect(start + old_len, len - old_len,
+                                PROT_READ | PROT_WRITE) == -1) {
+            fprintf(stderr,
+                    "ERROR: making %zu bytes at %p accessible failed (%s)\n",
+                    len - old_len, (void *)(start + old_len),
+                    strerror(errno));
+            pthread_mutex_unlock(&brk_lock);
+            return (void *)-1;
+        }
+#ifdef USE_ASAN
+        if (!sparse) {
+            __asan_unpoison_memory_region(start + old_len, len - old_len);
+        }
+#endif
+#ifdef USE_MSAN
+        if (!sparse) {
+            __msan_allocated_memory(start + old_len, len - old_len);
+        }
+#endif
+        set_region(pos, start, len);
+        mapped_bytes += len - old_len;
+    } else {
+        /* Move the pages to a gap that is large enough */
+        size_t new_pos;
+        unsigned char *dst =
+            (num_regions < MAX_MAP_REGIONS) ? find_gap(len, &new_pos) : NULL;
+        if (dst == NULL) {
+            fprintf(stderr,
+                    "ERROR: mem_remap failed.  No room for a region of %zu "
+                    "bytes\n",
+                    len);
+            pthread_mutex_unlock(&brk_lock);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        if (sparse) {
+            move_pages(start, start + old_len, dst);
+        } else {
+            /* mremap leaves a hole where the region was, so the area is
+             * mapped PROT_NONE there again */
+            if (mremap(start, old_len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                       dst) == MAP_FAILED ||
+                mmap(start, old_len, PROT_NONE,
+                     MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0) == MAP_FAILED) {
+                fprintf(stderr,
+                        "ERROR: moving %zu bytes from %p to %p failed (%s)\n",
+                        old_len, (void *)start, (void *)dst, strerror(errno));
+                pthread_mutex_unlock(&brk_lock);
+                return (void *)-1;
+            }
+#ifdef USE_ASAN
+            __asan_poison_memory_region(start, old_len);
+            __asan_unpoison_memory_region(dst, len);
+#endif
+#ifdef USE_MSAN
+            __msan_allocated_memory(dst + old_len, len - old_len);
+#endif
+        }
+        /* Insert the new entry first, so new_pos is still right */
+        memmove(&regions[new_pos + 1], &regions[new_pos],
+                (num_regions - new_pos) * sizeof(mem_region_t));
+        num_regions++;
+        set_region(new_pos, dst, len);
+        remove_region(new_pos <= pos ? pos + 1 : pos);
+        mapped_bytes += len - old_len;
+        start = dst;
+    }
+    update_peak();
+    pthread_mutex_unlock(&brk_lock);
+    return start;
+}
+
+/*
+ * mem_map_lo - return the start of the area for mapped regions
+ */
+void *mem_map_lo(void) {
+    return (void *)map_area;
+}
+
+/*
+ * mem_in_map - check that [addr, addr + len) lies within a single region
+ * returned by mem_map or mem_remap
+ */
+bool mem_in_map(const void *addr, size_t len) {
+    const unsigned char *lo = addr;
+    pthread_mutex_lock(&brk_lock);
+    bool found = false;
+    size_t a = 0;
+    size_t b = num_regions;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (regions[m].start + regions[m].len <= lo) {
+            a = m + 1;
+        } else {
+            b = m;
+        }
+    }
+    if (a < num_regions && regions[a].start <= lo &&
+        len <= regions[a].len - (size_t)(lo - regions[a].start)) {
+        found = true;
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return found;
+}
+
+/*
+ * mem_sbrk_calls - returns the number of calls of mem_sbrk since the last
+ * reset
+ */
+size_t mem_sbrk_calls(void) {
+    return sbrk_calls;
+}
+
+/*
+ * mem_sbrk_secs - returns the time spent in mem_sbrk since the last reset
+ */
+double mem_sbrk_secs(void) {
+    return sbrk_secs;
+}
+
 /*
  * mem_pagesize - returns the page size of the system
  */
@@ -368,8 +775,7 @@ void mem_write128(void *addr, __int128_t val) {
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && is_emulated(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -407,8 +813,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && is_emulated(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -447,7 +852,29 @@ void mem_write(void *addr, uint64_t val, size_t len) {
 
 /* Emulation of memcpy */
 void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
+    if (!sparse || (!is_emulated(dst, num_bytes) &&
+                    !is_emulated(src, num_bytes))) {
+        /* Nothing is emulated; libc copies with the widest moves the
+         * machine has */
+        return memcpy(dst, src, num_bytes);
+    }
     void *savedst = dst;
+    if (is_emulated(dst, num_bytes) && is_emulated(src, num_bytes)) {
+        /* Copy the runs that lie on one page of each side, resolving
+         * both pages once per run */
+        while (num_bytes) {
+            size_t len = page_room(src) < page_room(dst) ? page_room(src)
+                                                         : page_room(dst);
+            if (len > num_bytes)
+                len = num_bytes;
+            const void *from = get_mem(src, len, false);
+            memcpy(get_mem(dst, len, true), from, len);
+            num_bytes -= len;
+            src = (const unsigned char *)src + len;
+            dst = (unsigned char *)dst + len;
+        }
+        return savedst;
+    }
     size_t word_size = sizeof(uint64_t);
     while (num_bytes >= word_size) {
         uint64_t data = mem_read(src, word_size);
@@ -465,21 +892,15 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
 
 /* Emulation of memset */
 void *mem_memset(void *dst, int c, size_t num_bytes) {
+    if (!sparse || !is_emulated(dst, num_bytes))
+        return memset(dst, c, num_bytes);
     void *savedst = dst;
-    uint64_t byte = c & 0xFF;
-    uint64_t data = 0;
-    size_t word_size = sizeof(uint64_t);
-    size_t i;
-    for (i = 0; i < word_size; i++) {
-        data = data | (byte << (8 * i));
-    }
-    while (num_bytes >= word_size) {
-        mem_write(dst, data, word_size);
-        num_bytes -= word_size;
-        dst = (void *)((unsigned char *)dst + word_size);
-    }
-    if (num_bytes) {
-        mem_write(dst, data, num_bytes);
+    /* Set the run that lies on each page, resolving the page once */
+    while (num_bytes) {
+        size_t len = page_room(dst) < num_bytes ? page_room(dst) : num_bytes;
+        memset(get_mem(dst, len, true), c, len);
+        num_bytes -= len;
+        dst = (unsigned char *)dst + len;
     }
     return savedst;
 }
@@ -538,40 +959,229 @@ static size_t page_id(const void *addr) {
     return (size_t)offset / SPARSE_PAGE_SIZE;
 }
 
+/* Number of bytes from an address to the end of its page */
+static size_t page_room(const void *addr) {
+    ptrdiff_t offset =
+        (const unsigned char *)addr - (unsigned char *)SPARSE_HEAP_START;
+    assert(offset >= 0);
+    return SPARSE_PAGE_SIZE - (size_t)offset % SPARSE_PAGE_SIZE;
+}
+
 /* Given a page ID, compute its starting address */
 static void *page_start(size_t id) {
     size_t offset = id * SPARSE_PAGE_SIZE;
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/*
+ * Move the sparse pages that lie wholly in [lo, hi) so that lo maps to dst,
+ * or return them to the pool of free pages if dst is NULL.  Pages given
+ * back count as uninitialized when they are used again.
+ */
+static void move_pages(void *lo, void *hi, void *dst) {
+    size_t first = page_id(round_address_up(lo, SPARSE_PAGE_SIZE));
+    size_t last = page_id(round_address_down(hi, SPARSE_PAGE_SIZE));
+    if (first >= last)
+        return;
+    last_page = NULL;
+    /* A range with fewer pages than the table has slots is looked up page
+     * by page; a larger one is found by walking the whole table.  Removing
+     * a page may shift the next one back into its slot, so the slot is
+     * looked at again.  dst lies outside the range, so a moved page is
+     * never seen twice. */
+    if (last - first <= table_mask) {
+        for (size_t id = first; id < last; id++) {
+            size_t slot = find_slot(id);
+            if (page_table[slot])
+                move_page(slot, first, dst);
+        }
+        return;
+    }
+    for (size_t slot = 0; slot <= table_mask;) {
+        mem_block_t *block = page_table[slot];
+        if (block && block->id >= first && block->id < last)
+            move_page(slot, first, dst);
+        else
+            slot++;
+    }
+}
+
+/*
+ * Move the page in a slot of the page table as move_pages does, for a
+ * range that starts at page first
+ */
+static void move_page(size_t slot, size_t first, void *dst) {
+    mem_block_t *block = page_table[slot];
+    remove_slot(slot);
+    if (dst) {
+        block->id = block->id - first + page_id(dst);
+        page_table[find_slot(block->id)] = block;
+    } else {
+        block->next = released_pages;
+        released_pages = block;
+        num_free_pages++;
+    }
+}
+
+/* Is [addr, addr + len) emulated memory of the heap or of a region? */
+static bool is_emulated(const void *addr, size_t len) {
+    const unsigned char *lo = addr;
+    return (lo >= heap && lo + len <= mem_brk) ||
+           (lo >= map_area && lo + len <= map_top);
+}
+
+/* Record the current size of the heap and regions if it is a new peak */
+static void update_peak(void) {
+    size_t size = (size_t)(mem_brk - heap) + mapped_bytes;
+    if (size > mem_peak)
+        mem_peak = size;
+}
+
+/* Find the region starting at addr.  Return num_regions if there is none */
+static size_t find_region(const void *addr) {
+    size_t a = 0;
+    size_t b = num_regions;
+    while (a < b) {
+        size_t m = a + (b - a) / 2;
+        if (regions[m].start < (const unsigned char *)addr)
+            a = m + 1;
+        else
+            b = m;
+    }
+    if (a < num_regions && regions[a].start == addr)
+        return a;
+    return num_regions;
+}
+
+/*
+ * Find the lowest gap of at least len bytes in the map area.  Return its
+ * start, and in pos the index a region there would have, or NULL if the
+ * area is full.
+ */
+static unsigned char *find_gap(size_t len, size_t *pos) {
+    unsigned char *lo = map_area;
+    for (size_t i = 0; i < num_regions; i++) {
+        if ((size_t)(regions[i].start - lo) >= len) {
+            *pos = i;
+            return lo;
+        }
+        lo = regions[i].start + regions[i].len;
+    }
+    if ((size_t)(map_area_end - lo) >= len) {
+        *pos = num_regions;
+        return lo;
+    }
+    return NULL;
+}
+
+/* Set the region table entry at pos */
+static void set_region(size_t pos, unsigned char *start, size_t len) {
+    regions[pos].start = start;
+    regions[pos].len = len;
+    map_top = regions[num_regions - 1].start + regions[num_regions - 1].len;
+}
+
+/* Delete the region table entry at pos */
+static void remove_region(size_t pos) {
+    memmove(&regions[pos], &regions[pos + 1],
+            (num_regions - pos - 1) * sizeof(mem_region_t));
+    num_regions--;
+    map_top = num_regions == 0 ? map_area
+                               : regions[num_regions - 1].start +
+                                     regions[num_regions - 1].len;
+}
+
+/*
+ * Discard the pages of [addr, addr + len) in the map area, leaving them
+ * inaccessible.  Return false if that failed.
+ */
+static bool drop_mapping(void *addr, size_t len) {
+    if (sparse) {
+        move_pages(addr, (unsigned char *)addr + len, NULL);
+        return true;
+    }
+    if (mmap(addr, len, PROT_NONE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0) == MAP_FAILED) {
+        fprintf(stderr, "ERROR: unmapping %zu bytes at %p failed (%s)\n", len,
+                addr, strerror(errno));
+        return false;
+    }
+#ifdef USE_ASAN
+    __asan_poison_memory_region(addr, len);
+#endif
+    return true;
+}
+
+/* Hash a page ID to the first slot of the page table to probe */
+static size_t page_hash(size_t id) {
+    return (size_t)(((uint64_t)id * 0x9E3779B97F4A7C15ull) >> 20) & table_mask;
+}
+
+/*
+ * Find the slot of the page table that holds a page ID, or the empty slot
+ * where it would go.  The table is probed linearly, and is never more than
+ * half full.
+ */
+static size_t find_slot(size_t id) {
+    size_t slot = page_hash(id);
+    while (page_table[slot] && page_table[slot]->id != id)
+        slot = (slot + 1) & table_mask;
+    return slot;
+}
+
+/*
+ * Empty a slot of the page table.  The pages probed past it are shifted
+ * back, so that no lookup stops short of its page.
+ */
+static void remove_slot(size_t slot) {
+    size_t hole = slot;
+    for (size_t i = (slot + 1) & table_mask; page_table[i];
+         i = (i + 1) & table_mask) {
+        /* The page in slot i may fill the hole if the hole is on its
+         * probe sequence */
+        size_t home = page_hash(page_table[i]->id);
+        if (((i - home) & table_mask) >= ((i - hole) & table_mask)) {
+            page_table[hole] = page_table[i];
+            hole = i;
+        }
+    }
+    page_table[hole] = NULL;
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite) {
     size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
-    unsigned int i;
-
-    mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
-    if (!block) {
-        /* Need to allocate a new block */
-        if (num_free_pages == 0) {
-            /*
-             * This will often fail due to student code that either accesses
-             *  too many memory locations, such as checking every byte in a
-             *  block.  Or more commonly due to poor utilization, such as
-             *  leaking or not finding the huge allocations.
-             */
-            fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
-            exit(1);
+
+    /* Accesses come in runs on one page, so check the last one first */
+    mem_block_t *block = last_page;
+    if (!block || block->id != id) {
+        size_t slot = find_slot(id);
+        block = page_table[slot];
+        if (!block) {
+            /* Need to allocate a new block */
+            if (num_free_pages == 0) {
+                /*
+                 * This will often fail due to student code that either
+                 *  accesses too many memory locations, such as checking
+                 *  every byte in a block.  Or more commonly due to poor
+                 *  utilization, such as leaking or not finding the huge
+                 *  allocations.
+                 */
+                fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
+                exit(1);
+            }
+            if (released_pages) {
+                block = released_pages;
+                released_pages = block->next;
+            } else {
+                block = next_free_page++;
+            }
+            num_free_pages--;
+            block->id = id;
+            memset(block->initSet, 0, sizeof(block->initSet));
+            page_table[slot] = block;
         }
-        block = next_free_page++;
-        num_free_pages--;
-        block->id = id;
-        block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
-        page_table[b] = block;
+        last_page = block;
     }
 
     // Convert an emulated address into an offset
@@ -580,34 +1190,35 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
     assert(offset >= 0);
 
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = (size_t)offset / 8;
-    size_t offsetBit = (size_t)offset & 0x7ul;
-
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++) {
+    // Update or check the bits that track the use / initialization of
+    //  the emulated bytes of this access, a word of the bit vector at a
+    //  time.  The access is cut off at the end of the page.
+    size_t end = (size_t)offset + size;
+    if (end > SPARSE_PAGE_SIZE)
+        end = SPARSE_PAGE_SIZE;
+    for (size_t bit = (size_t)offset; bit < end;) {
+        size_t shift = bit % 64;
+        size_t nbits = end - bit < 64 - shift ? end - bit : 64 - shift;
+        uint64_t mask = (nbits == 64 ? ~(uint64_t)0
+                                     : (((uint64_t)1 << nbits) - 1))
+                        << shift;
+        uint64_t *word = &block->initSet[bit / 64];
         if (isWrite) {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
-        } else if (checkUB &&
-                   (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0) {
+            *word |= mask;
+        } else if (checkUB && (*word & mask) != mask) {
             // The student code has attempted to read an address that was
             //  never written to.  Students should set a breakpoint on this
             //  line / check and then backtrace to where their code has
             //  made the memory access.
+            size_t i = bit - (size_t)offset +
+                       (size_t)__builtin_ctzll(~*word & mask) - shift;
             fprintf(stderr,
                     "Attempt to read uninitialized address %p, see %s:%d for "
                     "details\n",
                     (addr + i), __FILE__, __LINE__);
             abort();
         }
-        offsetBit++;
-        if (offsetBit == 8) {
-            offsetBit = 0;
-            offsetIdx++;
-        }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
+        bit += nbits;
     }
 #endif
 
@@ -24,18 +24,95 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. When the heap
+ * shrinks, the pages above the new break are returned to the system. It
+ * may be called from several threads at once.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `-incr <= mem_heapsize()`
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Returns the whole pages in a range of the heap, or of a mapped
+ * region, to the system.
+ *
+ * The range stays part of the heap and may be used again at any time, but
+ * its contents are lost: the pages read back as zero in the regular driver,
+ * and as uninitialized in emulation.
+ *
+ * @param[in] addr The start of the range
+ * @param[in] len  The length of the range, in bytes
+ * @pre The range lies within the heap or within one mapped region
+ */
+void mem_release(void *addr, size_t len);
+
+/**
+ * @brief Checks whether memory new to the heap or to a mapped region, or
+ * given back with mem_release, reads as zero.
+ *
+ * This holds in the regular driver. Emulation and MemorySanitizer treat
+ * such memory as uninitialized instead, so it must still be written before
+ * it is read.
+ *
+ * @return True if the allocator may rely on fresh memory being zero
+ */
+bool mem_zero_filled(void);
+
+/**
+ * @brief Maps a region of memory outside the heap, like mmap().
+ *
+ * Regions lie in an area of their own just above the heap, and do not move
+ * the break. Their pages read as zero in the regular driver. It may be
+ * called from several threads at once, as may mem_unmap and mem_remap.
+ *
+ * @param[in] len The size of the region, rounded up to whole pages
+ * @return The page-aligned start of the region, or (void *)-1 on failure
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Unmaps a whole region returned by mem_map or mem_remap.
+ * @param[in] addr The start of the region
+ * @return 0 on success, or -1 if addr is not the start of a region
+ */
+int mem_unmap(void *addr);
+
+/**
+ * @brief Resizes a region returned by mem_map or mem_remap, like mremap().
+ *
+ * The region is grown or shrunk in place if there is room; otherwise its
+ * pages are moved to a new place, without copying their contents.
+ *
+ * @param[in] addr The start of the region
+ * @param[in] len  The new size of the region, rounded up to whole pages
+ * @return The new start of the region, or (void *)-1 on failure, in which
+ *         case the region is left as it was
+ */
+void *mem_remap(void *addr, size_t len);
+
+/**
+ * @brief Finds the low address of the area for mapped regions.
+ *
+ * Every region lies at or above this address, and the whole heap below it.
+ * The address does not change until mem_deinit.
+ *
+ * @return The start of the area for regions from mem_map
+ */
+void *mem_map_lo(void);
+
+/**
+ * @brief Checks whether a range of memory lies within one mapped region.
+ * @param[in] addr The start of the range
+ * @param[in] len  The length of the range, in bytes
+ * @return True if the range lies within a region from mem_map or mem_remap
+ */
+bool mem_in_map(const void *addr, size_t len);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
@@ -63,6 +140,36 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest size the heap and the mapped regions have had
+ * together since the last reset.
+ * @return The peak size of the heap and regions, in bytes
+ */
+size_t mem_heap_peak(void);
+
+/**
+ * @brief Returns the number of heap and mapped bytes currently backed by
+ * memory.
+ *
+ * Pages that were never touched, or that were given back by mem_release or
+ * by shrinking the heap, do not count.
+ *
+ * @return The resident size of the heap, in bytes
+ */
+size_t mem_resident(void);
+
+/**
+ * @brief Returns the number of calls of mem_sbrk since the last reset.
+ * @return The number of calls, including failed ones
+ */
+size_t mem_sbrk_calls(void);
+
+/**
+ * @brief Returns the time spent in mem_sbrk since the last reset.
+ * @return The time, in seconds
+ */
+double mem_sbrk_secs(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -172,6 +172,41 @@ void *calloc(size_t nmemb, size_t size) {
     return newptr;
 }
 
+/*
+ * mm_malloc_batch - Allocate the blocks one at a time.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if ((ptrs[i] = malloc(size)) == NULL)
+            break;
+    }
+    return i;
+}
+
+/*
+ * mm_free_batch - Free the blocks one at a time, which is to say not at all.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+/*
+ * mm_get_stats - No statistics are kept.
+ */
+bool mm_get_stats(mm_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return false;
+}
+
+/*
+ * mm_get_snapshot - The heap has no blocks to walk.
+ */
+bool mm_get_snapshot(mm_snapshot_t *snap) {
+    return false;
+}
+
 /*
  * mm_checkheap - There are no bugs in my code, so I don't need to
  *      check, so nah! (But if I did, I could call this function using
@@ -14,6 +14,30 @@
  * Store extra information in the header -> Create helpers to extract
  * information and fast check if needed
  *
+ * Requests of at most 128 bytes are served from slabs: chunksize blocks
+ * split into equal, header-free slots that are never coalesced. Larger
+ * requests use boundary-tagged blocks on the segregated lists; only free
+ * blocks carry a footer, so an allocated block costs one header word.
+ * Free blocks of 2048 bytes or more share the last class, which is a
+ * splay tree ordered by size and address instead of a list, so they are
+ * placed by true best fit. Its nodes live in the free payloads.
+ * FREE_ORDER can keep the other classes in address order too, each in a
+ * tree keyed by address.
+ *
+ * Allocations are kept together in memory where fit allows: a list class
+ * hands out a fitting block within NEAR_WINDOW bytes of the last block
+ * allocated before looking for a better fit, and a size class keeps
+ * filling the slab it is on while slots free up in other slabs.
+ *
+ * Freed blocks of up to 384 bytes wait on a quick-list per size, still
+ * marked allocated, so that a block freed and then requested again is not
+ * coalesced and split in between. A quick-list is coalesced in bulk when
+ * it overflows, and all of them before the heap would be extended.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more do not use the heap at all:
+ * each gets a region of its own from mem_map, which is unmapped when it is
+ * freed and remapped, not copied, when realloc resizes it.
+ *
  *************************************************************************
  * @author Tram Tran <tntran@andrew.cmu.edu>
  */
@@ -27,6 +51,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
 
@@ -82,8 +111,17 @@
 
 /* Basic constants */
 #define SEG_LENGTH 15
+
+/* Slab size classes: one per slot size 16, 32, ..., 128 bytes */
+#define SLAB_CLASSES 8
+
+/* Quick-list classes: one per block size 144, 160, ..., 384 bytes */
+#define QUICK_CLASSES 16
 typedef uint64_t word_t;
 
+/* The exact classes come first, so there must be room for a range class */
+_Static_assert(SEG_LENGTH > 8, "SEG_LENGTH must exceed the exact classes");
+
 /** @brief Word and header size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
@@ -93,12 +131,196 @@ static const size_t dsize = 2 * wsize;
 /** @brief Minimum block size (bytes) */
 static const size_t min_block_size = dsize;
 
+/**
+ * @brief Number of leading size classes that each hold a single block size
+ * (16, 32, ..., 128 bytes)
+ */
+static const size_t num_exact_classes = 8;
+
+/** @brief Largest request served from a slab instead of a block */
+static const size_t slab_max_size = SLAB_CLASSES * dsize;
+
+/**
+ * @brief Segregated class whose free blocks form a splay tree ordered by
+ * size, then address, instead of a list; seg_list holds the root.
+ */
+static const size_t tree_index = SEG_LENGTH - 1;
+
+/**
+ * @brief First segregated class whose free blocks form a tree instead of a
+ * list (see FREE_ORDER). Every class from here to tree_index is kept in
+ * address order. A tree node and a footer need blocks of 48 bytes.
+ */
+#if FREE_ORDER == ORDER_ADDRESS
+static const size_t first_tree_class = 2;
+#elif FREE_ORDER == ORDER_ADDRESS_LARGE
+static const size_t first_tree_class = 8;
+#else
+static const size_t first_tree_class = SEG_LENGTH - 1;
+#endif
+
+/*
+ * Smallest block size of each range class after the first, the last being
+ * the tree class. The first range class starts at 144 bytes, past the
+ * exact classes; classes 8 and 9 hold nothing by default. classgen fits
+ * the bounds to the requests of a set of traces and writes them to a
+ * header, which SIZE_CLASS_TABLE names at build time. They are constants
+ * rather than a table, so the lookup compares against immediates and
+ * takes no global data.
+ */
+#ifdef SIZE_CLASS_TABLE
+#include SIZE_CLASS_TABLE
+#else
+#define RANGE_CLASS_BOUND_9 144
+#define RANGE_CLASS_BOUND_10 144
+#define RANGE_CLASS_BOUND_11 256
+#define RANGE_CLASS_BOUND_12 512
+#define RANGE_CLASS_BOUND_13 1024
+#define RANGE_CLASS_BOUND_14 2048
+#endif
+
+_Static_assert(SEG_LENGTH == 15,
+               "RANGE_CLASS_BOUND_* must bound every class past class 8");
+_Static_assert(RANGE_CLASS_BOUND_9 <= RANGE_CLASS_BOUND_10 &&
+                   RANGE_CLASS_BOUND_10 <= RANGE_CLASS_BOUND_11 &&
+                   RANGE_CLASS_BOUND_11 <= RANGE_CLASS_BOUND_12 &&
+                   RANGE_CLASS_BOUND_12 <= RANGE_CLASS_BOUND_13 &&
+                   RANGE_CLASS_BOUND_13 <= RANGE_CLASS_BOUND_14,
+               "RANGE_CLASS_BOUND_* must not decrease");
+
+/*
+ * The default bounds double from 256 bytes, so get_seg_index can find a
+ * range class from the highest set bit of the size. Bounds from classgen
+ * are compared against one by one.
+ */
+#if RANGE_CLASS_BOUND_9 == 144 && RANGE_CLASS_BOUND_10 == 144 &&             \
+    RANGE_CLASS_BOUND_11 == 256 && RANGE_CLASS_BOUND_12 == 512 &&            \
+    RANGE_CLASS_BOUND_13 == 1024 && RANGE_CLASS_BOUND_14 == 2048
+#define RANGE_CLASS_POW2 1
+#else
+#define RANGE_CLASS_POW2 0
+#endif
+
+/** @brief Block size of the first quick-list class */
+static const size_t quick_min_size = SLAB_CLASSES * dsize + dsize;
+
+/**
+ * @brief Extra room, in percent of the new size, that realloc reserves when
+ * it grows a block, so that further growth can stay in place. The room is
+ * given back before the heap is extended for another request. Set to 0 at
+ * build time to turn the policy off.
+ */
+#ifndef REALLOC_HEADROOM
+#define REALLOC_HEADROOM 50
+#endif
+
+/**
+ * @brief Blocks per arena whose headroom is tracked, so that it can be given
+ * back when the heap would otherwise have to grow. Past that, the block
+ * tracked longest is trimmed to make room.
+ */
+#define HEADROOM_BLOCKS 4
+
+/**
+ * @brief Freed blocks that each quick-list class holds, uncoalesced, before
+ * the class is coalesced in bulk. Set to 0 at build time to coalesce every
+ * block as soon as it is freed.
+ */
+#ifndef QUICK_LIMIT
+#define QUICK_LIMIT 16
+#endif
+
+/**
+ * @brief Order of the free blocks in the segregated classes. ORDER_LIFO puts
+ * a freed block at the head of its class list. ORDER_ADDRESS keeps every
+ * class of blocks of 48 bytes or more in address order, and
+ * ORDER_ADDRESS_LARGE only the range classes (144 bytes or more). An
+ * ordered class is a splay tree keyed by address, like the tree of the
+ * largest class, so a block is inserted without walking the class. The
+ * largest class is always ordered by size, then address.
+ */
+#define ORDER_LIFO 0
+#define ORDER_ADDRESS 1
+#define ORDER_ADDRESS_LARGE 2
+#ifndef FREE_ORDER
+#define FREE_ORDER ORDER_LIFO
+#endif
+
+/**
+ * @brief Size of a free block at the end of the heap, in bytes, from which
+ * the heap is shrunk to leave a block of about half that size. Set to 0 at
+ * build time to never shrink the heap.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 18)
+#endif
+
+/**
+ * @brief Size of a free block, in bytes, from which the whole pages of its
+ * freed memory are given back to the system. Set to 0 at build time to keep
+ * every page of the heap resident.
+ */
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD (1 << 16)
+#endif
+
+/**
+ * @brief Requests of at least this many bytes get a region of their own
+ * from mem_map, outside the heap, which is unmapped when it is freed. Set
+ * to 0 at build time to serve every request from the heap.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 20)
+#endif
+
+/**
+ * @brief Largest heap extension, in bytes, that a run of extensions grows
+ * to. The heap is extended by at most 1/GROW_FRACTION of its size past
+ * the request, so that the unused end of the last extension costs little
+ * utilization. Set to 0 at build time to always extend by chunksize.
+ */
+#ifndef GROW_MAX
+#define GROW_MAX (1 << 18)
+#endif
+#ifndef GROW_FRACTION
+#define GROW_FRACTION 256
+#endif
+
+/**
+ * @brief Distance in bytes from the end of the block allocated last within
+ * which a fitting free block is taken at once, instead of the best of a
+ * few. Blocks allocated one after another then tend to share pages and
+ * cache lines. Set to 0 at build time to always take the best fit.
+ */
+#ifndef NEAR_WINDOW
+#define NEAR_WINDOW 4096
+#endif
+
+/**
+ * @brief Allocations between two heap extensions, at most, for the second
+ * one to double the extension size. Every further GROW_WINDOW allocations
+ * without one halve it back towards chunksize.
+ */
+#ifndef GROW_WINDOW
+#define GROW_WINDOW 64
+#endif
+
+/**
+ * @brief Set to 1 at build time to keep the counters that mm_get_stats
+ * reads. They are off by default, since they cost a little time on every
+ * call and grow the arena metadata at the start of the heap.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
 /**
  * @brief Memory that the allocator requests from the system when it needs to
  *        expand the heap
  * (Must be divisible by dsize)
  */
-static const size_t chunksize = (1 << 12);
+#define CHUNKSIZE (1 << 12)
+static const size_t chunksize = CHUNKSIZE;
 
 /**
  * @brief Bit mask to isolate allocation status
@@ -116,6 +338,14 @@ static const word_t prev_alloc_mask = 0x2;
  */
 static const word_t prev_min_tag_mask = 0x4;
 
+/**
+ * @brief Bit mask to isolate the flag of a free mini block. Its size is
+ * implicitly min_block_size, and the size bits of its header hold its
+ * predecessor in seg_list[0] instead, since there is no room for a prev
+ * pointer in the payload.
+ */
+static const word_t mini_free_mask = 0x8;
+
 /**
  * @brief Bit mask to isolate size of block
  */
@@ -131,17 +361,149 @@ typedef struct block {
             struct block *next;
             struct block *prev;
         } linkList;
+        struct {
+            struct block *left;
+            struct block *right;
+            struct block *parent;
+        } treeNode; /* Free blocks in the largest class */
         char data[0];
     } payLoad;
 } block_t;
 
-/* Global variables */
-/** @brief Array of 13 class sizes */
-static block_t *seg_list[SEG_LENGTH];
+/**
+ * @brief Header of a slab: one allocated block of chunksize bytes, carved
+ * into equal slots for one small size class. Slots have no header of their
+ * own and are never coalesced; a set bit in free_map marks a free slot.
+ *
+ * A slab's payload starts on the slab grid (a multiple of chunksize past
+ * the first payload of the heap), so the slab of a slot is found by
+ * rounding the slot address down to the grid.
+ */
+typedef struct slab {
+    struct slab *next; /* Other partial slabs of the same class */
+    struct slab *prev;
+    word_t slot_size;
+    word_t free_count;
+    word_t free_map[4];
+} slab_t;
+
+/* Slots are 16-byte aligned, and a slab of 16-byte slots fits free_map */
+_Static_assert(sizeof(slab_t) % 16 == 0, "slab_t must keep slots aligned");
+_Static_assert(((1 << 12) - sizeof(word_t) - sizeof(slab_t)) / 16 <= 4 * 64,
+               "free_map must cover every slot of a slab");
+
+/** @brief Number of independent heaps (arenas) */
+#ifdef THREAD_SAFE
+#define NUM_ARENAS 4
+#else
+#define NUM_ARENAS 1
+#endif
+
+/**
+ * @brief Allocator bookkeeping for one arena. The arenas live at the very
+ * start of the heap, just before the prologue, so they do not count against
+ * the global data budget.
+ */
+typedef struct heap_meta {
+    word_t class_bitmap; /* Bit i is set iff seg_list[i] is non-empty */
+    block_t *seg_list[SEG_LENGTH]; /* Heads of the segregated free lists */
+    slab_t *slab_list[SLAB_CLASSES]; /* Slabs with a free slot, per class */
+    word_t quick_bitmap; /* Bit i is set iff quick_list[i] is non-empty */
+    block_t *quick_list[QUICK_CLASSES]; /* Freed blocks not yet coalesced */
+    unsigned quick_count[QUICK_CLASSES]; /* Length of each quick-list */
+    block_t *roomy[HEADROOM_BLOCKS]; /* Blocks grown past their need */
+    size_t roomy_need[HEADROOM_BLOCKS]; /* Block size each one needs */
+    unsigned roomy_count; /* Entries in use in roomy */
+#ifndef THREAD_SAFE
+    word_t *slab_map;      /* Bit i is set iff slab grid page i is a slab */
+    size_t slab_map_words; /* Length of slab_map */
+    char *fresh;           /* No block has been allocated from here on */
+#endif
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock; /* Protects the lists and this arena's blocks */
+    block_t *remote_free; /* Blocks freed by threads of other arenas */
+    block_t *epilogue;    /* Epilogue of this arena's newest chunk */
+#endif
+    size_t heap_size;  /* Bytes of heap that this arena has extended */
+    size_t grow_size;  /* Size of the arena's next heap extension */
+    word_t alloc_ops;  /* Blocks and slabs allocated by this arena */
+    word_t grow_ops;   /* alloc_ops at the last heap extension */
+    char *cursor;      /* End of the block allocated last */
+    mm_stats_t stats;  /* Counters read by mm_get_stats; must come last */
+} heap_meta_t;
 
+/* Global variables */
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
+#ifdef THREAD_SAFE
+/*
+ * Thread-safe build mode. Threads are spread round-robin over NUM_ARENAS
+ * arenas, each with its own segregated lists and lock. An arena grows in
+ * whole chunks of the heap: when another arena has grown the heap since it
+ * last did, the new chunk gets its own prologue and epilogue, so blocks of
+ * different arenas never coalesce. chunk_owner records which arena each
+ * chunk belongs to, and whether it is a slab, so both are found from an
+ * address.
+ *
+ * Each thread also keeps a small cache of freed slots for each slab class.
+ * An arena's lists and slabs are only touched while holding its lock, which
+ * happens on a cache refill or flush, or for requests above the slab
+ * classes. A block freed by a thread of another arena is pushed onto the
+ * owner's remote_free stack without a lock, and the owner frees it the next
+ * time it takes its lock.
+ *
+ * Cached and remotely freed blocks and slots still count as allocated, so
+ * neighbours never coalesce with them; they are linked through the first
+ * payload word.
+ */
+
+/** @brief Number of slab classes that have a thread cache */
+#define TCACHE_CLASSES SLAB_CLASSES
+
+/** @brief Maximum number of blocks cached per class before a flush */
+static const unsigned tcache_limit = 32;
+
+/** @brief Number of blocks moved per refill or flush */
+static const unsigned tcache_batch = 16;
+
+/**
+ * @brief Heap span covered by chunk_owner, in chunksize units. This is
+ * memlib's dense heap limit.
+ */
+#define ARENA_MAX_CHUNKS (MAX_DENSE_HEAP / CHUNKSIZE)
+
+_Static_assert(MAX_DENSE_HEAP % CHUNKSIZE == 0,
+               "chunksize must divide the heap limit");
+
+/** @brief Per-thread cache of freed slots for the slab classes */
+typedef struct tcache {
+    block_t *head[TCACHE_CLASSES];
+    unsigned count[TCACHE_CLASSES];
+    heap_meta_t *arena; /* Arena this thread allocates from */
+    word_t generation;  /* heap_generation this cache was filled under */
+    bool registered;    /* exit destructor installed for this thread */
+} tcache_t;
+
+/** @brief Arena index of each chunk after the initial prologue */
+static unsigned char chunk_owner[ARENA_MAX_CHUNKS];
+
+/** @brief Flag in chunk_owner marking a chunk that is a slab */
+static const unsigned char chunk_slab_flag = 0x80;
+
+/** @brief Arena handed to the next thread, reset by mm_init */
+static unsigned arena_next = 0;
+
+/** @brief Bumped by mm_init, so caches holding blocks of an old heap reset */
+static word_t heap_generation = 0;
+
+/** @brief Key whose destructor flushes a thread's cache when it exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local tcache_t tcache;
+#endif /* def THREAD_SAFE */
+
 /************* FUNCTION LISTS *************/
 
 void *malloc(size_t size);
@@ -155,8 +517,46 @@ static block_t *extend_heap(size_t size);
 static block_t *coalesce_block(block_t *block);
 static block_t *find_fit(size_t asize);
 static void split_block(block_t *block, size_t asize);
+static void *heap_malloc(size_t size);
+static void heap_free(void *bp);
+static void release_block(block_t *block, char *lo, char *hi);
+static size_t heap_malloc_batch(size_t size, size_t n, void **ptrs);
+static void heap_free_batch(void **ptrs, size_t n);
+static void sort_pointers(void **ptrs, size_t n);
+static bool resize_block(block_t *block, size_t asize, size_t reserve);
+static block_t *alloc_block(size_t asize);
+static size_t get_extend_size(heap_meta_t *meta, size_t size);
+
+static void stats_add(size_t *counter, size_t n);
+static mm_stats_t *get_stats(void);
+static void count_blocks(size_t *counters, size_t size, size_t n);
+
+static slab_t *get_slab(const void *bp);
+static bool is_slab(const void *bp);
+static bool is_valid_slabs(heap_meta_t *meta, int line);
+static bool is_valid_quick_lists(heap_meta_t *meta, int line);
+static bool is_valid_tree(heap_meta_t *meta, size_t idx, int line);
+static size_t get_quick_index(size_t size);
+static void flush_quick_class(heap_meta_t *meta, size_t idx);
+static bool flush_quick_lists(heap_meta_t *meta);
+static bool set_slab_page(slab_t *slab, bool is_slab_page);
+static size_t get_slab_slots(size_t slot_size);
+static void *slab_malloc(size_t size);
+static void slab_free(void *bp);
+static size_t get_headroom(size_t size);
+static void trim_block(block_t *block, size_t asize);
+static void track_headroom(heap_meta_t *meta, block_t *block, size_t asize);
+static void untrack_headroom(heap_meta_t *meta, block_t *block);
+static bool trim_headroom(heap_meta_t *meta);
+static bool use_map(size_t size);
+static bool is_mapped(const void *bp);
+static void *map_malloc(size_t size);
+static void map_free(void *bp);
+static void *map_realloc(void *bp, size_t size);
+static size_t adjust_size(size_t size);
 
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
 
 static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_min_alloc);
@@ -165,6 +565,7 @@ static size_t get_size(block_t *block);
 static size_t get_payload_size(block_t *block);
 static block_t *payload_to_header(void *bp);
 static void *header_to_payload(block_t *block);
+static void *slot_to_payload(block_t *block);
 static word_t *header_to_footer(block_t *block);
 static block_t *footer_to_header(word_t *footer);
 
@@ -178,9 +579,28 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
+static void set_prev_tags(block_t *block, bool prev_alloc, bool prev_min);
+static block_t *get_mini_prev(block_t *block);
+static void set_mini_prev(block_t *block, block_t *prev);
 static void add_node(block_t *block);
 static void delete_node(block_t *block);
+static void tree_insert(heap_meta_t *meta, size_t idx, block_t *block);
+static void tree_remove(heap_meta_t *meta, size_t idx, block_t *block);
+static block_t *tree_find_fit(heap_meta_t *meta, size_t asize);
+static block_t *tree_minimum(block_t *node);
+static block_t *tree_successor(block_t *node);
 static size_t get_seg_index(size_t size);
+static size_t get_meta_size(void);
+static heap_meta_t *get_arena(size_t i);
+static heap_meta_t *get_meta(void);
+static block_t *skip_fences(block_t *block);
+static void note_alloc(block_t *block);
+static bool is_near(heap_meta_t *meta, block_t *block);
+static void clear_payload(void *bp, size_t size, const char *fresh);
+#ifdef THREAD_SAFE
+static heap_meta_t *arena_of(block_t *block);
+static void tcache_prepare(void);
+#endif
 
 /*
 *****************************************************************************
@@ -212,6 +632,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the minimum of two integers.
+ * @param[in] x
+ * @param[in] y
+ * @return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -251,13 +681,14 @@ static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_min_alloc
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. Free mini blocks keep a list pointer in those bits,
+ * so their size is always reported as min_block_size.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
-    return (word & size_mask);
+    return (word & mini_free_mask) ? min_block_size : (word & size_mask);
 }
 
 /**
@@ -291,6 +722,19 @@ static void *header_to_payload(block_t *block) {
     return (void *)(block->payLoad.data);    
 }
 
+/**
+ * @brief Given the block pointer of a slab slot, returns a pointer to its
+ *        payload.
+ *
+ * A slot has no header: the word before its payload belongs to the slot
+ * below it, so unlike header_to_payload this reads nothing.
+ * @param[in] block
+ * @return A pointer to the slot's payload
+ */
+static void *slot_to_payload(block_t *block) {
+    return (void *)(block->payLoad.data);
+}
+
 /**
  * @brief Given a block pointer, returns a pointer to the corresponding
  *        footer.
@@ -415,8 +859,22 @@ static void write_block(block_t *block, size_t size, bool alloc) {
 
     /* Update the flag of next block */
     block_t* block_next = find_next(block);
-    block_next->header = pack(get_size(block_next), get_alloc(block_next), alloc, get_size(block) == min_block_size);
-    
+    set_prev_tags(block_next, alloc, get_size(block) == min_block_size);
+}
+
+/**
+ * @brief Updates the flags a block keeps about its predecessor on the heap.
+ *
+ * Only the two prev bits are rewritten, so the size bits are preserved even
+ * when they hold the list link of a free mini block.
+ *
+ * @param[out] block The block whose header is updated
+ * @param[in] prev_alloc True if the previous block is allocated
+ * @param[in] prev_min True if the previous block is a mini block
+ */
+static void set_prev_tags(block_t *block, bool prev_alloc, bool prev_min) {
+    word_t header = block->header & ~(prev_alloc_mask | prev_min_tag_mask);
+    block->header = header | pack(0, false, prev_alloc, prev_min);
 }
 
 /**
@@ -483,44 +941,421 @@ static bool get_prev_alloc(word_t header) {
 }
 
 /**
- * @brief Initiliaze the segregated list
+ * @brief Returns the size of the heap metadata area, rounded up so that
+ * the prologue that follows it keeps payloads 16-byte aligned. Without
+ * MM_STATS the counters at the end of heap_meta_t are never touched, so
+ * no room is reserved for them.
+ * @return The number of bytes reserved for heap_meta_t
+ */
+static size_t get_meta_size(void) {
+#if MM_STATS > 0
+    return round_up(sizeof(heap_meta_t), dsize);
+#else
+    return round_up(offsetof(heap_meta_t, stats), dsize);
+#endif
+}
+
+/**
+ * @brief Returns one of the arenas, which sit one after another right
+ * before the prologue.
+ * @param[in] i The arena index, below NUM_ARENAS
+ * @return A pointer to the arena's metadata
+ * @pre The heap must have been initialized by mm_init
+ */
+static heap_meta_t *get_arena(size_t i) {
+    dbg_requires(heap_start != NULL);
+    char *base = (char *)heap_start - wsize - NUM_ARENAS * get_meta_size();
+    return (heap_meta_t *)(base + i * get_meta_size());
+}
+
+/**
+ * @brief Returns the metadata of the arena the caller allocates from.
+ *
+ * In the thread-safe build this is the calling thread's arena, and its lock
+ * must be held before the lists are touched.
+ *
+ * @return A pointer to the arena's metadata
+ */
+static heap_meta_t *get_meta(void) {
+#ifdef THREAD_SAFE
+    return tcache.arena;
+#else
+    return get_arena(0);
+#endif
+}
+
+/**
+ * @brief Moves the fresh mark of the heap past a block just allocated, and
+ * the cursor of the arena to its end (see NEAR_WINDOW).
+ *
+ * Memory at or above the mark has never been handed out since the heap
+ * grew over it, so it is still zero, except for the header and links of
+ * the free block that holds the mark, which end within sizeof(block_t)
+ * bytes past it, and the footer of that block. calloc does not clear it.
+ * The thread-safe build keeps no mark.
+ *
+ * @param[in] block An allocated block
+ */
+static void note_alloc(block_t *block) {
+    char *end = (char *)find_next(block);
+    heap_meta_t *meta = get_meta();
+    meta->cursor = end;
+#ifndef THREAD_SAFE
+    if (end > meta->fresh) {
+        meta->fresh = end;
+    }
+#endif
+}
+
+/**
+ * @brief Checks whether a block starts within NEAR_WINDOW bytes of the
+ * cursor of an arena, the end of the block it allocated last.
+ * @param[in] meta The arena
+ * @param[in] block A free block
+ */
+static bool is_near(heap_meta_t *meta, block_t *block) {
+#if NEAR_WINDOW > 0
+    char *at = (char *)block;
+    size_t dist = (at >= meta->cursor) ? (size_t)(at - meta->cursor)
+                                       : (size_t)(meta->cursor - at);
+    return dist < NEAR_WINDOW;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Initiliaze the segregated list, its occupancy bitmap, the slab
+ * lists and the quick-lists
+ * @param[out] meta The arena whose lists are emptied
  */
-static void init_seg_list() {
+static void init_seg_list(heap_meta_t *meta) {
     for (int i = 0; i < SEG_LENGTH; i++) {
-        seg_list[i] = NULL;
+        meta->seg_list[i] = NULL;
+    }
+    meta->class_bitmap = 0;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        meta->slab_list[i] = NULL;
     }
+    meta->quick_bitmap = 0;
+    for (int i = 0; i < QUICK_CLASSES; i++) {
+        meta->quick_list[i] = NULL;
+        meta->quick_count[i] = 0;
+    }
+    meta->roomy_count = 0;
+#ifndef THREAD_SAFE
+    meta->slab_map = NULL;
+    meta->slab_map_words = 0;
+#endif
+    meta->heap_size = 0;
+    meta->grow_size = chunksize;
+    meta->alloc_ops = 0;
+    meta->grow_ops = 0;
+    meta->cursor = NULL;
+#if MM_STATS > 0
+    memset(&meta->stats, 0, sizeof(meta->stats));
+#endif
 }
 
 /**
  * @brief Return the index of current position in the segregated list
  *
+ * Classes 0 to 7 hold exactly one size each (16, 32, ..., 128 bytes), so
+ * they map directly to (size / 16) - 1. Every other size goes to range
+ * class 8 plus the number of RANGE_CLASS_BOUND_* at or below it, so the
+ * last class catches all sizes from the last bound up.
+ *
+ * With the default bounds that number comes from the position of the
+ * highest set bit of (size / 32); with bounds from classgen it is a sum
+ * of comparisons against constants. Both indices are computed and then
+ * selected, so there is no loop, no load and no data-dependent branch on
+ * this hot path.
+ *
  * @param[in] size The size of the current block we are checking
  * @return The index based on the size
  */
 static size_t get_seg_index(size_t size) {
-    size_t sizes[] = {min_block_size, 32, 48, 64, 80, 96, 112, 128};
+    size_t exact_idx = (size >> 4) - 1;
+
+#if RANGE_CLASS_POW2
+    /* OR in 1 so sizes below 64 land in the first range class */
+    size_t log2 = (size_t)(63 - __builtin_clzl((size >> 5) | 1));
+    size_t range_idx = num_exact_classes + log2;
+    if (range_idx > SEG_LENGTH - 1) {
+        range_idx = SEG_LENGTH - 1;
+    }
+#else
+    size_t range_idx =
+        num_exact_classes +
+        (size_t)((size >= RANGE_CLASS_BOUND_9) +
+                 (size >= RANGE_CLASS_BOUND_10) +
+                 (size >= RANGE_CLASS_BOUND_11) +
+                 (size >= RANGE_CLASS_BOUND_12) +
+                 (size >= RANGE_CLASS_BOUND_13) +
+                 (size >= RANGE_CLASS_BOUND_14));
+#endif
+
+    bool is_exact = (size & ~size_mask) == 0 &&
+                    size - 1 < num_exact_classes * min_block_size;
+    return is_exact ? exact_idx : range_idx;
+}
+
+/**
+ * @brief Returns the predecessor of a free mini block in seg_list[0].
+ * @param[in] block A free mini block that is on the list
+ * @return The previous block in the list, or NULL if block is the head
+ */
+static block_t *get_mini_prev(block_t *block) {
+    dbg_requires(block->header & mini_free_mask);
+    word_t prev_payload = block->header & size_mask;
+    if (prev_payload == 0) {
+        return NULL;
+    }
+    return payload_to_header((void *)prev_payload);
+}
+
+/**
+ * @brief Stores the predecessor of a free mini block in its header.
+ *
+ * The predecessor is recorded by its payload address, which is 16-byte
+ * aligned and so leaves the low 4 bits free. This marks the block as a free
+ * mini block, and keeps its flag bits.
+ *
+ * @param[out] block A free mini block
+ * @param[in] prev The previous block in seg_list[0], or NULL
+ */
+static void set_mini_prev(block_t *block, block_t *prev) {
+    word_t flags = block->header & (prev_alloc_mask | prev_min_tag_mask);
+    word_t prev_payload = (prev == NULL) ? 0 : (word_t)header_to_payload(prev);
+    block->header = prev_payload | mini_free_mask | flags;
+}
+
+/**
+ * @brief Orders the blocks of a free tree: those of the largest class by
+ * size, then by address, and those of any other class by address.
+ * @param[in] idx The class of the tree
+ * @param[in] a A free block
+ * @param[in] b Another free block
+ * @return True if a comes before b
+ */
+static bool tree_less(size_t idx, block_t *a, block_t *b) {
+    if (idx != tree_index) {
+        return a < b;
+    }
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * @brief Points the parent of a subtree, or the root, at a new subtree.
+ * @param[out] root The root of the tree
+ * @param[in] u The subtree being replaced
+ * @param[in] v The new subtree, or NULL
+ */
+static void tree_replace(block_t **root, block_t *u, block_t *v) {
+    block_t *parent = u->payLoad.treeNode.parent;
+    if (parent == NULL) {
+        *root = v;
+    } else if (u == parent->payLoad.treeNode.left) {
+        parent->payLoad.treeNode.left = v;
+    } else {
+        parent->payLoad.treeNode.right = v;
+    }
+    if (v != NULL) {
+        v->payLoad.treeNode.parent = parent;
+    }
+}
+
+/**
+ * @brief Rotates a node of a free tree down to the left.
+ * @param[out] root The root of the tree
+ * @param[in] x A node with a right child
+ */
+static void tree_rotate_left(block_t **root, block_t *x) {
+    block_t *y = x->payLoad.treeNode.right;
+    x->payLoad.treeNode.right = y->payLoad.treeNode.left;
+    if (y->payLoad.treeNode.left != NULL) {
+        y->payLoad.treeNode.left->payLoad.treeNode.parent = x;
+    }
+    tree_replace(root, x, y);
+    y->payLoad.treeNode.left = x;
+    x->payLoad.treeNode.parent = y;
+}
 
-    size_t num = sizeof(sizes) / sizeof(sizes[0]);
+/**
+ * @brief Rotates a node of a free tree down to the right.
+ * @param[out] root The root of the tree
+ * @param[in] x A node with a left child
+ */
+static void tree_rotate_right(block_t **root, block_t *x) {
+    block_t *y = x->payLoad.treeNode.left;
+    x->payLoad.treeNode.left = y->payLoad.treeNode.right;
+    if (y->payLoad.treeNode.right != NULL) {
+        y->payLoad.treeNode.right->payLoad.treeNode.parent = x;
+    }
+    tree_replace(root, x, y);
+    y->payLoad.treeNode.right = x;
+    x->payLoad.treeNode.parent = y;
+}
 
-    for (size_t i = 0; i < num; i++) {
-        if (size == sizes[i]) {
-            return i;
+/**
+ * @brief Moves a node to the root of a free tree by splaying, which keeps
+ * the amortized cost of every tree operation logarithmic.
+ * @param[out] root The root of the tree
+ * @param[in] x A node of the tree
+ */
+static void tree_splay(block_t **root, block_t *x) {
+    block_t *p;
+    while ((p = x->payLoad.treeNode.parent) != NULL) {
+        block_t *g = p->payLoad.treeNode.parent;
+        bool x_left = (p->payLoad.treeNode.left == x);
+        if (g == NULL) {
+            if (x_left) {
+                tree_rotate_right(root, p);
+            } else {
+                tree_rotate_left(root, p);
+            }
+        } else if (x_left && g->payLoad.treeNode.left == p) {
+            tree_rotate_right(root, g);
+            tree_rotate_right(root, p);
+        } else if (!x_left && g->payLoad.treeNode.right == p) {
+            tree_rotate_left(root, g);
+            tree_rotate_left(root, p);
+        } else if (x_left) {
+            tree_rotate_right(root, p);
+            tree_rotate_left(root, g);
+        } else {
+            tree_rotate_left(root, p);
+            tree_rotate_right(root, g);
         }
     }
+}
 
-    size_t idx = num;
-    size >>= 5;
-    
-    while (size > 1 && idx < SEG_LENGTH - 1) {
-        size >>= 1;
-        idx++;
+/**
+ * @brief Returns the first node of a subtree of a free tree.
+ * @param[in] node A node of the tree
+ * @return The smallest node under node
+ */
+static block_t *tree_minimum(block_t *node) {
+    while (node->payLoad.treeNode.left != NULL) {
+        node = node->payLoad.treeNode.left;
+    }
+    return node;
+}
+
+/**
+ * @brief Returns the next node of a free tree in its order.
+ * @param[in] node A node of the tree
+ * @return The next node, or NULL if node is the last one
+ */
+static block_t *tree_successor(block_t *node) {
+    if (node->payLoad.treeNode.right != NULL) {
+        return tree_minimum(node->payLoad.treeNode.right);
+    }
+    block_t *parent = node->payLoad.treeNode.parent;
+    while (parent != NULL && node == parent->payLoad.treeNode.right) {
+        node = parent;
+        parent = parent->payLoad.treeNode.parent;
+    }
+    return parent;
+}
+
+/**
+ * @brief Inserts a free block into the tree of its class and splays it to
+ * the root.
+ * @param[in] meta The arena that owns the tree
+ * @param[in] idx The class of the block, at least first_tree_class
+ * @param[in] block A free block
+ */
+static void tree_insert(heap_meta_t *meta, size_t idx, block_t *block) {
+    block_t **root = &meta->seg_list[idx];
+    block_t *parent = NULL;
+    block_t *node = *root;
+    while (node != NULL) {
+        parent = node;
+        node = tree_less(idx, block, node) ? node->payLoad.treeNode.left
+                                           : node->payLoad.treeNode.right;
+    }
+
+    block->payLoad.treeNode.left = NULL;
+    block->payLoad.treeNode.right = NULL;
+    block->payLoad.treeNode.parent = parent;
+    if (parent == NULL) {
+        *root = block;
+    } else if (tree_less(idx, block, parent)) {
+        parent->payLoad.treeNode.left = block;
+    } else {
+        parent->payLoad.treeNode.right = block;
+    }
+    tree_splay(root, block);
+}
+
+/**
+ * @brief Removes a block from the tree of its class.
+ * @param[in] meta The arena that owns the tree
+ * @param[in] idx The class of the block, at least first_tree_class
+ * @param[in] block A block in the tree
+ */
+static void tree_remove(heap_meta_t *meta, size_t idx, block_t *block) {
+    block_t **root = &meta->seg_list[idx];
+    tree_splay(root, block);
+
+    block_t *left = block->payLoad.treeNode.left;
+    block_t *right = block->payLoad.treeNode.right;
+    if (left == NULL) {
+        tree_replace(root, block, right);
+    } else if (right == NULL) {
+        tree_replace(root, block, left);
+    } else {
+        block_t *next = tree_minimum(right);
+        if (next->payLoad.treeNode.parent != block) {
+            tree_replace(root, next, next->payLoad.treeNode.right);
+            next->payLoad.treeNode.right = right;
+            right->payLoad.treeNode.parent = next;
+        }
+        tree_replace(root, block, next);
+        next->payLoad.treeNode.left = left;
+        left->payLoad.treeNode.parent = next;
     }
-    return idx;
 }
 
+/**
+ * @brief Finds the best fit in the free tree: the smallest block of at
+ * least asize bytes, and among those the lowest in the heap.
+ *
+ * The node found, or the last one visited if there is none, is splayed to
+ * the root, so a following tree_remove of the fit is cheap.
+ *
+ * @param[in] meta The arena that owns the tree
+ * @param[in] asize The adjusted block size being requested
+ * @return The best-fitting block, or NULL if every block is smaller
+ */
+static block_t *tree_find_fit(heap_meta_t *meta, size_t asize) {
+    block_t *fit = NULL;
+    block_t *last = NULL;
+    block_t *node = meta->seg_list[tree_index];
+    while (node != NULL) {
+        last = node;
+        if (get_size(node) >= asize) {
+            fit = node;
+            node = node->payLoad.treeNode.left;
+        } else {
+            node = node->payLoad.treeNode.right;
+        }
+    }
+
+    if (fit != NULL) {
+        tree_splay(&meta->seg_list[tree_index], fit);
+    } else if (last != NULL) {
+        tree_splay(&meta->seg_list[tree_index], last);
+    }
+    return fit;
+}
 
 /**
- * @brief Insert a new block to the segregated free list using LIFO approach
+ * @brief Insert a new block to the segregated free list: at the head of a
+ * list class, or into the tree of an ordered class (see FREE_ORDER)
  *
  * @pre block must not be NULL
  * 
@@ -531,13 +1366,27 @@ static void add_node(block_t *block) {
 
     size_t size = get_size(block);
     size_t idx = get_seg_index(size);
+    heap_meta_t *meta = get_meta();
+
+    block_t* start = meta->seg_list[idx];
 
-    block_t* start = seg_list[idx];
+    meta->class_bitmap |= (word_t)1 << idx;
 
-    /* Block of min block size */
+    /* The largest blocks are kept in size order, for best fit, and those
+     * of the ordered classes in address order */
+    if (idx >= first_tree_class) {
+        tree_insert(meta, idx, block);
+        return;
+    }
+
+    /* Block of min block size: its prev link is kept in the header */
     if ((int)idx == 0) {
         block->payLoad.linkList.next = start;
-        seg_list[idx] = block;
+        set_mini_prev(block, NULL);
+        if (start != NULL) {
+            set_mini_prev(start, block);
+        }
+        meta->seg_list[idx] = block;
         return;
     }
 
@@ -549,33 +1398,52 @@ static void add_node(block_t *block) {
         start->payLoad.linkList.prev = block;
     }
 
-    seg_list[idx] = block;
+    meta->seg_list[idx] = block;
 }
 
 /**
  * @brief Delete the new from the segregated free list
+ *
+ * Every class is doubly linked (mini blocks keep their prev link in the
+ * header), so this takes constant time.
  */
 static void delete_node(block_t *block) {
     dbg_requires(block != NULL);
     int idx = (int)get_seg_index(get_size(block));
+    heap_meta_t *meta = get_meta();
 
     dbg_assert(idx >= 0 && idx <= 14);
 
-    if (idx == 0) {
-        block_t* curr = seg_list[idx];
-
-        if (curr == block) {
-            seg_list[idx] = curr->payLoad.linkList.next;
-            return;
+    if ((size_t)idx >= first_tree_class) {
+        tree_remove(meta, (size_t)idx, block);
+        if (meta->seg_list[idx] == NULL) {
+            meta->class_bitmap &= ~((word_t)1 << idx);
         }
+        return;
+    }
 
-        while (curr != NULL) {
-            if (curr->payLoad.linkList.next == block) {
-                curr->payLoad.linkList.next = block->payLoad.linkList.next;
-                break;
+    if (idx == 0) {
+        block_t *prev = get_mini_prev(block);
+        block_t *next = block->payLoad.linkList.next;
+
+        if (prev != NULL) {
+            prev->payLoad.linkList.next = next;
+        } else {
+            meta->seg_list[idx] = next;
+            if (next == NULL) {
+                meta->class_bitmap &= ~((word_t)1 << idx);
             }
-            curr = curr->payLoad.linkList.next;
         }
+
+        if (next != NULL) {
+            set_mini_prev(next, prev);
+        }
+
+        /* Restore an ordinary header now that the block is off the list */
+        block->header = pack(min_block_size, false,
+                             get_prev_alloc(block->header),
+                             get_prev_min_tag(block->header));
+        block->payLoad.linkList.next = NULL;
         return;
     }
     
@@ -583,7 +1451,12 @@ static void delete_node(block_t *block) {
         block->payLoad.linkList.prev->payLoad.linkList.next =
         block->payLoad.linkList.next;
     }
-    else {seg_list[idx] = block->payLoad.linkList.next;}
+    else {
+        meta->seg_list[idx] = block->payLoad.linkList.next;
+        if (meta->seg_list[idx] == NULL) {
+            meta->class_bitmap &= ~((word_t)1 << idx);
+        }
+    }
 
     /* deleted block is not the last node */
     if (block->payLoad.linkList.next) {
@@ -635,6 +1508,7 @@ static block_t *coalesce_block(block_t *block) {
 
     /* Case 1: prev alloc and next alloc */
     if (block_prev_alloc && block_next_alloc) {
+        stats_add(&get_meta()->stats.coalesces[0], 1);
         dbg_assert(in_heap(block));
         add_node(block);
         return block;
@@ -642,6 +1516,7 @@ static block_t *coalesce_block(block_t *block) {
 
     /* Case 2: prev alloc but next free */
     else if (block_prev_alloc && !block_next_alloc) {
+        stats_add(&get_meta()->stats.coalesces[1], 1);
         newSize += block_next_size;
         dbg_assert(in_heap(block));
         delete_node(block_next);
@@ -653,6 +1528,7 @@ static block_t *coalesce_block(block_t *block) {
     }
     /* Case 3: prev free but next alloc */
     else if (!block_prev_alloc && block_next_alloc) {
+        stats_add(&get_meta()->stats.coalesces[2], 1);
         newSize += block_prev_size;
         delete_node(block_prev);
         write_block(block_prev, newSize, false);
@@ -663,6 +1539,7 @@ static block_t *coalesce_block(block_t *block) {
 
     /* Case 4: prev and next free */
     else {
+        stats_add(&get_meta()->stats.coalesces[3], 1);
         newSize += block_prev_size + block_next_size;
         delete_node(block_prev);
         delete_node(block_next);
@@ -687,11 +1564,41 @@ static block_t *coalesce_block(block_t *block) {
 static block_t *extend_heap(size_t size) {
     void *bp;
 
+#ifdef THREAD_SAFE
+    // Grow in whole chunks, with room for the fences of a new chunk, so
+    // that chunk_owner has one entry per chunk
+    size = round_up(size + dsize, chunksize);
+#else
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
+#endif
     if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
         return NULL;
     }
+    get_meta()->heap_size += size;
+    stats_add(&get_meta()->stats.extends, 1);
+    stats_add(&get_meta()->stats.extend_bytes, size);
+
+#ifdef THREAD_SAFE
+    heap_meta_t *arena = get_meta();
+    size_t arena_idx =
+        (size_t)((char *)arena - (char *)get_arena(0)) / get_meta_size();
+    size_t chunk = (size_t)((char *)bp - ((char *)heap_start + wsize)) /
+                   chunksize;
+    dbg_assert(chunk + size / chunksize <= ARENA_MAX_CHUNKS);
+    for (size_t i = 0; i < size / chunksize; i++) {
+        chunk_owner[chunk + i] = (unsigned char)arena_idx;
+    }
+
+    // Another arena grew the heap last, so open a chunk with its own fences
+    if ((char *)bp != (char *)arena->epilogue + wsize) {
+        word_t *fence = bp;
+        fence[0] = pack(0, true, false, false); // Chunk prologue
+        fence[1] = pack(0, true, true, false);  // Chunk epilogue
+        bp = &fence[2];
+        size -= dsize;
+    }
+#endif
 
     // Initialize free block header/footer
     block_t *block = payload_to_header(bp);
@@ -700,10 +1607,24 @@ static block_t *extend_heap(size_t size) {
     // Create new epilogue header
     block_t *block_next = find_next(block);
     write_epilogue(block_next);
+#ifdef THREAD_SAFE
+    arena->epilogue = block_next;
+#endif
 
     // Coalesce in case the previous block was free
     block = coalesce_block(block);
 
+#ifndef THREAD_SAFE
+    // The old epilogue and the footer before it now lie inside the free
+    // block; clear them, so the memory past the fresh mark stays zero
+    char *links_end = (char *)block + sizeof(block_t);
+    for (word_t *word = (word_t *)bp - 2; word < (word_t *)bp; word++) {
+        if ((char *)word >= links_end) {
+            *word = 0;
+        }
+    }
+#endif
+
     return block;
 }
 
@@ -720,12 +1641,13 @@ static block_t *extend_heap(size_t size) {
  */
 static void split_block(block_t *block, size_t asize) {
     dbg_requires(get_alloc(block));
-    dbg_requires(get_size(block) > asize);
+    dbg_requires(get_size(block) >= asize);
 
     size_t block_size = get_size(block);
 
     if ((block_size - asize) >= min_block_size) {
         block_t *block_next;
+        stats_add(&get_meta()->stats.splits, 1);
         write_block(block, asize, true);
 
         block_next = find_next(block);
@@ -733,49 +1655,86 @@ static void split_block(block_t *block, size_t asize) {
         add_node(block_next);
     }
     else {write_block(block, block_size, true);}
+    note_alloc(block);
 
     dbg_ensures(get_alloc(block));
 }
 
 /**
- * @brief First fit
+ * @brief Finds a free block that can hold `asize` bytes
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * The occupancy bitmap in the heap metadata tells us which classes are
+ * non-empty, so empty classes are skipped with a single count-trailing-zeros
+ * instead of being visited one by one. A miss costs constant time.
  *
- * @param[in] asize
- * @return
+ * Small classes (up to index 4) use first fit. Larger classes use a bounded
+ * best fit that stops after MAX_TRIES improvements, except for the largest
+ * class, whose tree gives the true best fit.
+ *
+ * @param[in] asize The adjusted block size being requested
+ * @return A free block of at least `asize` bytes, or NULL if none exists
  */
 static block_t *find_fit(size_t asize) {
     int class_idx = (int)get_seg_index(asize);
     dbg_assert(class_idx >= 0 && class_idx <= 14);
     block_t *block;
     block_t *start;
+    heap_meta_t *meta = get_meta();
 
-    /* First-fit*/
-    if (class_idx >= 0 && class_idx <= 4) {
-        for (int i = class_idx; i < 5; i++) {
-            start = seg_list[i];
-            for (block = start; block != NULL; block = block->payLoad.linkList.next) {
-                if (asize <= get_size(block)) {
-                    return block;
-                }
-            }
-        }
+    /* Classes at or above class_idx that currently hold any block */
+    word_t candidates = meta->class_bitmap & (~(word_t)0 << class_idx);
+
+    if (candidates == 0) {
+        return NULL; // no fit found
+    }
+
+    /* First-fit: every block in an exact class >= class_idx fits */
+    int first = __builtin_ctzl(candidates);
+    stats_add(&meta->stats.fit_searches, 1);
+    if (class_idx <= 4 && first <= 4) {
+        stats_add(&meta->stats.fit_visits, 1);
+        block = meta->seg_list[first];
+        return ((size_t)first >= first_tree_class) ? tree_minimum(block)
+                                                   : block;
     }
 
-    block_t *good_block = NULL;
-    size_t good_size = SIZE_MAX;
     int MAX_TRIES = 5;
+    size_t visits = 0;
+
+    while (candidates != 0) {
+        int i = __builtin_ctzl(candidates);
+        candidates &= candidates - 1;
+
+        if ((size_t)i == tree_index) {
+            stats_add(&meta->stats.fit_visits, visits);
+            stats_add(&meta->stats.tree_searches, 1);
+            return tree_find_fit(meta, asize);
+        }
 
-    for (int i = class_idx; i < SEG_LENGTH; i++) {
-        start = seg_list[i];
+        block_t *good_block = NULL;
+        size_t good_size = SIZE_MAX;
+        start = meta->seg_list[i];
         int tries = 0;
 
-        for (block = start; block != NULL; block = block->payLoad.linkList.next) {
+        /* An ordered class is walked in address order */
+        bool is_tree = (size_t)i >= first_tree_class;
+        if (is_tree) {
+            start = tree_minimum(start);
+        }
+
+        for (block = start; block != NULL;
+             block = is_tree ? tree_successor(block)
+                             : block->payLoad.linkList.next) {
             size_t block_size = get_size(block);
+            visits++;
+
+            /* A fit next to the last allocation keeps them together */
+            if (NEAR_WINDOW > 0 && asize <= block_size &&
+                is_near(meta, block)) {
+                good_block = block;
+                good_size = block_size;
+                break;
+            }
 
             if (asize == block_size) {
                 good_block = block;
@@ -801,22 +1760,94 @@ static block_t *find_fit(size_t asize) {
             }
             
         }
-        if (good_block != NULL) return good_block;
+        if (good_block != NULL) {
+            stats_add(&meta->stats.fit_visits, visits);
+            return good_block;
+        }
     }
 
+    stats_add(&meta->stats.fit_visits, visits);
     return NULL; // no fit found
 }
 
+/**
+ * @brief Checks a free tree of an arena: every node is a free block of
+ * the tree's class whose children point back at it, and an in-order walk
+ * visits the nodes in strictly increasing order.
+ */
+static bool is_valid_tree(heap_meta_t *meta, size_t idx, int line) {
+    block_t *root = meta->seg_list[idx];
+    if (root == NULL) {
+        return true;
+    }
+    if (root->payLoad.treeNode.parent != NULL) {
+        dbg_printf("Error on free tree root at line %d\n", line);
+        return false;
+    }
+
+    block_t *prev = NULL;
+    for (block_t *curr = tree_minimum(root); curr != NULL;
+         curr = tree_successor(curr)) {
+        block_t *left = curr->payLoad.treeNode.left;
+        block_t *right = curr->payLoad.treeNode.right;
+        if (!in_heap(curr) || get_alloc(curr) ||
+            get_seg_index(get_size(curr)) != idx) {
+            dbg_printf("Error on free tree block at line %d\n", line);
+            return false;
+        }
+        if ((left != NULL && left->payLoad.treeNode.parent != curr) ||
+            (right != NULL && right->payLoad.treeNode.parent != curr)) {
+            dbg_printf("Error on free tree links at line %d\n", line);
+            return false;
+        }
+        if (prev != NULL && !tree_less(idx, prev, curr)) {
+            dbg_printf("Error on free tree order at line %d\n", line);
+            return false;
+        }
+#ifdef THREAD_SAFE
+        if (arena_of(curr) != meta) {
+            dbg_printf("Error on arena ownership at line %d\n", line);
+            return false;
+        }
+#endif
+        prev = curr;
+    }
+    return true;
+}
+
 /**
  * Check pointer consistency, pointer in bound,
  */
-static bool is_valid_segregated_list(int line) {
+static bool is_valid_segregated_list(heap_meta_t *meta, int line) {
+    word_t bitmap = meta->class_bitmap;
+
     for (int i = 0; i < SEG_LENGTH; i++) {
-        for (block_t *curr = seg_list[i]; curr != NULL; curr = curr->payLoad.linkList.next) {
+        /* Check the occupancy bitmap agrees with the list */
+        bool bit_set = (bitmap >> i) & 1;
+        if (bit_set != (meta->seg_list[i] != NULL)) {
+            dbg_printf("Error on class bitmap for class %d at line %d\n", i,
+                       line);
+            return false;
+        }
+
+        if ((size_t)i >= first_tree_class) {
+            if (!is_valid_tree(meta, (size_t)i, line)) {
+                return false;
+            }
+            continue;
+        }
+
+        for (block_t *curr = meta->seg_list[i]; curr != NULL;
+             curr = curr->payLoad.linkList.next) {
             block_t *next = curr->payLoad.linkList.next;
 
             /* Check pointer consistency */
-            if (next != NULL && next->payLoad.linkList.prev != curr) {
+            block_t *next_prev = NULL;
+            if (next != NULL) {
+                next_prev = (i == 0) ? get_mini_prev(next)
+                                     : next->payLoad.linkList.prev;
+            }
+            if (next != NULL && next_prev != curr) {
                 dbg_printf("Error on pointer consistency at line %d\n", line);
                 return false;
             }
@@ -826,6 +1857,85 @@ static bool is_valid_segregated_list(int line) {
                 curr < (block_t *)mem_heap_lo()) {
                 dbg_printf("Error on pointer boundaries at line %d\n", line);
             }
+
+#ifdef THREAD_SAFE
+            /* Check the block lies in a chunk of this arena */
+            if (arena_of(curr) != meta) {
+                dbg_printf("Error on arena ownership at line %d\n", line);
+                return false;
+            }
+#endif
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the partial slab lists of an arena: each slab is marked in
+ * the page map, has the slot size of its class, and has a free count that
+ * matches its free map and leaves at least one slot free.
+ */
+static bool is_valid_slabs(heap_meta_t *meta, int line) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_t *prev = NULL;
+        for (slab_t *slab = meta->slab_list[i]; slab != NULL;
+             slab = slab->next) {
+            size_t free_slots = 0;
+            for (size_t w = 0; w < 4; w++) {
+                free_slots += (size_t)__builtin_popcountl(slab->free_map[w]);
+            }
+
+            if (slab->prev != prev || !is_slab(slab) ||
+                get_slab(slab) != slab) {
+                dbg_printf("Error on slab list of class %zu at line %d\n", i,
+                           line);
+                return false;
+            }
+            if (slab->slot_size != (i + 1) * dsize ||
+                slab->free_count != free_slots || slab->free_count == 0 ||
+                slab->free_count > get_slab_slots(slab->slot_size)) {
+                dbg_printf("Error on slab free count at line %d\n", line);
+                return false;
+            }
+            prev = slab;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the quick-lists of an arena: each block is still marked
+ * allocated, has the size of its class, and each count and occupancy bit
+ * agrees with its list.
+ */
+static bool is_valid_quick_lists(heap_meta_t *meta, int line) {
+    for (size_t i = 0; i < QUICK_CLASSES; i++) {
+        bool bit_set = (meta->quick_bitmap >> i) & 1;
+        if (bit_set != (meta->quick_list[i] != NULL)) {
+            dbg_printf("Error on quick bitmap for class %zu at line %d\n", i,
+                       line);
+            return false;
+        }
+
+        unsigned count = 0;
+        for (block_t *curr = meta->quick_list[i]; curr != NULL;
+             curr = curr->payLoad.linkList.next) {
+            if (!in_heap(curr) || !get_alloc(curr) ||
+                get_size(curr) != quick_min_size + i * dsize) {
+                dbg_printf("Error on quick-list block at line %d\n", line);
+                return false;
+            }
+#ifdef THREAD_SAFE
+            if (arena_of(curr) != meta) {
+                dbg_printf("Error on arena ownership at line %d\n", line);
+                return false;
+            }
+#endif
+            count++;
+        }
+        if (count != meta->quick_count[i] || count > QUICK_LIMIT) {
+            dbg_printf("Error on quick-list count at line %d\n", line);
+            return false;
         }
     }
     return true;
@@ -838,11 +1948,34 @@ static bool in_heap(const void *p) {
     return p <= mem_heap_hi() && p >= mem_heap_lo();
 }
 
+/**
+ * @brief Steps over the fences between two chunks of the heap.
+ *
+ * In the thread-safe build an arena may grow in a chunk that does not
+ * follow its previous one. Each chunk then ends with an epilogue that is
+ * followed by the next chunk's prologue, so the heap continues past it.
+ *
+ * @param[in] block A block in the heap
+ * @return The first block of the next chunk if block is such an epilogue,
+ *         otherwise block itself
+ */
+static block_t *skip_fences(block_t *block) {
+#ifdef THREAD_SAFE
+    while (get_size(block) == 0 &&
+           (char *)block + dsize < (char *)mem_heap_hi()) {
+        block = (block_t *)((char *)block + dsize);
+    }
+#endif
+    return block;
+}
+
 /**
  */
 static bool is_valid_heap_boundaries(int line) {
-    block_t *base = (block_t *)mem_heap_lo(); /* Get the prologue */
-    block_t *top = (block_t *)((char *)mem_heap_hi() - sizeof(block_t) +
+    /* Get the prologue, after the arenas */
+    block_t *base = (block_t *)((char *)mem_heap_lo() +
+                                NUM_ARENAS * get_meta_size());
+    block_t *top = (block_t *)((char *)mem_heap_hi() - wsize +
                                1); /* Get the epilogue*/
 
     /* Check heap starts */
@@ -908,9 +2041,19 @@ bool mm_checkheap(int line) {
 
     /* Check validity on list level: check pointer consistency, pointer in bound
      */
-    if (!is_valid_segregated_list(line)) {
-        dbg_printf("Error: invalid segregated list at line %d\n", line);
-        return false;
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        if (!is_valid_segregated_list(get_arena(i), line)) {
+            dbg_printf("Error: invalid segregated list at line %d\n", line);
+            return false;
+        }
+        if (!is_valid_slabs(get_arena(i), line)) {
+            dbg_printf("Error: invalid slabs at line %d\n", line);
+            return false;
+        }
+        if (!is_valid_quick_lists(get_arena(i), line)) {
+            dbg_printf("Error: invalid quick-lists at line %d\n", line);
+            return false;
+        }
     }
 
     /* Check validity on heap level: check heap start, epilogue, prologue, heap
@@ -937,7 +2080,7 @@ bool mm_checkheap(int line) {
                 return false;
             }
         }
-        curr = next;
+        curr = skip_fences(next);
     }
 
     dbg_printf("Heap is consistent at line %d\n", line);
@@ -955,20 +2098,53 @@ bool mm_checkheap(int line) {
  * @return
  */
 bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    // Create the initial empty heap, preceded by the arenas
+    size_t meta_size = NUM_ARENAS * get_meta_size();
+    char *meta = (char *)(mem_sbrk((intptr_t)(meta_size + 2 * wsize)));
 
-    if (start == (void *)-1) {
+    if (meta == (void *)-1) {
         return false;
     }
 
+    word_t *start = (word_t *)(meta + meta_size);
+
     start[0] = pack(0, true, false, false); // Heap prologue (block footer)
     start[1] = pack(0, true, true, false); // Heap epilogue (block header)
 
     // Heap starts with first "block header", currently the epilogue
     heap_start = (block_t *)&(start[1]);
 
-    init_seg_list();
+#ifndef THREAD_SAFE
+    // The heap is zero from its first block on, except that a page it
+    // shares with memory used before may hold old data
+    char *fresh = (char *)heap_start;
+    size_t stale = (size_t)((uintptr_t)meta % mem_pagesize());
+    if (stale != 0 && fresh < meta - stale + mem_pagesize()) {
+        fresh = meta - stale + mem_pagesize();
+    }
+#endif
+
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        heap_meta_t *arena = get_arena(i);
+        init_seg_list(arena);
+#ifdef THREAD_SAFE
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->remote_free = NULL;
+        arena->epilogue = NULL;
+#else
+        arena->fresh = fresh;
+#endif
+    }
+
+#ifdef THREAD_SAFE
+    // Blocks sitting in thread caches belonged to the previous heap
+    heap_generation++;
+    arena_next = 0;
+
+    // The calling thread takes arena 0, which owns the initial heap
+    tcache_prepare();
+    get_meta()->epilogue = heap_start;
+#endif
 
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL) {
@@ -979,52 +2155,106 @@ bool mm_init(void) {
 }
 
 /**
- * @brief
+ * @brief Adjusts a request size to a block size, adding the header
+ * overhead and meeting alignment requirements.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * An allocated block has no footer, since the next block's prev_alloc bit
+ * stands for it, so the payload runs to the end of the block and the
+ * header is the only word of overhead. The payload starts a word past a
+ * dsize boundary, and the block ends on one.
  *
- * @param[in] size
- * @return
+ * @param[in] size The requested payload size
+ * @return The size of the block that will hold the payload
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
+static size_t adjust_size(size_t size) {
+    return round_up(size + wsize, dsize);
+}
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
+/**
+ * @brief Chooses how far to extend the heap for a request that found no
+ * free block.
+ *
+ * The extension size doubles when the heap has to grow again within
+ * GROW_WINDOW allocations of the last extension, and halves for every
+ * further GROW_WINDOW allocations that went without one, so a heap that is
+ * growing fast calls sbrk less often and one that has gone idle falls back
+ * to chunksize. It never exceeds GROW_MAX, nor 1/GROW_FRACTION of the heap.
+ *
+ * @param[in] meta The arena whose heap is extended
+ * @param[in] size The bytes that the extension must provide
+ * @return The number of bytes to extend the heap by, at least size
+ */
+static size_t get_extend_size(heap_meta_t *meta, size_t size) {
+#if GROW_MAX > 0
+    word_t idle = meta->alloc_ops - meta->grow_ops;
+    size_t grow = meta->grow_size;
+    if (idle < GROW_WINDOW) {
+        grow *= 2;
+    } else {
+        for (idle -= GROW_WINDOW; idle >= GROW_WINDOW && grow > chunksize;
+             idle -= GROW_WINDOW) {
+            grow /= 2;
         }
     }
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
-    }
+    size_t limit = min(GROW_MAX, meta->heap_size / GROW_FRACTION);
+    limit = limit / chunksize * chunksize;
+    grow = max(min(grow, limit), chunksize);
+    meta->grow_size = grow;
+    meta->grow_ops = meta->alloc_ops;
+    return max(size, grow);
+#else
+    return max(size, chunksize);
+#endif
+}
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + dsize, dsize);
+/**
+ * @brief Allocates a block of at least asize bytes.
+ *
+ * A block of exactly asize bytes waiting on a quick-list is reused as it
+ * is. Otherwise the segregated lists are searched for a fit; if there is
+ * none, the quick-lists are coalesced, and then the headroom of blocks
+ * grown by realloc is trimmed, and the search is retried after each before
+ * the heap is extended. Any remainder is split off.
+ *
+ * @param[in] asize The adjusted block size
+ * @return The allocated block, or NULL if sbrk fails
+ */
+static block_t *alloc_block(size_t asize) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+    heap_meta_t *meta = get_meta();
+
+    // Freed blocks of the same size are still marked allocated
+    size_t idx = get_quick_index(asize);
+    if (idx < QUICK_CLASSES && meta->quick_list[idx] != NULL) {
+        block = meta->quick_list[idx];
+        meta->quick_list[idx] = block->payLoad.linkList.next;
+        if (--meta->quick_count[idx] == 0) {
+            meta->quick_bitmap &= ~((word_t)1 << idx);
+        }
+        return block;
+    }
+    meta->alloc_ops++;
 
     // Search the free list for a fit
     block = find_fit(asize);
+    if (block == NULL && flush_quick_lists(meta)) {
+        block = find_fit(asize);
+    }
+
+    // Then the headroom that realloc reserved is given back
+    if (block == NULL && trim_headroom(meta)) {
+        block = find_fit(asize);
+    }
 
     // If no fit is found, request more memory, and then and place the block
     if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
+        extendsize = get_extend_size(meta, asize);
         block = extend_heap(extendsize);
         // extend_heap returns an error
         if (block == NULL) {
-            return bp;
+            return NULL;
         }
     }
 
@@ -1033,12 +2263,58 @@ void *malloc(size_t size) {
 
     // Mark block as allocated
     size_t block_size = get_size(block);
-    write_block(block, block_size, true);
     delete_node(block);
+    write_block(block, block_size, true);
 
     // Try to split the block if too large
     split_block(block, asize);
 
+    return block;
+}
+
+/**
+ * @brief Allocates memory from the caller's arena.
+ *
+ * Requests up to slab_max_size bytes get a slot in a slab, and larger ones
+ * a block. In the thread-safe build the caller must hold the arena lock.
+ *
+ * @param[in] size The requested payload size
+ * @return A pointer to the payload, or NULL if size is 0 or sbrk fails
+ */
+static void *heap_malloc(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    block_t *block;
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        if (!(mm_init())) {
+            dbg_printf("Problem initializing heap. Likely due to sbrk");
+            return NULL;
+        }
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Small requests need no header, so they share a slab
+    if (size <= slab_max_size) {
+        bp = slab_malloc(size);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    block = alloc_block(adjust_size(size));
+    if (block == NULL) {
+        return bp;
+    }
+
+    count_blocks(get_meta()->stats.mallocs, get_size(block), 1);
     bp = header_to_payload(block);
 
     dbg_ensures(mm_checkheap(__LINE__));
@@ -1046,63 +2322,1275 @@ void *malloc(size_t size) {
 }
 
 /**
- * @brief
+ * @brief Returns a slot to its slab, or a block to the caller's arena and
+ * coalesces it.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * In the thread-safe build the caller must hold the arena lock.
  *
- * @param[in] bp
+ * @param[in] bp A payload pointer returned by heap_malloc, or NULL
  */
-void free(void *bp) {
+static void heap_free(void *bp) {
     dbg_requires(mm_checkheap(__LINE__));
 
     if (bp == NULL) {
         return;
     }
 
+    if (is_slab(bp)) {
+        slab_free(bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
     block_t *block = payload_to_header(bp);
+    untrack_headroom(get_meta(), block);
     size_t size = get_size(block);
+    count_blocks(get_meta()->stats.frees, size, 1);
 
     // The block should be marked as allocated
     dbg_assert(get_alloc(block));
 
+#if QUICK_LIMIT > 0
+    // A block of a quick-list class waits there, still marked allocated,
+    // so that it can be reused without being coalesced and split again
+    size_t idx = get_quick_index(size);
+    if (idx < QUICK_CLASSES) {
+        heap_meta_t *meta = get_meta();
+        if (meta->quick_count[idx] >= QUICK_LIMIT) {
+            flush_quick_class(meta, idx);
+        }
+        block->payLoad.linkList.next = meta->quick_list[idx];
+        meta->quick_list[idx] = block;
+        meta->quick_count[idx]++;
+        meta->quick_bitmap |= (word_t)1 << idx;
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
     // Mark the block as free
     write_block(block, size, false);
 
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    // Coalesce the block with its neighbors, and give back unneeded pages
+    release_block(coalesce_block(block), (char *)block, (char *)block + size);
 
     dbg_ensures(mm_checkheap(__LINE__));
 }
 
 /**
- * @brief
+ * @brief Gives the memory of a span just freed back to the system, once it
+ * is part of a large free block.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * A free block at the end of the heap of at least TRIM_THRESHOLD bytes is
+ * cut down to about half that by shrinking the heap, so that a heap which
+ * grows right back does not shrink every time. This only happens in the
+ * default build, since in the thread-safe build the end of the heap may
+ * belong to another arena. Otherwise, in a free block of at least
+ * RELEASE_THRESHOLD bytes, the whole pages of the span are released,
+ * except those holding the header, links or footer. The rest of the block
+ * was already released when it was freed, if it was large enough then.
  *
- * @param[in] ptr
- * @param[in] size
- * @return
+ * @param[in] block A coalesced free block
+ * @param[in] lo The start of the span, inside block
+ * @param[in] hi The end of the span
  */
-void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
+static void release_block(block_t *block, char *lo, char *hi) {
+    dbg_requires(!get_alloc(block));
 
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
-        return NULL;
-    }
+    size_t size = get_size(block);
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+#if !defined THREAD_SAFE && TRIM_THRESHOLD > 0
+    block_t *block_next = find_next(block);
+    if (size >= TRIM_THRESHOLD &&
+        (char *)block_next == (char *)mem_heap_hi() - 7) {
+        size_t excess = (size - TRIM_THRESHOLD / 2) / chunksize * chunksize;
+        if (mem_sbrk(-(intptr_t)excess) != (void *)-1) {
+            // The heap may grow back over memory that held blocks
+            char *brk = (char *)block_next + wsize;
+            if (get_meta()->fresh < brk) {
+                get_meta()->fresh = brk;
+            }
+            get_meta()->heap_size -= excess;
+            delete_node(block);
+            write_block(block, size - excess, false);
+            write_epilogue(find_next(block));
+            add_node(block);
+            return;
+        }
+    }
+#endif
+
+#if RELEASE_THRESHOLD > 0
+    if (size >= RELEASE_THRESHOLD) {
+        char *first = (char *)block + sizeof(block_t);
+        char *last = (char *)header_to_footer(block);
+        lo = (lo < first) ? first : lo;
+        hi = (hi > last) ? last : hi;
+        if (hi > lo && (size_t)(hi - lo) >= mem_pagesize()) {
+            mem_release(lo, (size_t)(hi - lo));
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Returns the quick-list class of a block size.
+ * @param[in] size A block size
+ * @return The class, or QUICK_CLASSES if blocks of this size are coalesced
+ *         as soon as they are freed
+ */
+static size_t get_quick_index(size_t size) {
+    if (size < quick_min_size) {
+        return QUICK_CLASSES;
+    }
+    size_t idx = (size - quick_min_size) / dsize;
+    return (idx < QUICK_CLASSES) ? idx : QUICK_CLASSES;
+}
+
+/**
+ * @brief Frees and coalesces every block on one quick-list.
+ * @param[in] meta The arena that owns the list
+ * @param[in] idx The quick-list class
+ */
+static void flush_quick_class(heap_meta_t *meta, size_t idx) {
+    block_t *block = meta->quick_list[idx];
+    while (block != NULL) {
+        block_t *next = block->payLoad.linkList.next;
+        write_block(block, get_size(block), false);
+        coalesce_block(block);
+        block = next;
+    }
+    meta->quick_list[idx] = NULL;
+    meta->quick_count[idx] = 0;
+    meta->quick_bitmap &= ~((word_t)1 << idx);
+}
+
+/**
+ * @brief Frees and coalesces the blocks on all quick-lists of an arena,
+ * before the heap would otherwise be extended.
+ * @param[in] meta The arena
+ * @return True if any block was flushed, so a search may now succeed
+ */
+static bool flush_quick_lists(heap_meta_t *meta) {
+    word_t bitmap = meta->quick_bitmap;
+    if (bitmap == 0) {
+        return false;
+    }
+    while (bitmap != 0) {
+        flush_quick_class(meta, (size_t)__builtin_ctzl(bitmap));
+        bitmap &= bitmap - 1;
+    }
+    return true;
+}
+
+/**
+ * @brief Allocates n blocks of the same size from the caller's arena.
+ *
+ * Blocks are carved one after the other out of a single free block of
+ * n times the adjusted size, found with one search of the segregated
+ * lists. Slab-sized requests take their slots from the partial slabs of
+ * the class. In the thread-safe build the caller must hold the arena lock.
+ *
+ * @param[in] size The requested payload size of each block
+ * @param[in] n The number of blocks
+ * @param[out] ptrs Receives the payload pointers
+ * @return The number of blocks allocated, less than n only if sbrk fails
+ */
+static size_t heap_malloc_batch(size_t size, size_t n, void **ptrs) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t filled = 0;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        if (!(mm_init())) {
+            dbg_printf("Problem initializing heap. Likely due to sbrk");
+            return filled;
+        }
+    }
+
+    if (size == 0 || size > SIZE_MAX - dsize) {
+        return filled;
+    }
+
+    if (size <= slab_max_size) {
+        while (filled < n && (ptrs[filled] = slab_malloc(size)) != NULL) {
+            filled++;
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return filled;
+    }
+
+    size_t asize = adjust_size(size);
+    block_t *block = NULL;
+    if (n > 1 && asize <= SIZE_MAX / n) {
+        block = alloc_block(n * asize);
+    }
+
+    // Carve the batch block into n blocks, the last taking what is left
+    if (block != NULL) {
+        size_t rest = get_size(block);
+        for (; filled + 1 < n; filled++) {
+            write_block(block, asize, true);
+            ptrs[filled] = header_to_payload(block);
+            rest -= asize;
+            block = find_next(block);
+        }
+        write_block(block, rest, true);
+        note_alloc(block);
+        ptrs[filled++] = header_to_payload(block);
+        count_blocks(get_meta()->stats.mallocs, asize, n - 1);
+        count_blocks(get_meta()->stats.mallocs, rest, 1);
+    }
+
+    // Without a batch block, the blocks are allocated one at a time
+    while (filled < n && (block = alloc_block(asize)) != NULL) {
+        count_blocks(get_meta()->stats.mallocs, get_size(block), 1);
+        ptrs[filled++] = header_to_payload(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return filled;
+}
+
+/**
+ * @brief Frees an address-sorted array of payload pointers.
+ *
+ * A run of blocks that are neighbours on the heap is turned into one free
+ * block, so it is coalesced with the rest of the heap only once. In the
+ * thread-safe build every pointer must belong to the caller's arena, and
+ * the caller must hold its lock.
+ *
+ * @param[in] ptrs Payload pointers in increasing address order, or NULL
+ * @param[in] n The number of pointers
+ */
+static void heap_free_batch(void **ptrs, size_t n) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t i = 0;
+    while (i < n) {
+        void *bp = ptrs[i++];
+        if (bp == NULL) {
+            continue;
+        }
+        if (is_slab(bp)) {
+            slab_free(bp);
+            continue;
+        }
+
+        block_t *block = payload_to_header(bp);
+        untrack_headroom(get_meta(), block);
+        size_t size = get_size(block);
+        dbg_assert(get_alloc(block));
+        count_blocks(get_meta()->stats.frees, size, 1);
+
+        while (i < n && ptrs[i] != NULL &&
+               payload_to_header(ptrs[i]) ==
+                   (block_t *)((char *)block + size) &&
+               !is_slab(ptrs[i])) {
+            untrack_headroom(get_meta(), payload_to_header(ptrs[i]));
+            size_t next_size = get_size(payload_to_header(ptrs[i++]));
+            dbg_assert(get_alloc(payload_to_header(ptrs[i - 1])));
+            count_blocks(get_meta()->stats.frees, next_size, 1);
+            size += next_size;
+        }
+
+        write_block(block, size, false);
+        release_block(coalesce_block(block), (char *)block,
+                      (char *)block + size);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief Sorts pointers by increasing address, with a Shell sort.
+ *
+ * It needs no memory of its own, unlike qsort, which may call malloc.
+ *
+ * @param[inout] ptrs The pointers to sort
+ * @param[in] n The number of pointers
+ */
+static void sort_pointers(void **ptrs, size_t n) {
+    size_t gap = 1;
+    while (gap < n / 3) {
+        gap = 3 * gap + 1;
+    }
+    for (; gap > 0; gap /= 3) {
+        for (size_t i = gap; i < n; i++) {
+            void *p = ptrs[i];
+            size_t j = i;
+            while (j >= gap && (uintptr_t)ptrs[j - gap] > (uintptr_t)p) {
+                ptrs[j] = ptrs[j - gap];
+                j -= gap;
+            }
+            ptrs[j] = p;
+        }
+    }
+}
+
+/**
+ * @brief Checks whether a request is large enough for a region of its own.
+ * @param[in] size The requested payload size
+ * @return True if the request is served by map_malloc
+ */
+static bool use_map(size_t size) {
+#if MMAP_THRESHOLD > 0
+    return size >= MMAP_THRESHOLD && size <= SIZE_MAX - 2 * chunksize;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Checks whether a payload pointer lies in a mapped region.
+ *
+ * Regions lie above the whole heap, so the address alone tells.
+ *
+ * @param[in] bp A payload pointer returned by malloc
+ * @return True if bp was returned by map_malloc or map_realloc
+ */
+static bool is_mapped(const void *bp) {
+    return (const char *)bp >= (char *)mem_map_lo();
+}
+
+/**
+ * @brief Allocates a block in a mapped region of its own.
+ *
+ * The region starts with a fence word, so that the block header is laid
+ * out as on the heap and the payload is aligned. The block ends a word
+ * short of the region, since block sizes are multiples of dsize.
+ *
+ * @param[in] size The requested payload size, accepted by use_map
+ * @return A pointer to the payload, or NULL if the region cannot be mapped
+ */
+static void *map_malloc(size_t size) {
+    size_t len = round_up(size + dsize + wsize, mem_pagesize());
+    word_t *region = mem_map(len);
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    region[0] = pack(0, true, false, false);
+    block_t *block = (block_t *)&region[1];
+    block->header = pack(len - dsize, true, true, false);
+
+    mm_stats_t *stats = get_stats();
+    if (stats != NULL) {
+        count_blocks(stats->mallocs, len - dsize, 1);
+    }
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Unmaps the region of a block from map_malloc.
+ * @param[in] bp A payload pointer for which is_mapped holds
+ */
+static void map_free(void *bp) {
+    mm_stats_t *stats = get_stats();
+    if (stats != NULL) {
+        count_blocks(stats->frees, get_size(payload_to_header(bp)), 1);
+    }
+    mem_unmap((char *)payload_to_header(bp) - wsize);
+}
+
+/**
+ * @brief Resizes the region of a block from map_malloc. The pages are
+ * remapped rather than copied, even if the region has to move.
+ *
+ * @param[in] bp A payload pointer for which is_mapped holds
+ * @param[in] size The new payload size, accepted by use_map
+ * @return The new payload pointer, or NULL if the region is left as it was
+ */
+static void *map_realloc(void *bp, size_t size) {
+    size_t len = round_up(size + dsize + wsize, mem_pagesize());
+    word_t *region = mem_remap((char *)payload_to_header(bp) - wsize, len);
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    block_t *block = (block_t *)&region[1];
+    block->header = pack(len - dsize, true, true, false);
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Returns the headroom realloc reserves when it grows a block.
+ * @param[in] size The new payload size
+ * @return REALLOC_HEADROOM percent of size, or 0 if that would overflow
+ */
+static size_t get_headroom(size_t size) {
+    if (size > SIZE_MAX / 2) {
+        return 0;
+    }
+    return size / 100 * REALLOC_HEADROOM;
+}
+
+/**
+ * @brief Shrinks an allocated block to asize bytes, and frees the rest,
+ * coalesced with any free block after it.
+ * @param[in] block An allocated block of at least asize + min_block_size
+ * @param[in] asize The block size to keep
+ */
+static void trim_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+    dbg_requires(get_size(block) >= asize + min_block_size);
+
+    size_t size = get_size(block);
+    write_block(block, asize, true);
+    block_t *rest = find_next(block);
+    write_block(rest, size - asize, false);
+    release_block(coalesce_block(rest), (char *)rest, (char *)block + size);
+}
+
+/**
+ * @brief Records that a block resized by realloc may hold headroom.
+ *
+ * A block with room to split off past asize is tracked, and any other is
+ * dropped. If every entry is taken, the oldest block is trimmed first.
+ *
+ * @param[in] meta The arena that owns the block
+ * @param[in] block An allocated block
+ * @param[in] asize The block size the block needs
+ */
+static void track_headroom(heap_meta_t *meta, block_t *block, size_t asize) {
+    untrack_headroom(meta, block);
+    if (get_size(block) < asize + min_block_size) {
+        return;
+    }
+    if (meta->roomy_count == HEADROOM_BLOCKS) {
+        trim_block(meta->roomy[0], meta->roomy_need[0]);
+        untrack_headroom(meta, meta->roomy[0]);
+    }
+    meta->roomy[meta->roomy_count] = block;
+    meta->roomy_need[meta->roomy_count] = asize;
+    meta->roomy_count++;
+}
+
+/**
+ * @brief Stops tracking the headroom of a block, if it is tracked. Called
+ * before the block is freed.
+ * @param[in] meta The arena that owns the block
+ * @param[in] block An allocated block
+ */
+static void untrack_headroom(heap_meta_t *meta, block_t *block) {
+    for (unsigned i = 0; i < meta->roomy_count; i++) {
+        if (meta->roomy[i] == block) {
+            meta->roomy_count--;
+            for (; i < meta->roomy_count; i++) {
+                meta->roomy[i] = meta->roomy[i + 1];
+                meta->roomy_need[i] = meta->roomy_need[i + 1];
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Gives back the headroom of every tracked block, so that a request
+ * can be met without growing the heap.
+ * @param[in] meta The arena
+ * @return True if any headroom was freed
+ */
+static bool trim_headroom(heap_meta_t *meta) {
+    if (meta->roomy_count == 0) {
+        return false;
+    }
+    for (unsigned i = 0; i < meta->roomy_count; i++) {
+        trim_block(meta->roomy[i], meta->roomy_need[i]);
+    }
+    meta->roomy_count = 0;
+    return true;
+}
+
+/**
+ * @brief Resizes an allocated block where it is, so realloc need not copy.
+ *
+ * A free block right after it is absorbed, which is enough to shrink or to
+ * grow into that space. If that is not enough, the quick-lists are
+ * coalesced first, since the next block may be waiting on one. If the
+ * block (with any free block after it) is the last one in the heap, the
+ * heap is extended to make room. The block keeps up to `reserve` bytes of
+ * what it absorbed, and the rest is split off as a free block. The reserve
+ * only ever comes out of space that is already free or that has to be
+ * added anyway, so it never grows the heap by itself, and the block is
+ * tracked so that alloc_block can take it back. In the thread-safe build
+ * the caller must hold the arena lock.
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize The adjusted block size needed
+ * @param[in] reserve The block size wanted if there is room, at least asize
+ * @return True if the block now holds at least asize bytes, false if it was
+ *         left untouched
+ */
+static bool resize_block(block_t *block, size_t asize, size_t reserve) {
+    dbg_requires(reserve >= asize);
+    dbg_requires(mm_checkheap(__LINE__));
+    dbg_requires(get_alloc(block));
+
+    size_t block_size = get_size(block);
+    block_t *block_next = find_next(block);
+    size_t next_size = get_alloc(block_next) ? 0 : get_size(block_next);
+
+    // Slack within the reserve is kept as headroom for the next growth
+    if (asize <= block_size && block_size <= reserve) {
+        track_headroom(get_meta(), block, asize);
+        return true;
+    }
+
+    if (block_size + next_size < asize && flush_quick_lists(get_meta())) {
+        // The block next door may have been on a quick-list
+        block_next = find_next(block);
+        next_size = get_alloc(block_next) ? 0 : get_size(block_next);
+    }
+    if (block_size + next_size < asize) {
+        // Grow the heap only if nothing follows the block but the epilogue
+        block_t *last = (next_size == 0) ? block_next : find_next(block_next);
+        if (get_size(last) != 0 ||
+            (char *)last != (char *)mem_heap_hi() - 7) {
+            return false;
+        }
+        if (extend_heap(max(reserve - block_size - next_size, chunksize)) ==
+            NULL) {
+            return false;
+        }
+
+        // In the thread-safe build another arena may have grown the heap
+        // first, leaving the new space in a chunk of its own
+        block_next = find_next(block);
+        if (get_alloc(block_next) ||
+            block_size + get_size(block_next) < asize) {
+            return false;
+        }
+        next_size = get_size(block_next);
+    }
+
+    if (next_size != 0) {
+        delete_node(block_next);
+    }
+    size_t total = block_size + next_size;
+    write_block(block, total, true);
+    split_block(block, (reserve < total) ? reserve : total);
+    track_headroom(get_meta(), block, asize);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
+}
+
+/**
+ * @brief Returns the slab that a slot lies in.
+ *
+ * Slab payloads start on the slab grid, every chunksize bytes from the
+ * first payload of the heap, so rounding down to the grid finds the slab.
+ *
+ * @param[in] bp A slot, or any address inside a slab
+ * @return The slab header
+ */
+static slab_t *get_slab(const void *bp) {
+    char *grid = (char *)heap_start + wsize;
+    size_t page = (size_t)((const char *)bp - grid) / chunksize;
+    return (slab_t *)(grid + page * chunksize);
+}
+
+/**
+ * @brief Checks whether a payload pointer is a slot of some slab.
+ * @param[in] bp A payload pointer returned by heap_malloc
+ * @return True if bp lies in a slab, false if it is the payload of a block
+ */
+static bool is_slab(const void *bp) {
+    size_t page =
+        (size_t)((const char *)bp - ((char *)heap_start + wsize)) / chunksize;
+#ifdef THREAD_SAFE
+    return (chunk_owner[page] & chunk_slab_flag) != 0;
+#else
+    heap_meta_t *meta = get_meta();
+    return page / 64 < meta->slab_map_words &&
+           ((meta->slab_map[page / 64] >> (page % 64)) & 1) != 0;
+#endif
+}
+
+/**
+ * @brief Marks or unmarks the grid page of a slab, so is_slab sees it.
+ *
+ * In the default build the page map is itself a block of the heap, and it
+ * is replaced by one twice as large when a slab lies past its end.
+ *
+ * @param[in] slab A slab on the slab grid
+ * @param[in] is_slab_page True to mark the page, false to unmark it
+ * @return False if the page map could not grow
+ */
+static bool set_slab_page(slab_t *slab, bool is_slab_page) {
+    size_t page =
+        (size_t)((char *)slab - ((char *)heap_start + wsize)) / chunksize;
+#ifdef THREAD_SAFE
+    if (is_slab_page) {
+        chunk_owner[page] |= chunk_slab_flag;
+    } else {
+        chunk_owner[page] &= (unsigned char)~chunk_slab_flag;
+    }
+#else
+    heap_meta_t *meta = get_meta();
+    if (page / 64 >= meta->slab_map_words) {
+        if (!is_slab_page) {
+            return true;
+        }
+        size_t words = max(page / 64 + 1, 2 * meta->slab_map_words);
+        block_t *block = alloc_block(adjust_size(words * wsize));
+        if (block == NULL) {
+            return false;
+        }
+        word_t *map = header_to_payload(block);
+        for (size_t i = 0; i < words; i++) {
+            map[i] = (i < meta->slab_map_words) ? meta->slab_map[i] : 0;
+        }
+        if (meta->slab_map != NULL) {
+            block_t *old = payload_to_header(meta->slab_map);
+            write_block(old, get_size(old), false);
+            coalesce_block(old);
+        }
+        meta->slab_map = map;
+        meta->slab_map_words = words;
+    }
+    if (is_slab_page) {
+        meta->slab_map[page / 64] |= (word_t)1 << (page % 64);
+    } else {
+        meta->slab_map[page / 64] &= ~((word_t)1 << (page % 64));
+    }
+#endif
+    return true;
+}
+
+/**
+ * @brief Returns the number of slots in a slab.
+ * @param[in] slot_size The slot size of the slab
+ * @return The number of slots that fit after the slab header
+ */
+static size_t get_slab_slots(size_t slot_size) {
+    return (chunksize - wsize - sizeof(slab_t)) / slot_size;
+}
+
+/**
+ * @brief Finds where a slab could be carved out of a free block.
+ * @param[in] block A free block
+ * @return The header of the first chunksize block on the slab grid that
+ *         lies wholly inside block, or NULL if there is none
+ */
+static block_t *find_slab_spot(block_t *block) {
+    size_t offset = (size_t)((char *)block - (char *)heap_start) % chunksize;
+    char *spot = (char *)block + (offset == 0 ? 0 : chunksize - offset);
+    if (spot + chunksize > (char *)block + get_size(block)) {
+        return NULL;
+    }
+    return (block_t *)spot;
+}
+
+/**
+ * @brief Looks for a free block that a slab can be carved out of.
+ *
+ * Blocks of at least chunksize bytes are all in the free tree. The few
+ * smallest are tried first; failing those, the best fit among the blocks
+ * large enough to hold a grid block wherever they start.
+ *
+ * @param[in] meta The arena to search
+ * @param[out] spot Set to the slab's place in the returned block
+ * @return The free block, or NULL if none has room
+ */
+static block_t *find_slab_fit(heap_meta_t *meta, block_t **spot) {
+    dbg_assert(get_seg_index(chunksize) == tree_index);
+
+    block_t *block = tree_find_fit(meta, chunksize);
+    for (int tries = 0; block != NULL && tries < 8; tries++) {
+        if ((*spot = find_slab_spot(block)) != NULL) {
+            return block;
+        }
+        block = tree_successor(block);
+    }
+
+    block = tree_find_fit(meta, 2 * chunksize - dsize);
+    if (block != NULL) {
+        *spot = find_slab_spot(block);
+        dbg_assert(*spot != NULL);
+    }
+    return block;
+}
+
+/**
+ * @brief Allocates the block for a new slab, on the slab grid.
+ *
+ * A few free blocks of at least chunksize bytes are tried first, then
+ * again once the quick-lists are coalesced. Otherwise the heap is extended
+ * far enough that the new space holds a grid block. Whatever lies before
+ * or after the slab stays free.
+ *
+ * @return The allocated slab block, or NULL if sbrk fails
+ */
+static block_t *alloc_slab_block(void) {
+    heap_meta_t *meta = get_meta();
+    block_t *spot = NULL;
+
+    meta->alloc_ops++;
+    block_t *block = find_slab_fit(meta, &spot);
+    if (block == NULL && flush_quick_lists(meta)) {
+        block = find_slab_fit(meta, &spot);
+    }
+
+    if (block == NULL) {
+#ifdef THREAD_SAFE
+        block_t *epilogue = meta->epilogue;
+#else
+        block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+#endif
+        size_t offset =
+            (size_t)((char *)epilogue - (char *)heap_start) % chunksize;
+        size_t gap = (offset == 0) ? 0 : chunksize - offset;
+        if ((block = extend_heap(get_extend_size(meta, gap + chunksize))) ==
+            NULL) {
+            return NULL;
+        }
+        spot = find_slab_spot(block);
+        dbg_assert(spot != NULL);
+    }
+
+    // Split the free block into a free front, the slab and a free back
+    size_t front = (size_t)((char *)spot - (char *)block);
+    size_t back = get_size(block) - front - chunksize;
+    delete_node(block);
+    if (front != 0) {
+        write_block(block, front, false);
+        add_node(block);
+    }
+    write_block(spot, chunksize, true);
+    note_alloc(spot);
+    if (back != 0) {
+        block_t *rest = find_next(spot);
+        write_block(rest, back, false);
+        add_node(rest);
+    }
+    return spot;
+}
+
+/**
+ * @brief Adds a slab to the partial list of its class.
+ *
+ * Slots come from the head of the list. With NEAR_WINDOW set, a slab goes
+ * in behind the head, so that the class keeps filling the slab it is on,
+ * whose pages are already in the cache and the TLB, rather than turning
+ * to each slab in which a slot is freed.
+ *
+ * @param[in] slab A slab with at least one free slot
+ */
+static void link_slab(slab_t *slab) {
+    heap_meta_t *meta = get_meta();
+    size_t cls = slab->slot_size / dsize - 1;
+    slab_t *head = meta->slab_list[cls];
+    if (NEAR_WINDOW > 0 && head != NULL) {
+        slab->prev = head;
+        slab->next = head->next;
+        if (slab->next != NULL) {
+            slab->next->prev = slab;
+        }
+        head->next = slab;
+        return;
+    }
+    slab->prev = NULL;
+    slab->next = head;
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    meta->slab_list[cls] = slab;
+}
+
+/**
+ * @brief Removes a slab from the partial list of its class.
+ * @param[in] slab A slab on its partial list
+ */
+static void unlink_slab(slab_t *slab) {
+    heap_meta_t *meta = get_meta();
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        meta->slab_list[slab->slot_size / dsize - 1] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Allocates a slot for a small request.
+ *
+ * The first partial slab of the size class supplies the slot. If the class
+ * has none, a new slab is carved out of the heap.
+ *
+ * @param[in] size The requested payload size, from 1 to slab_max_size
+ * @return A pointer to the slot, or NULL if a new slab was needed and sbrk
+ *         failed
+ */
+static void *slab_malloc(size_t size) {
+    dbg_requires(size != 0 && size <= slab_max_size);
+
+    size_t cls = (size - 1) / dsize;
+    slab_t *slab = get_meta()->slab_list[cls];
+
+    if (slab == NULL) {
+        block_t *block = alloc_slab_block();
+        if (block == NULL) {
+            return NULL;
+        }
+        slab = header_to_payload(block);
+        if (!set_slab_page(slab, true)) {
+            write_block(block, chunksize, false);
+            coalesce_block(block);
+            return NULL;
+        }
+
+        slab->slot_size = (cls + 1) * dsize;
+        slab->free_count = get_slab_slots(slab->slot_size);
+        for (size_t i = 0; i < 4; i++) {
+            size_t first = i * 64;
+            size_t n = (slab->free_count > first) ? slab->free_count - first
+                                                  : 0;
+            slab->free_map[i] = (n >= 64) ? ~(word_t)0
+                                          : ((word_t)1 << n) - 1;
+        }
+        link_slab(slab);
+    }
+
+    size_t w = 0;
+    while (slab->free_map[w] == 0) {
+        w++;
+    }
+    size_t slot = w * 64 + (size_t)__builtin_ctzl(slab->free_map[w]);
+    slab->free_map[w] &= slab->free_map[w] - 1;
+
+    count_blocks(get_meta()->stats.mallocs, slab->slot_size, 1);
+
+    // A full slab has nothing more to offer until a slot is freed
+    if (--slab->free_count == 0) {
+        unlink_slab(slab);
+    }
+
+    return (char *)slab + sizeof(slab_t) + slot * slab->slot_size;
+}
+
+/**
+ * @brief Returns a slot to its slab.
+ *
+ * A slab that becomes empty is given back to the heap as a free block,
+ * unless it is the only partial slab of its class, which is kept so that
+ * a class that keeps allocating and freeing one slot does not churn.
+ *
+ * @param[in] bp A slot returned by slab_malloc
+ */
+static void slab_free(void *bp) {
+    slab_t *slab = get_slab(bp);
+    size_t slot = (size_t)((char *)bp - ((char *)slab + sizeof(slab_t))) /
+                  slab->slot_size;
+    dbg_requires(((slab->free_map[slot / 64] >> (slot % 64)) & 1) == 0);
+    count_blocks(get_meta()->stats.frees, slab->slot_size, 1);
+
+    slab->free_map[slot / 64] |= (word_t)1 << (slot % 64);
+    if (slab->free_count++ == 0) {
+        link_slab(slab);
+        return;
+    }
+
+    if (slab->free_count == get_slab_slots(slab->slot_size) &&
+        (slab->prev != NULL || slab->next != NULL)) {
+        unlink_slab(slab);
+        set_slab_page(slab, false);
+        block_t *block = payload_to_header(slab);
+        write_block(block, chunksize, false);
+        release_block(coalesce_block(block), (char *)block,
+                      (char *)block + chunksize);
+    }
+}
+
+#ifdef THREAD_SAFE
+/**
+ * @brief Returns the arena that owns a block, from the chunk it lies in.
+ * @param[in] block An allocated or free block after the initial prologue
+ * @return The arena whose chunk holds the block
+ */
+static heap_meta_t *arena_of(block_t *block) {
+    // Slots have no header of their own, so only the address is used
+    size_t offset = (size_t)((char *)block - (char *)heap_start);
+    unsigned owner = chunk_owner[offset / chunksize];
+    return get_arena(owner & ~(unsigned)chunk_slab_flag);
+}
+
+/**
+ * @brief Locks the calling thread's arena, then frees the blocks that
+ * threads of other arenas have queued for it.
+ */
+static void arena_lock(void) {
+    heap_meta_t *arena = get_meta();
+    pthread_mutex_lock(&arena->lock);
+
+    block_t *block =
+        __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        block_t *next = block->payLoad.linkList.next;
+        // The queue holds slab slots too, which have no header to check
+        heap_free(slot_to_payload(block));
+        block = next;
+    }
+}
+
+/**
+ * @brief Unlocks the calling thread's arena.
+ */
+static void arena_unlock(void) {
+    pthread_mutex_unlock(&get_meta()->lock);
+}
+
+/**
+ * @brief Queues a block for the arena that owns it, without taking a lock.
+ *
+ * The block is pushed onto the owner's remote_free stack with a
+ * compare-and-swap. The owner takes the whole stack at once in arena_lock,
+ * so a push never races with the removal of a single node.
+ *
+ * @param[in] owner The arena that owns the block
+ * @param[in] block An allocated block of another arena than the caller's
+ */
+static void arena_remote_free(heap_meta_t *owner, block_t *block) {
+    block_t *head = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+    do {
+        block->payLoad.linkList.next = head;
+    } while (!__atomic_compare_exchange_n(&owner->remote_free, &head, block,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Returns every block in one class of the calling thread's cache to
+ * its arena, leaving `keep` blocks cached.
+ * @param[in] idx The size class to flush
+ * @param[in] keep The number of blocks to leave in the cache
+ * @pre The caller must hold the arena lock
+ */
+static void tcache_flush_class(size_t idx, unsigned keep) {
+    while (tcache.count[idx] > keep) {
+        block_t *block = tcache.head[idx];
+        tcache.head[idx] = block->payLoad.linkList.next;
+        tcache.count[idx]--;
+        heap_free(slot_to_payload(block));
+    }
+}
+
+/**
+ * @brief Thread exit destructor: hands the thread's cached blocks back to
+ * its arena so they are not leaked.
+ * @param[in] arg Unused key value
+ */
+static void tcache_release(void *arg) {
+    if (tcache.generation != heap_generation) {
+        return;
+    }
+    arena_lock();
+    for (size_t i = 0; i < TCACHE_CLASSES; i++) {
+        tcache_flush_class(i, 0);
+    }
+    arena_unlock();
+}
+
+/**
+ * @brief Creates the key used to run tcache_release on thread exit
+ */
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/**
+ * @brief Gets the calling thread's cache and arena ready for use.
+ *
+ * Blocks cached under a heap that mm_init has since reset no longer exist,
+ * so the cache is emptied and the thread is given an arena again when the
+ * heap generation changes.
+ */
+static void tcache_prepare(void) {
+    if (tcache.generation != heap_generation) {
+        for (size_t i = 0; i < TCACHE_CLASSES; i++) {
+            tcache.head[i] = NULL;
+            tcache.count[i] = 0;
+        }
+        unsigned next = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+        tcache.arena = get_arena(next % NUM_ARENAS);
+        tcache.generation = heap_generation;
+    }
+    if (!tcache.registered) {
+        pthread_once(&tcache_key_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+}
+
+/**
+ * @brief Allocates a slot of a slab class through the thread cache.
+ *
+ * When the cache is empty it is refilled with a batch of slots taken from
+ * the thread's arena under one acquisition of its lock.
+ *
+ * @param[in] size The requested payload size
+ * @param[in] idx The slab class of the size
+ * @return A pointer to the payload, or NULL if the heap cannot grow
+ * @pre tcache_prepare has run for the current heap
+ */
+static void *tcache_malloc(size_t size, size_t idx) {
+    if (tcache.head[idx] == NULL) {
+        arena_lock();
+        for (unsigned i = 0; i < tcache_batch; i++) {
+            void *bp = heap_malloc(size);
+            if (bp == NULL) {
+                break;
+            }
+            block_t *block = payload_to_header(bp);
+            block->payLoad.linkList.next = tcache.head[idx];
+            tcache.head[idx] = block;
+            tcache.count[idx]++;
+        }
+        arena_unlock();
+
+        if (tcache.head[idx] == NULL) {
+            return NULL;
+        }
+    }
+
+    block_t *block = tcache.head[idx];
+    tcache.head[idx] = block->payLoad.linkList.next;
+    tcache.count[idx]--;
+    return slot_to_payload(block);
+}
+
+/**
+ * @brief Frees a slot of a slab class into the thread cache.
+ *
+ * When the cache for the class is full, half of it is flushed back to the
+ * thread's arena under one acquisition of its lock.
+ *
+ * @param[in] block The slot, viewed as a block for its link word
+ * @param[in] idx The slab class of the slot
+ * @pre The slot belongs to the calling thread's arena
+ */
+static void tcache_free(block_t *block, size_t idx) {
+    if (tcache.count[idx] >= tcache_limit) {
+        arena_lock();
+        tcache_flush_class(idx, tcache_limit - tcache_batch);
+        arena_unlock();
+    }
+
+    block->payLoad.linkList.next = tcache.head[idx];
+    tcache.head[idx] = block;
+    tcache.count[idx]++;
+}
+#endif /* def THREAD_SAFE */
+
+/**
+ * @brief Adds n to a statistics counter of an arena. In the thread-safe
+ * build the counter may be bumped without the arena lock, so the add is
+ * atomic. Compiles to nothing when MM_STATS is 0.
+ * @param[inout] counter A field of an arena's stats
+ * @param[in] n The amount to add
+ */
+static void stats_add(size_t *counter, size_t n) {
+#if MM_STATS > 0
+#ifdef THREAD_SAFE
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+#endif
+}
+
+/**
+ * @brief Returns the statistics of the caller's arena, for the paths that
+ * may run before the heap is initialized or without the arena lock.
+ * @return The arena's stats, or NULL if the heap is not initialized or
+ *         MM_STATS is 0
+ */
+static mm_stats_t *get_stats(void) {
+#if MM_STATS > 0
+    if (heap_start == NULL) {
+        return NULL;
+    }
+#ifdef THREAD_SAFE
+    tcache_prepare();
+#endif
+    return &get_meta()->stats;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * @brief Counts n blocks of a size in one of the per-class counters of an
+ * arena's statistics.
+ * @param[inout] counters The mallocs or frees of an arena's stats
+ * @param[in] size The block or slot size
+ * @param[in] n The number of blocks
+ */
+static void count_blocks(size_t *counters, size_t size, size_t n) {
+    stats_add(&counters[get_seg_index(size)], n);
+}
+
+/**
+ * @brief Allocates a block of at least `size` bytes.
+ *
+ * In the thread-safe build, slab-sized requests are served from the
+ * calling thread's cache, and larger ones take the thread's arena lock
+ * around heap_malloc.
+ *
+ * @param[in] size The requested payload size
+ * @return A pointer to a 16-byte aligned payload, or NULL if size is 0 or
+ *         the heap cannot grow
+ */
+void *malloc(size_t size) {
+    // A huge request gets a region of its own, without touching the heap
+    if (use_map(size)) {
+        return map_malloc(size);
+    }
+
+#ifdef THREAD_SAFE
+    // Lazy initialization, which like mm_init must not race other calls
+    if (heap_start == NULL) {
+        return heap_malloc(size);
+    }
+
+    tcache_prepare();
+    if (size != 0 && size <= slab_max_size) {
+        return tcache_malloc(size, (size - 1) / dsize);
+    }
+
+    arena_lock();
+    void *bp = heap_malloc(size);
+    arena_unlock();
+    return bp;
+#else
+    return heap_malloc(size);
+#endif
+}
+
+/**
+ * @brief Frees a block returned by malloc, calloc or realloc.
+ *
+ * In the thread-safe build, a block of another arena is queued for its
+ * owner without taking any lock. Slots of the thread's own arena go to its
+ * cache, also without a lock; their slab's slot size never changes while
+ * they are allocated.
+ *
+ * @param[in] bp A payload pointer, or NULL
+ */
+void free(void *bp) {
+    if (bp != NULL && is_mapped(bp)) {
+        map_free(bp);
+        return;
+    }
+
+#ifdef THREAD_SAFE
+    if (bp == NULL) {
+        return;
+    }
+
+    tcache_prepare();
+    block_t *block = payload_to_header(bp);
+    heap_meta_t *owner = arena_of(block);
+    if (owner != get_meta()) {
+        arena_remote_free(owner, block);
+        return;
+    }
+
+    if (is_slab(bp)) {
+        tcache_free(block, get_slab(bp)->slot_size / dsize - 1);
+        return;
+    }
+
+    arena_lock();
+    heap_free(bp);
+    arena_unlock();
+#else
+    heap_free(bp);
+#endif
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * <What are the function's arguments?>
+ * <What is the function's return value?>
+ * <Are there any preconditions or postconditions?>
+ *
+ * @param[in] ptr
+ * @param[in] size
+ * @return
+ */
+void *realloc(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    mm_stats_t *stats = get_stats();
+    if (stats != NULL) {
+        stats_add(&stats->reallocs, 1);
+    }
+
+    // A region is remapped, so its pages are never copied
+    if (is_mapped(ptr) && use_map(size)) {
+        return map_realloc(ptr, size);
+    }
+
+    // A slot keeps its size; it only has to move if it is outgrown
+    if (!is_mapped(ptr) && is_slab(ptr)) {
+        copysize = get_slab(ptr)->slot_size;
+        if (size <= copysize) {
+            return ptr;
+        }
+        if ((newptr = malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, ptr, copysize);
+        if ((stats = get_stats()) != NULL) {
+            stats_add(&stats->realloc_copy_bytes, copysize);
+        }
+        free(ptr);
+        return newptr;
+    }
+
+    // Ask for headroom, so that further growth can stay put
+    size_t headroom = get_headroom(size);
+
+    // Resize in place if the block or its neighbourhood has room, which
+    // needs no copy. Only the thread's own arena can be touched here. A
+    // block that outgrows the heap moves to a region instead.
+    if (!is_mapped(ptr) && !use_map(size) &&
+        size + headroom <= SIZE_MAX - dsize) {
+        size_t asize = adjust_size(size);
+        size_t reserve = adjust_size(size + headroom);
+#ifdef THREAD_SAFE
+        tcache_prepare();
+        if (arena_of(block) == get_meta()) {
+            arena_lock();
+            bool resized = resize_block(block, asize, reserve);
+            arena_unlock();
+            if (resized) {
+                return ptr;
+            }
+        }
+#else
+        if (resize_block(block, asize, reserve)) {
+            return ptr;
+        }
+#endif
     }
 
     // Otherwise, proceed with reallocation
@@ -1119,6 +3607,9 @@ void *realloc(void *ptr, size_t size) {
         copysize = size;
     }
     memcpy(newptr, ptr, copysize);
+    if ((stats = get_stats()) != NULL) {
+        stats_add(&stats->realloc_copy_bytes, copysize);
+    }
 
     // Free the old block
     free(ptr);
@@ -1150,17 +3641,304 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
+    // Allocating moves the fresh mark, so read it first
+    const char *fresh = NULL;
+#ifndef THREAD_SAFE
+    if (heap_start == NULL && !mm_init()) {
+        return NULL;
+    }
+    fresh = get_meta()->fresh;
+#endif
+
     bp = malloc(asize);
     if (bp == NULL) {
         return NULL;
     }
 
     // Initialize all bits to 0
-    memset(bp, 0, asize);
+    clear_payload(bp, asize, fresh);
 
     return bp;
 }
 
+/**
+ * @brief Zeroes the start of a payload for calloc, skipping memory that is
+ * known to be zero already.
+ *
+ * A mapped region is all zero. On the heap, only the bytes below the fresh
+ * mark, as it was before the block was allocated, and the words past it
+ * that note_alloc lists are cleared: the links within sizeof(block_t)
+ * bytes of the mark, and the footer of the free block that held it, which
+ * is the last word of the block if the block took all of it. Everything is
+ * cleared if mem_zero_filled says fresh memory must still be written.
+ *
+ * @param[out] bp A payload pointer just returned by malloc
+ * @param[in] size The number of bytes to zero
+ * @param[in] fresh The fresh mark before the allocation, or NULL if none
+ */
+static void clear_payload(void *bp, size_t size, const char *fresh) {
+    if (!mem_zero_filled()) {
+        memset(bp, 0, size);
+        return;
+    }
+    if (is_mapped(bp)) {
+        return;
+    }
+    if (fresh == NULL || is_slab(bp)) {
+        memset(bp, 0, size);
+        return;
+    }
+
+    char *lo = bp;
+    char *hi = lo + size;
+    const char *clean = fresh + sizeof(block_t);
+    if (clean > lo) {
+        memset(lo, 0, (size_t)((clean < hi ? clean : hi) - lo));
+    }
+    word_t *footer = (word_t *)find_next(payload_to_header(bp)) - 1;
+    if ((char *)footer >= clean && (char *)(footer + 1) <= hi) {
+        *footer = 0;
+    }
+}
+
+/**
+ * @brief Allocates n blocks of at least `size` bytes each.
+ *
+ * In the thread-safe build the whole batch is allocated under a single
+ * acquisition of the thread's arena lock, bypassing the thread cache.
+ *
+ * @param[in] size The requested payload size of each block
+ * @param[in] n The number of blocks
+ * @param[out] ptrs Receives the 16-byte aligned payload pointers
+ * @return The number of blocks allocated: 0 if size is 0, and less than n
+ *         if the heap cannot grow
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    if (use_map(size)) {
+        size_t filled = 0;
+        while (filled < n && (ptrs[filled] = map_malloc(size)) != NULL) {
+            filled++;
+        }
+        return filled;
+    }
+
+#ifdef THREAD_SAFE
+    // Lazy initialization, which like mm_init must not race other calls
+    if (heap_start == NULL) {
+        return heap_malloc_batch(size, n, ptrs);
+    }
+
+    tcache_prepare();
+    arena_lock();
+    size_t filled = heap_malloc_batch(size, n, ptrs);
+    arena_unlock();
+    return filled;
+#else
+    return heap_malloc_batch(size, n, ptrs);
+#endif
+}
+
+/**
+ * @brief Frees n blocks returned by malloc, calloc, realloc or
+ * mm_malloc_batch.
+ *
+ * Blocks in mapped regions are unmapped first. The other pointers are
+ * sorted by address, so neighbouring blocks are coalesced once. In the
+ * thread-safe build, blocks of other arenas are queued for their owners
+ * and dropped from the array, and the rest are freed under a single
+ * acquisition of the thread's arena lock.
+ *
+ * @param[inout] ptrs Payload pointers, or NULL; the array is overwritten
+ * @param[in] n The number of pointers
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL && is_mapped(ptrs[i])) {
+            map_free(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+
+    if (heap_start == NULL) {
+        return;
+    }
+
+    sort_pointers(ptrs, n);
+#ifdef THREAD_SAFE
+    tcache_prepare();
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        block_t *block = payload_to_header(ptrs[i]);
+        heap_meta_t *owner = arena_of(block);
+        if (owner != get_meta()) {
+            arena_remote_free(owner, block);
+            ptrs[i] = NULL;
+        }
+    }
+
+    arena_lock();
+    heap_free_batch(ptrs, n);
+    arena_unlock();
+#else
+    heap_free_batch(ptrs, n);
+#endif
+}
+
+/**
+ * @brief Computes the largest block size of each segregated class, for
+ * the class_max field of mm_stats_t.
+ * @param[out] class_max Receives SEG_LENGTH sizes, 0 for an empty class
+ */
+static void get_class_max(size_t *class_max) {
+    for (size_t i = 0; i < SEG_LENGTH; i++) {
+        class_max[i] = (i < num_exact_classes) ? (i + 1) * dsize : 0;
+    }
+    // Sizes rise through the range classes, so each keeps its last one
+    for (size_t size = (num_exact_classes + 1) * dsize;
+         size < RANGE_CLASS_BOUND_14; size += dsize) {
+        class_max[get_seg_index(size)] = size;
+    }
+    class_max[tree_index] = SIZE_MAX;
+}
+
+/**
+ * @brief Reads the counters of every arena into stats.
+ * @param[out] stats Receives the sums, or zeros if MM_STATS is 0, and the
+ *                   class bounds either way
+ * @return True if the statistics were compiled in
+ */
+bool mm_get_stats(mm_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    get_class_max(stats->class_max);
+#if MM_STATS > 0
+    if (heap_start == NULL) {
+        return true;
+    }
+
+    // mm_stats_t is counters up to class_max, so they are summed as an array
+    _Static_assert(MM_STATS_CLASSES == SEG_LENGTH,
+                   "mm_stats_t must have a counter per segregated class");
+    _Static_assert(offsetof(mm_stats_t, class_max) % sizeof(size_t) == 0,
+                   "mm_stats_t must hold only size_t counters");
+    size_t *sum = (size_t *)stats;
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        size_t *counters = (size_t *)&get_arena(i)->stats;
+        for (size_t j = 0; j < offsetof(mm_stats_t, class_max) / sizeof(size_t);
+             j++) {
+            sum[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Takes the bytes in [lo, hi) off the used bytes of their pages in
+ * a snapshot's page map.
+ * @param[inout] snap The snapshot
+ * @param[in] lo First free byte
+ * @param[in] hi One past the last free byte
+ */
+static void snap_free_range(mm_snapshot_t *snap, const char *lo,
+                            const char *hi) {
+    const char *base = mem_heap_lo();
+    size_t page_size = mem_pagesize();
+    size_t first = (size_t)(lo - base);
+    size_t last = (size_t)(hi - base);
+    for (size_t page = first / page_size;
+         page < snap->max_pages && page * page_size < last; page++) {
+        size_t start = max(first, page * page_size);
+        size_t end = min(last, (page + 1) * page_size);
+        snap->page_used[page] -= (unsigned)(end - start);
+    }
+}
+
+/**
+ * @brief Counts the free slots of a slab in a snapshot.
+ * @param[inout] snap The snapshot
+ * @param[in] slab A slab
+ */
+static void snap_slab(mm_snapshot_t *snap, slab_t *slab) {
+    size_t slots = get_slab_slots(slab->slot_size);
+    for (size_t i = 0; i < slots; i++) {
+        if (((slab->free_map[i / 64] >> (i % 64)) & 1) != 0) {
+            char *slot = (char *)slab + sizeof(slab_t) + i * slab->slot_size;
+            snap->slab_slots++;
+            snap->slab_bytes += slab->slot_size;
+            snap_free_range(snap, slot, slot + slab->slot_size);
+        }
+    }
+}
+
+/**
+ * @brief Walks the heap and the quick-lists of every arena into snap.
+ *
+ * Every page starts out fully used, and the walk takes off the bytes of
+ * free blocks, quick-list blocks and free slab slots.
+ *
+ * @param[inout] snap The snapshot, with page_used and max_pages set
+ * @return False if the heap has not been initialized
+ */
+bool mm_get_snapshot(mm_snapshot_t *snap) {
+    unsigned *page_used = snap->page_used;
+    size_t max_pages = (page_used == NULL) ? 0 : snap->max_pages;
+    memset(snap, 0, sizeof(*snap));
+    snap->page_used = page_used;
+    snap->max_pages = max_pages;
+    if (heap_start == NULL) {
+        return false;
+    }
+
+    size_t page_size = mem_pagesize();
+    snap->heap_bytes = mem_heapsize();
+    snap->num_pages = (snap->heap_bytes + page_size - 1) / page_size;
+    for (size_t page = 0; page < min(max_pages, snap->num_pages); page++) {
+        snap->page_used[page] =
+            (unsigned)min(page_size, snap->heap_bytes - page * page_size);
+    }
+
+    size_t free_total = 0;
+    for (block_t *block = heap_start; get_size(block) != 0;
+         block = skip_fences(find_next(block))) {
+        size_t size = get_size(block);
+        void *bp = header_to_payload(block);
+        if (!get_alloc(block)) {
+            size_t idx = get_seg_index(size);
+            snap->free_blocks[idx]++;
+            snap->free_bytes[idx] += size;
+            snap->largest_free = max(snap->largest_free, size);
+            free_total += size;
+            snap_free_range(snap, (char *)block, (char *)block + size);
+        } else if (is_slab(bp) && get_slab(bp) == bp) {
+            snap_slab(snap, bp);
+        }
+    }
+
+    for (size_t i = 0; i < NUM_ARENAS; i++) {
+        heap_meta_t *meta = get_arena(i);
+        for (size_t idx = 0; idx < QUICK_CLASSES; idx++) {
+            for (block_t *block = meta->quick_list[idx]; block != NULL;
+                 block = block->payLoad.linkList.next) {
+                snap->quick_blocks++;
+                snap->quick_bytes += get_size(block);
+                snap_free_range(snap, (char *)block,
+                                (char *)block + get_size(block));
+            }
+        }
+    }
+
+    snap->used_bytes = snap->heap_bytes - free_total - snap->quick_bytes -
+                       snap->slab_bytes;
+    snap->frag = (free_total == 0)
+                     ? 0.0
+                     : 1.0 - (double)snap->largest_free / (double)free_total;
+    return true;
+}
+
 /*
 *****************************************************************************
 * Do not delete the following super-secret(tm) lines!                       *
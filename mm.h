@@ -61,6 +61,130 @@ extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
 #endif
 
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each.
+ *
+ * The blocks are carved out of as few free blocks as possible, so this is
+ * cheaper than `n` calls to malloc.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] ptrs  An array of `n` pointers, filled with the blocks.
+ *
+ * @return  The number of blocks allocated, which is less than `n` only if
+ *          the heap cannot grow. The first that many entries of `ptrs`
+ *          are set.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Frees `n` blocks at once.
+ *
+ * The pointers are sorted by address first, so that blocks that are
+ * neighbours on the heap are coalesced together once.
+ *
+ * @param[inout] ptrs  An array of `n` payload pointers, any of them NULL.
+ *                     Its contents are overwritten.
+ * @param[in] n  The number of pointers in the array.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Number of size classes that mm_stats_t counts blocks in.
+ *
+ * Classes 0 to 7 hold blocks of 16, 32, ..., 128 bytes, and classes 10 to
+ * 13 blocks of 144 to 255, 256 to 511, 512 to 1023 and 1024 to 2047 bytes.
+ * Class 14 holds every larger block, including mapped regions. Classes 8
+ * and 9 stay empty. A build with a table from classgen moves the bounds
+ * of classes 8 to 14; class_max in mm_stats_t gives them.
+ */
+#define MM_STATS_CLASSES 15
+
+/**
+ * @brief  Counters of the allocator's work since the heap was initialized.
+ *
+ * Blocks are counted in the size class of their block size, header
+ * included, and the blocks that realloc allocates and frees are counted
+ * too. In the thread-safe build, slots are counted as they move between
+ * an arena and a thread cache, and a block freed by a thread of another
+ * arena is counted when its owner takes it back.
+ */
+typedef struct mm_stats {
+    size_t mallocs[MM_STATS_CLASSES]; /* Blocks allocated, per size class */
+    size_t frees[MM_STATS_CLASSES];   /* Blocks freed, per size class */
+    size_t fit_searches;       /* Searches of the segregated lists */
+    size_t fit_visits;         /* List nodes visited by those searches */
+    size_t tree_searches;      /* Searches of the tree of large blocks */
+    size_t splits;             /* Free blocks split to fit a request */
+    size_t coalesces[4];       /* Frees merged with no neighbour, the next
+                                  block, the previous one and both */
+    size_t extends;            /* Times the heap was extended */
+    size_t extend_bytes;       /* Bytes the heap was extended by */
+    size_t reallocs;           /* Calls to realloc that resized a block */
+    size_t realloc_copy_bytes; /* Bytes that realloc copied */
+    size_t class_max[MM_STATS_CLASSES]; /* Largest block of each class, 0
+                                           if it holds none, SIZE_MAX for
+                                           the last */
+} mm_stats_t;
+
+/**
+ * @brief  Reads the allocator's statistics.
+ *
+ * In the thread-safe build the counters of every arena are summed. They
+ * are read one at a time, so a snapshot taken while other threads
+ * allocate need not be consistent.
+ *
+ * @param[out] stats  Receives the counters, or zeros if none are kept;
+ *                    class_max is filled in either way.
+ *
+ * @return  True if the statistics were compiled in, False otherwise.
+ */
+extern bool mm_get_stats(mm_stats_t *stats);
+
+/**
+ * @brief  The layout of the heap at one moment, from a walk of its blocks.
+ *
+ * Free bytes are those of free blocks, of blocks waiting on a quick-list,
+ * and of the free slots of slabs; the rest of the heap, headers, arena
+ * bookkeeping and padding included, counts as used. Mapped regions lie
+ * outside the heap and are left out. The external fragmentation is
+ * 1 - largest_free / free block bytes: 0 when the free blocks are one
+ * block, near 1 when they are many small ones.
+ *
+ * The caller sets page_used and max_pages; page i of the heap, counted
+ * from mem_heap_lo() in pages of mem_pagesize() bytes, gets the number of
+ * its bytes in use, for the first max_pages pages.
+ */
+typedef struct mm_snapshot {
+    size_t heap_bytes;  /* Size of the heap */
+    size_t used_bytes;  /* Bytes not free, as above */
+    size_t free_blocks[MM_STATS_CLASSES]; /* Free blocks, per size class */
+    size_t free_bytes[MM_STATS_CLASSES];  /* And their bytes */
+    size_t quick_blocks; /* Blocks on quick-lists, not in the classes */
+    size_t quick_bytes;
+    size_t slab_slots;   /* Free slots of slabs, not in the classes */
+    size_t slab_bytes;
+    size_t largest_free; /* Largest free block */
+    double frag;         /* External fragmentation of the free blocks */
+    unsigned *page_used; /* Bytes in use per page, or NULL for none */
+    size_t max_pages;    /* Length of page_used */
+    size_t num_pages;    /* Pages in the heap, which may exceed max_pages */
+} mm_snapshot_t;
+
+/**
+ * @brief  Walks the heap and summarizes its layout.
+ *
+ * The walk takes no locks, so in the thread-safe build it must not run
+ * while other threads allocate, and slots held in thread caches count as
+ * used.
+ *
+ * @param[inout] snap  Receives the summary; page_used and max_pages are
+ *                     read first.
+ *
+ * @return  True if the heap could be walked, False otherwise.
+ */
+extern bool mm_get_snapshot(mm_snapshot_t *snap);
+
 /**
  * @brief  Initialize the heap.
  *
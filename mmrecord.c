@@ -0,0 +1,473 @@
+/*
+ * mmrecord.c - A library that logs the allocator calls of a running
+ * program, for record2rep to turn into a trace for the CS:APP Malloc Lab
+ * Driver.
+ *
+ * Usage: LD_PRELOAD=./mmrecord.so MMRECORD_FILE=<log> <program> ...
+ *
+ * malloc, calloc, realloc, free, posix_memalign, aligned_alloc and
+ * memalign are passed on to the next allocator, normally libc's, and
+ * each call that allocated or freed a block is logged (see mmrecord.h).
+ * The log goes to MMRECORD_FILE, or mmrecord.<pid>.log.
+ *
+ * Each thread fills a buffer of its own, so the only shared write per
+ * call is the atomic sequence number. A full buffer is queued for a
+ * writer thread, which writes it out, and the thread takes another. The
+ * buffers of running threads are written when the program exits, and a
+ * thread's buffer when the thread exits. Calls made after exit has begun,
+ * by a forked child, or after _exit are not logged.
+ */
+
+#define _GNU_SOURCE 1 // for RTLD_NEXT
+
+#include "mmrecord.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Records per buffer */
+#define BUF_RECS 4096
+
+/* Bytes of the heap that serves dlsym before the real allocator is
+   known; its blocks are never freed */
+#define BOOT_BYTES (1 << 16)
+
+/** A buffer of records, owned by a thread, queued for the writer, or in
+ *  the pool of empty buffers.
+ */
+typedef struct buf_t {
+    struct buf_t *next; /* in the queue or the pool */
+    struct buf_t *all;  /* every buffer, for the flush at exit */
+    bool owned;         /* a thread is filling it */
+    size_t n;           /* records filled, stored with release order */
+    rec_t recs[BUF_RECS];
+} buf_t;
+
+/* The allocator that calls are passed to */
+static struct {
+    void *(*malloc)(size_t);
+    void *(*calloc)(size_t, size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+    int (*posix_memalign)(void **, size_t, size_t);
+    void *(*aligned_alloc)(size_t, size_t);
+    void *(*memalign)(size_t, size_t);
+} real;
+
+static int init_state; /* 0 before init_real, 1 during, 2 after */
+static _Alignas(16) char boot_heap[BOOT_BYTES];
+static size_t boot_used;
+
+static bool recording;      /* calls are logged */
+static uint64_t next_seq;   /* sequence number of the next call */
+static int log_fd = -1;     /* the log */
+static pthread_t writer;    /* writes the queued buffers */
+static pthread_key_t buf_key; /* flushes a thread's buffer at its exit */
+
+/* Buffers, guarded by lock; the writer waits on ready */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static buf_t *queue;    /* full buffers, newest first */
+static buf_t *pool;     /* empty buffers */
+static buf_t *all_bufs; /* every buffer made */
+static bool stopping;   /* the writer exits once the queue is empty */
+
+/* The thread's buffer, and whether it is inside this library, so that
+   the allocations of dlsym, pthread and the like are not logged */
+static __thread buf_t *tls_buf __attribute__((tls_model("initial-exec")));
+static __thread bool tls_busy __attribute__((tls_model("initial-exec")));
+
+/*
+ * boot_alloc - allocates from boot_heap, for calls made while dlsym
+ * looks up the real allocator. The memory is zero, as calloc needs.
+ */
+static void *boot_alloc(size_t size) {
+    size_t need = (size + 15) & ~(size_t)15;
+    size_t at = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+    if (need < size || at + need > BOOT_BYTES) {
+        return NULL;
+    }
+    return &boot_heap[at];
+}
+
+static bool is_boot(const void *p) {
+    return (const char *)p >= boot_heap &&
+           (const char *)p < boot_heap + BOOT_BYTES;
+}
+
+/*
+ * init_real - looks up the allocator that calls are passed to. Calls
+ * made meanwhile, by dlsym itself, are served from boot_heap.
+ */
+static void init_real(void) {
+    if (__atomic_load_n(&init_state, __ATOMIC_ACQUIRE) != 0) {
+        return;
+    }
+    init_state = 1;
+    *(void **)&real.malloc = dlsym(RTLD_NEXT, "malloc");
+    *(void **)&real.calloc = dlsym(RTLD_NEXT, "calloc");
+    *(void **)&real.realloc = dlsym(RTLD_NEXT, "realloc");
+    *(void **)&real.free = dlsym(RTLD_NEXT, "free");
+    *(void **)&real.posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    *(void **)&real.aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    *(void **)&real.memalign = dlsym(RTLD_NEXT, "memalign");
+    if (real.malloc == NULL || real.calloc == NULL || real.realloc == NULL ||
+        real.free == NULL) {
+        fprintf(stderr, "mmrecord: cannot find the allocator to wrap\n");
+        abort();
+    }
+    __atomic_store_n(&init_state, 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * write_buf - writes the records of a buffer to the log
+ */
+static void write_buf(buf_t *buf) {
+    const char *p = (const char *)buf->recs;
+    size_t left = __atomic_load_n(&buf->n, __ATOMIC_ACQUIRE) * sizeof(rec_t);
+    while (left > 0) {
+        ssize_t done = write(log_fd, p, left);
+        if (done <= 0) {
+            perror("mmrecord: write");
+            return;
+        }
+        p += done;
+        left -= (size_t)done;
+    }
+}
+
+/*
+ * writer_main - writes queued buffers to the log, oldest first, and
+ * returns them to the pool, until stopping is set and the queue is empty
+ */
+static void *writer_main(void *arg) {
+    tls_busy = true;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue == NULL && !stopping) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        if (queue == NULL) {
+            break;
+        }
+        buf_t *list = NULL;
+        while (queue != NULL) {
+            buf_t *buf = queue;
+            queue = buf->next;
+            buf->next = list;
+            list = buf;
+        }
+        pthread_mutex_unlock(&lock);
+
+        for (buf_t *buf = list; buf != NULL; buf = buf->next) {
+            write_buf(buf);
+        }
+
+        pthread_mutex_lock(&lock);
+        while (list != NULL) {
+            buf_t *buf = list;
+            list = buf->next;
+            buf->n = 0;
+            buf->next = pool;
+            pool = buf;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return arg;
+}
+
+/*
+ * swap_buf - queues the thread's buffer, if any, and gives the thread an
+ * empty one. Returns it, or NULL if none can be made.
+ */
+static buf_t *swap_buf(buf_t *full) {
+    pthread_mutex_lock(&lock);
+    if (full != NULL) {
+        full->owned = false;
+        full->next = queue;
+        queue = full;
+        pthread_cond_signal(&ready);
+    }
+    buf_t *buf = pool;
+    if (buf != NULL) {
+        pool = buf->next;
+    } else {
+        buf = mmap(NULL, sizeof(buf_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED) {
+            buf = NULL;
+        } else {
+            buf->all = all_bufs;
+            all_bufs = buf;
+        }
+    }
+    if (buf != NULL) {
+        buf->owned = true;
+    }
+    pthread_mutex_unlock(&lock);
+
+    pthread_setspecific(buf_key, buf);
+    tls_buf = buf;
+    return buf;
+}
+
+/*
+ * log_call - adds a record to the thread's buffer
+ */
+static void log_call(rec_type_t type, const void *ptr, const void *old,
+                     size_t size, uint64_t seq) {
+    buf_t *buf = tls_buf;
+    if (buf == NULL || buf->n == BUF_RECS) {
+        if ((buf = swap_buf(buf)) == NULL) {
+            return;
+        }
+    }
+    rec_t *rec = &buf->recs[buf->n];
+    rec->seq = seq;
+    rec->type = type;
+    rec->ptr = (uint64_t)(uintptr_t)ptr;
+    rec->old = (uint64_t)(uintptr_t)old;
+    rec->size = size;
+    __atomic_store_n(&buf->n, buf->n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * take_seq - takes the next sequence number. Relaxed order is enough:
+ * an address is only reused after the allocator has ordered its free
+ * before the allocation, and so the increments too.
+ */
+static uint64_t take_seq(void) {
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * enter - returns whether the call is to be logged, and if so marks the
+ * thread as inside the library until leave
+ */
+static bool enter(void) {
+    if (tls_busy || !__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    tls_busy = true;
+    return true;
+}
+
+static void leave(void) {
+    tls_busy = false;
+}
+
+/*
+ * thread_done - queues the buffer of a thread that exits
+ */
+static void thread_done(void *arg) {
+    buf_t *buf = arg;
+    pthread_mutex_lock(&lock);
+    buf->owned = false;
+    buf->next = queue;
+    queue = buf;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    tls_buf = NULL;
+}
+
+/*
+ * child_stop - stops logging in a forked child, which has no writer
+ */
+static void child_stop(void) {
+    recording = false;
+}
+
+/*
+ * start - opens the log and starts the writer, before main runs
+ */
+static void __attribute__((constructor)) start(void) {
+    init_real();
+    tls_busy = true;
+
+    char name[64];
+    const char *fname = getenv("MMRECORD_FILE");
+    if (fname == NULL) {
+        snprintf(name, sizeof(name), "mmrecord.%d.log", (int)getpid());
+        fname = name;
+    }
+    log_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd < 0) {
+        perror(fname);
+        tls_busy = false;
+        return;
+    }
+
+    rec_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+    hdr.version = REC_VERSION;
+    hdr.rec_size = sizeof(rec_t);
+    if (write(log_fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        pthread_key_create(&buf_key, thread_done) != 0 ||
+        pthread_atfork(NULL, NULL, child_stop) != 0 ||
+        pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "mmrecord: cannot start recording to %s\n", fname);
+        close(log_fd);
+        log_fd = -1;
+        tls_busy = false;
+        return;
+    }
+    recording = true;
+    tls_busy = false;
+}
+
+/*
+ * finish - stops logging, queues the buffers that threads still hold,
+ * and waits for the writer to write everything
+ */
+static void __attribute__((destructor)) finish(void) {
+    if (log_fd < 0) {
+        return;
+    }
+    __atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+    tls_busy = true;
+
+    pthread_mutex_lock(&lock);
+    for (buf_t *buf = all_bufs; buf != NULL; buf = buf->all) {
+        if (buf->owned) {
+            buf->owned = false;
+            buf->next = queue;
+            queue = buf;
+        }
+    }
+    stopping = true;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
+
+void *malloc(size_t size) {
+    init_real();
+    if (real.malloc == NULL) {
+        return boot_alloc(size);
+    }
+    if (!enter()) {
+        return real.malloc(size);
+    }
+    void *p = real.malloc(size);
+    if (p != NULL) {
+        log_call(REC_ALLOC, p, NULL, size, take_seq());
+    }
+    leave();
+    return p;
+}
+
+void *calloc(size_t n, size_t size) {
+    init_real();
+    if (real.calloc == NULL) {
+        return (size == 0 || n <= SIZE_MAX / size) ? boot_alloc(n * size)
+                                                   : NULL;
+    }
+    if (!enter()) {
+        return real.calloc(n, size);
+    }
+    void *p = real.calloc(n, size);
+    if (p != NULL) {
+        log_call(REC_ALLOC, p, NULL, n * size, take_seq());
+    }
+    leave();
+    return p;
+}
+
+void free(void *p) {
+    init_real();
+    if (p == NULL || is_boot(p) || real.free == NULL) {
+        return;
+    }
+    if (!enter()) {
+        real.free(p);
+        return;
+    }
+    log_call(REC_FREE, p, NULL, 0, take_seq());
+    real.free(p);
+    leave();
+}
+
+void *realloc(void *old, size_t size) {
+    init_real();
+    if (real.realloc == NULL || is_boot(old)) {
+        // Boot blocks are copied out; the copy reads no further than the
+        // end of boot_heap, since their sizes are not kept
+        void *p = malloc(size);
+        if (p != NULL && old != NULL) {
+            size_t room = (size_t)(boot_heap + BOOT_BYTES - (char *)old);
+            memcpy(p, old, size < room ? size : room);
+        }
+        return p;
+    }
+    if (!enter()) {
+        return real.realloc(old, size);
+    }
+    void *p = real.realloc(old, size);
+    if (p != NULL || (old != NULL && size == 0)) {
+        log_call(old == NULL ? REC_ALLOC : REC_REALLOC, p, old, size,
+                 take_seq());
+    }
+    leave();
+    return p;
+}
+
+int posix_memalign(void **pp, size_t align, size_t size) {
+    init_real();
+    if (real.posix_memalign == NULL) {
+        return ENOMEM;
+    }
+    if (!enter()) {
+        return real.posix_memalign(pp, align, size);
+    }
+    int err = real.posix_memalign(pp, align, size);
+    if (err == 0) {
+        log_call(REC_ALLOC, *pp, NULL, size, take_seq());
+    }
+    leave();
+    return err;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    init_real();
+    if (real.aligned_alloc == NULL) {
+        return NULL;
+    }
+    if (!enter()) {
+        return real.aligned_alloc(align, size);
+    }
+    void *p = real.aligned_alloc(align, size);
+    if (p != NULL) {
+        log_call(REC_ALLOC, p, NULL, size, take_seq());
+    }
+    leave();
+    return p;
+}
+
+void *memalign(size_t align, size_t size) {
+    init_real();
+    if (real.memalign == NULL) {
+        return NULL;
+    }
+    if (!enter()) {
+        return real.memalign(align, size);
+    }
+    void *p = real.memalign(align, size);
+    if (p != NULL) {
+        log_call(REC_ALLOC, p, NULL, size, take_seq());
+    }
+    leave();
+    return p;
+}
@@ -0,0 +1,45 @@
+/*
+ * mmrecord.h - The log of allocator calls that mmrecord.so writes from a
+ * running program, and record2rep turns into a trace for the CS:APP
+ * Malloc Lab Driver.
+ */
+
+#ifndef MM_RECORD_H_
+#define MM_RECORD_H_ 1
+
+#include <stdint.h>
+
+/** What a logged call did.  */
+typedef enum rec_type_t {
+    REC_NONE,    /* no call: a sequence number that was never logged */
+    REC_ALLOC,   /* malloc, calloc or an aligned allocation returned ptr */
+    REC_FREE,    /* free(ptr) */
+    REC_REALLOC, /* realloc(old) returned ptr, or freed old if ptr is 0 */
+} rec_type_t;
+
+/** One logged call.  The calls of all threads share one sequence: a
+ *  free takes its number before the block is released and an allocation
+ *  after the block is returned, so no two live blocks in the sequence
+ *  share an address, except around a realloc that moves its block.
+ */
+typedef struct rec_t {
+    uint64_t seq;  /* position of the call in the sequence */
+    uint64_t type; /* rec_type_t */
+    uint64_t ptr;  /* block returned, or freed */
+    uint64_t old;  /* block passed to realloc */
+    uint64_t size; /* bytes requested */
+} rec_t;
+
+/** Header of a log: the records follow, in the order their threads
+ *  filled buffers with them, not in sequence.
+ */
+typedef struct rec_header_t {
+    char magic[8];     /* REC_MAGIC */
+    uint32_t version;  /* REC_VERSION */
+    uint32_t rec_size; /* sizeof(rec_t) */
+} rec_header_t;
+
+#define REC_MAGIC "MMRECRD"
+#define REC_VERSION 1
+
+#endif /* mmrecord.h */
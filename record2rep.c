@@ -0,0 +1,308 @@
+/*
+ * record2rep.c - Turn a log of allocator calls from mmrecord.so into a
+ * trace for the CS:APP Malloc Lab Driver.
+ *
+ * Usage: record2rep [-b] [-w <weight>] <in.log> <out.rep>
+ *
+ * The calls are put back in sequence, and every block gets an ID: a free
+ * one, if a block has been freed, or the next unused one. calloc and the
+ * aligned allocations become 'a' lines, and a zero-byte request asks for
+ * one byte, since mm_malloc(0) returns NULL. Frees and reallocs of
+ * blocks allocated before recording began are left out, or become 'a'
+ * lines. The header gets the weight (1 by default, as in traces/README),
+ * the number of IDs and operations, and the peak of the bytes allocated.
+ * With -b the trace is written in the binary format instead of as text.
+ */
+
+#include "mmrecord.h"
+#include "tracefile.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Weight codes of text traces, as in tracefile.c */
+static const weight_t weight_codes[] = {WNONE, WALL, WUTIL, WPERF};
+
+/** Map of block addresses to IDs, open-addressed.  */
+typedef struct idmap_t {
+    uint64_t *keys; /* addresses, 0 for an empty slot */
+    unsigned int *ids;
+    size_t mask; /* slots - 1, a power of 2 minus 1 */
+    size_t used;
+} idmap_t;
+
+static void __attribute__((noreturn)) fail(const char *msg) {
+    fprintf(stderr, "record2rep: %s\n", msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t n, size_t size) {
+    if (n > SIZE_MAX / size || (p = realloc(p, n * size)) == NULL) {
+        fail("out of memory");
+    }
+    return p;
+}
+
+static void *grow(void *p, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return p;
+    }
+    *cap = (need > 2 * *cap) ? need : 2 * *cap;
+    return xrealloc(p, *cap, size);
+}
+
+static size_t home_of(const idmap_t *map, uint64_t key) {
+    return (size_t)((key >> 4) * 0x9e3779b97f4a7c15u) & map->mask;
+}
+
+static size_t slot_of(const idmap_t *map, uint64_t key) {
+    size_t i = home_of(map, key);
+    while (map->keys[i] != 0 && map->keys[i] != key) {
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+/*
+ * map_put - maps key to id, growing the table at half load
+ */
+static void map_put(idmap_t *map, uint64_t key, unsigned int id) {
+    if (2 * (map->used + 1) > map->mask + 1) {
+        idmap_t big = {NULL, NULL, 2 * (map->mask + 1) - 1, 0};
+        big.keys = calloc(big.mask + 1, sizeof(uint64_t));
+        big.ids = calloc(big.mask + 1, sizeof(unsigned int));
+        if (big.keys == NULL || big.ids == NULL) {
+            fail("out of memory");
+        }
+        for (size_t i = 0; map->keys != NULL && i <= map->mask; i++) {
+            if (map->keys[i] != 0) {
+                size_t j = slot_of(&big, map->keys[i]);
+                big.keys[j] = map->keys[i];
+                big.ids[j] = map->ids[i];
+            }
+        }
+        big.used = map->used;
+        free(map->keys);
+        free(map->ids);
+        *map = big;
+    }
+    size_t i = slot_of(map, key);
+    map->used += (map->keys[i] == 0);
+    map->keys[i] = key;
+    map->ids[i] = id;
+}
+
+/*
+ * map_take - removes key from the map, shifting back the entries that
+ * probed past it. Returns its ID in *id, or false if it was not there.
+ */
+static bool map_take(idmap_t *map, uint64_t key, unsigned int *id) {
+    if (map->keys == NULL || key == 0) {
+        return false;
+    }
+    size_t i = slot_of(map, key);
+    if (map->keys[i] == 0) {
+        return false;
+    }
+    *id = map->ids[i];
+    map->keys[i] = 0;
+    map->used--;
+    for (size_t j = (i + 1) & map->mask; map->keys[j] != 0;
+         j = (j + 1) & map->mask) {
+        size_t home = home_of(map, map->keys[j]);
+        bool stays = (i < j) ? (home > i && home <= j)
+                             : (home > i || home <= j);
+        if (!stays) {
+            map->keys[i] = map->keys[j];
+            map->ids[i] = map->ids[j];
+            map->keys[j] = 0;
+            i = j;
+        }
+    }
+    return true;
+}
+
+/*
+ * read_log - reads a log and puts its records in sequence. Returns an
+ * array of *pnum records; sequence numbers that were never logged, by
+ * threads still running at exit, are left as REC_NONE.
+ */
+static rec_t *read_log(const char *fname, size_t *pnum) {
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    rec_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != REC_VERSION || hdr.rec_size != sizeof(rec_t)) {
+        fail("not a log from this version of mmrecord.so");
+    }
+
+    rec_t *recs = NULL;
+    size_t num = 0;
+    rec_t rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.seq >= SIZE_MAX / 2 / sizeof(rec_t)) {
+            fail("bad sequence number in the log");
+        }
+        if (rec.seq >= num) {
+            size_t want = 2 * (size_t)rec.seq + 1;
+            recs = xrealloc(recs, want, sizeof(rec_t));
+            memset(&recs[num], 0, (want - num) * sizeof(rec_t));
+            num = want;
+        }
+        recs[rec.seq] = rec;
+    }
+    fclose(fp);
+
+    while (num > 0 && recs[num - 1].type == REC_NONE) {
+        num--;
+    }
+    if (num == 0) {
+        fail("no calls in the log");
+    }
+    *pnum = num;
+    return recs;
+}
+
+/*
+ * write_text - writes a trace in the text format
+ */
+static void write_text(const trace_t *trace, unsigned int code,
+                       const char *fname) {
+    FILE *fp = fopen(fname, "w");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    fprintf(fp, "%u\n%u\n%u\n%zu\n", code, trace->num_ids, trace->num_ops,
+            trace->data_bytes);
+    for (unsigned int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        if (op->type == FREE) {
+            fprintf(fp, "f %u\n", op->index);
+        } else {
+            fprintf(fp, "%c %u %zu\n", op->type == ALLOC ? 'a' : 'r',
+                    op->index, op->size);
+        }
+    }
+    if (fclose(fp) != 0) {
+        perror(fname);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    bool binary = false;
+    unsigned int code = 1;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-b") == 0) {
+            binary = true;
+        } else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc) {
+            code = (unsigned int)strtoul(argv[++arg], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - arg != 2 || code > 3) {
+        fprintf(stderr, "Usage: %s [-b] [-w <weight>] <in.log> <out.rep>\n",
+                argv[0]);
+        return 1;
+    }
+
+    size_t num;
+    rec_t *recs = read_log(argv[arg], &num);
+
+    // Live blocks by address; a block whose address an allocation took
+    // before the realloc that moved it was logged waits in moved
+    idmap_t live = {NULL, NULL, 0, 0};
+    idmap_t moved = {NULL, NULL, 0, 0};
+    unsigned int *free_ids = NULL, num_free = 0, num_ids = 0;
+    size_t *sizes = NULL, bytes = 0, peak = 0;
+    size_t free_cap = 0, sizes_cap = 0;
+    if (num > UINT_MAX) {
+        fail("too many calls in the log");
+    }
+    traceop_t *ops = xrealloc(NULL, num, sizeof(traceop_t));
+    unsigned int num_ops = 0;
+
+    for (size_t i = 0; i < num; i++) {
+        const rec_t *rec = &recs[i];
+        traceop_t op = {.count = 1};
+        unsigned int id;
+        bool known = false;
+
+        if (rec->type == REC_FREE || rec->type == REC_REALLOC) {
+            known = (rec->type == REC_REALLOC &&
+                     map_take(&moved, rec->old, &id)) ||
+                    map_take(&live, rec->type == REC_FREE ? rec->ptr
+                                                          : rec->old,
+                             &id);
+        }
+        bool frees = rec->type == REC_FREE ||
+                     (rec->type == REC_REALLOC && rec->ptr == 0);
+        if (rec->type == REC_NONE || rec->type > REC_REALLOC ||
+            (frees && !known)) {
+            continue;
+        }
+
+        if (known) {
+            bytes -= sizes[id];
+        } else if (num_free > 0) {
+            id = free_ids[--num_free];
+        } else {
+            if (num_ids == UINT_MAX) {
+                fail("too many blocks");
+            }
+            id = num_ids++;
+            sizes = grow(sizes, &sizes_cap, num_ids, sizeof(size_t));
+        }
+
+        if (frees) {
+            op.type = FREE;
+            free_ids = grow(free_ids, &free_cap, num_free + 1,
+                            sizeof(unsigned int));
+            free_ids[num_free++] = id;
+        } else {
+            op.type = known ? REALLOC : ALLOC;
+            op.size = (rec->size == 0) ? 1 : rec->size;
+            sizes[id] = op.size;
+            bytes += op.size;
+            if (bytes > peak) {
+                peak = bytes;
+            }
+            unsigned int other;
+            if (map_take(&live, rec->ptr, &other)) {
+                map_put(&moved, rec->ptr, other);
+            }
+            map_put(&live, rec->ptr, id);
+        }
+        op.index = id;
+        op.lineno = (num_ops + 5) & 0xffffff;
+        ops[num_ops++] = op;
+    }
+
+    if (num_ops == 0) {
+        fail("no calls in the log");
+    }
+    trace_t trace = {
+        .filename = argv[arg + 1],
+        .data_bytes = peak,
+        .num_ids = num_ids,
+        .num_ops = num_ops,
+        .weight = weight_codes[code],
+        .ops = ops,
+    };
+    if (binary) {
+        write_trace(&trace, argv[arg + 1]);
+    } else {
+        write_text(&trace, code, argv[arg + 1]);
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Size-class bounds for mm.c, written by classgen from 32 traces.
+ * Requests, in % of the 146242 between 144 and 2047 bytes, per range class:
+ *
+ *     144 to   223   24.7%
+ *     224 to   351   24.2%
+ *     352 to   575   18.1%
+ *     576 to   879   11.0%
+ *     880 to  1359   10.8%
+ *    1360 to  2047   11.2%
+ */
+
+#ifndef MM_SIZECLASSES_H_
+#define MM_SIZECLASSES_H_ 1
+
+#define RANGE_CLASS_BOUND_9 224
+#define RANGE_CLASS_BOUND_10 352
+#define RANGE_CLASS_BOUND_11 576
+#define RANGE_CLASS_BOUND_12 880
+#define RANGE_CLASS_BOUND_13 1360
+#define RANGE_CLASS_BOUND_14 2048
+
+#endif /* sizeclasses.h */
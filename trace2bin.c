@@ -0,0 +1,25 @@
+/*
+ * trace2bin.c - Convert text trace files for the CS:APP Malloc Lab
+ * Driver to the binary format, which read_trace maps without parsing.
+ *
+ * Usage: trace2bin <in.rep> <out.rep>
+ *
+ * The input may itself be binary; read_trace checks it either way.
+ */
+
+#include "tracefile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <in.rep> <out.rep>\n", argv[0]);
+        return 1;
+    }
+
+    trace_t *trace = read_trace(argv[1], 0);
+    write_trace(trace, argv[2]);
+    free_trace(trace);
+    return 0;
+}
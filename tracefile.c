@@ -20,6 +20,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 /** Map from trace file weight codes to Wxxx values.
  *  Quoting traces/README:
  *
@@ -37,6 +42,27 @@ static const weight_t weight_codes[N_WEIGHT_CODES] = {
     /* 3 */ WPERF,
 };
 
+/** Header of a binary trace file.  The file is this header followed by
+ *  num_ops traceop_t records exactly as they are laid out in memory, so
+ *  read_trace can map it and use the records in place.  The layout is
+ *  that of the machine and compiler that wrote it; op_size and
+ *  byte_order reject files from a different one.
+ */
+typedef struct trace_header_t {
+    char magic[8];       /* TRACE_MAGIC */
+    uint32_t version;    /* TRACE_VERSION */
+    uint32_t byte_order; /* TRACE_BYTE_ORDER, as written by this machine */
+    uint32_t op_size;    /* sizeof(traceop_t) */
+    uint32_t weight;     /* weight_t of the trace */
+    uint32_t num_ids;    /* number of block IDs */
+    uint32_t num_ops;    /* number of traceop_t records that follow */
+    uint64_t data_bytes; /* peak number of data bytes allocated */
+} trace_header_t;
+
+#define TRACE_MAGIC "MMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304u
+
 /* Temporarily duplicated from mdriver.c.  */
 /*
  * app_error - Report an arbitrary application error
@@ -205,45 +231,65 @@ static unsigned long read_single_number(const char *line, unsigned long max,
     return val;
 }
 
-/** Read an 'a' or 'r' trace line (specifying a call to malloc
- *  or realloc, respectively).  The text at ARGS should match
- *  /[ \t]*[0-9]+[ \t]*[0-9]+/; the numbers are the block ID
- *  and the size to allocate or resize to, respectively.
+/** Split the next number off the arguments of a trace line.  The text
+ *  at *PARGS should match /[ \t]*[0-9]+[ \t]+/; the digits are
+ *  NUL-terminated in place and *PARGS is advanced past the blanks that
+ *  follow them.
  *
- *  @param op      traceop_t object to be initialized.
- *  @param opcode  Value for the 'type' field of OP.
- *  @param args    Arguments for this trace line, as text.
+ *  @param pargs   Arguments of this trace line, as text; advanced.
  *  @param fname   Trace file name (for error reporting).
  *  @param lineno  Trace line number (for error reporting).
+ *  @param what    What the number means (for error reporting).
+ *  @return        The text of the number, for read_single_number.
  */
-static void read_alloc_line(traceop_t *op, traceopcode_t opcode, char *args,
-                            const char *fname, unsigned int lineno) {
+static char *split_number_field(char **pargs, const char *fname,
+                                unsigned int lineno, const char *what) {
+    char *args = *pargs;
     while (*args == ' ' || *args == '\t') {
         args++;
     }
-    char *idtext = args;
+    char *text = args;
     while ('0' <= *args && *args <= '9') {
         args++;
     }
-    if (args == idtext) {
+    if (args == text) {
         app_error("%s:%u: error: invalid trace: "
-                  "while reading block ID, found a not-number",
-                  fname, lineno);
+                  "while reading %s, found a not-number",
+                  fname, lineno, what);
     }
     if (*args != ' ' && *args != '\t') {
         app_error("%s:%u: error: invalid trace: "
-                  "while reading block ID, junk after number",
-                  fname, lineno);
+                  "while reading %s, junk after number",
+                  fname, lineno, what);
     }
     *args++ = '\0';
     while (*args == ' ' || *args == '\t') {
         args++;
     }
+    *pargs = args;
+    return text;
+}
+
+/** Read an 'a' or 'r' trace line (specifying a call to malloc
+ *  or realloc, respectively).  The text at ARGS should match
+ *  /[ \t]*[0-9]+[ \t]*[0-9]+/; the numbers are the block ID
+ *  and the size to allocate or resize to, respectively.
+ *
+ *  @param op      traceop_t object to be initialized.
+ *  @param opcode  Value for the 'type' field of OP.
+ *  @param args    Arguments for this trace line, as text.
+ *  @param fname   Trace file name (for error reporting).
+ *  @param lineno  Trace line number (for error reporting).
+ */
+static void read_alloc_line(traceop_t *op, traceopcode_t opcode, char *args,
+                            const char *fname, unsigned int lineno) {
+    char *idtext = split_number_field(&args, fname, lineno, "block ID");
 
     op->type = opcode;
     op->lineno = lineno;
     op->index = (unsigned int)read_single_number(idtext, UINT_MAX, fname,
                                                  lineno, "block ID");
+    op->count = 1;
     op->size = read_single_number(args, SIZE_MAX, fname, lineno, "block size");
 }
 
@@ -266,66 +312,80 @@ static void read_free_line(traceop_t *op, char *args, const char *fname,
     op->lineno = lineno;
     op->index = (unsigned int)read_single_number(args, UINT_MAX, fname, lineno,
                                                  "block ID");
+    op->count = 1;
     op->size = 0;
 }
 
-/** Read a trace file into a freshly allocated trace_t object.
- *  Caller is responsible for calling free_trace on the trace
- *  when it's finished with it.
+/** Read an 'A' or 'F' trace line (specifying a call to mm_malloc_batch
+ *  or mm_free_batch, respectively).  For 'A' the text at ARGS should
+ *  match /[ \t]*[0-9]+[ \t]*[0-9]+[ \t]*[0-9]+/; the numbers are the
+ *  first block ID, the number of blocks, and the size of each block.
+ *  For 'F' the size is left out.  The batch covers the consecutive
+ *  block IDs starting at the first one.
  *
- *  @param fname    Name of the trace file to be read.
- *  @param verbose     Verbosity level.
- *  @return            a trace_t object.
+ *  @param op      traceop_t object to be initialized.
+ *  @param opcode  Value for the 'type' field of OP.
+ *  @param args    Arguments for this trace line, as text.
+ *  @param fname   Trace file name (for error reporting).
+ *  @param lineno  Trace line number (for error reporting).
  */
-trace_t *read_trace(const char *fname, unsigned int verbose) {
-
-    if (verbose > 1)
-        fprintf(stderr, "Reading tracefile: %s\n", fname);
+static void read_batch_line(traceop_t *op, traceopcode_t opcode, char *args,
+                            const char *fname, unsigned int lineno) {
+    char *idtext = split_number_field(&args, fname, lineno, "block ID");
+    op->type = opcode;
+    op->lineno = lineno;
+    op->index = (unsigned int)read_single_number(idtext, UINT_MAX, fname,
+                                                 lineno, "block ID");
 
-    FILE *fp = fopen(fname, "r");
-    if (!fp) {
-        unix_error("Could not open %s in read_trace", fname);
+    unsigned long max_count = UINT_MAX - op->index;
+    if (opcode == ALLOC_BATCH) {
+        char *counttext =
+            split_number_field(&args, fname, lineno, "batch count");
+        op->count = (unsigned int)read_single_number(
+            counttext, max_count, fname, lineno, "batch count");
+        op->size =
+            read_single_number(args, SIZE_MAX, fname, lineno, "block size");
+    } else {
+        while (*args == ' ' || *args == '\t') {
+            args++;
+        }
+        op->count = (unsigned int)read_single_number(
+            args, max_count, fname, lineno, "batch count");
+        op->size = 0;
     }
 
-    /* Read the trace file header */
-    char *line = NULL;
-    size_t linesz = 0;
-    unsigned int lineno = 0;
-
-    get_header_line(fp, fname, &line, &linesz, &lineno);
-    unsigned int iweight = (unsigned int)read_single_number(
-        line, N_WEIGHT_CODES - 1, fname, lineno, "trace weight");
-
-    get_header_line(fp, fname, &line, &linesz, &lineno);
-    unsigned int num_ids = (unsigned int)read_single_number(
-        line, UINT_MAX, fname, lineno, "number of block IDs");
-
-    get_header_line(fp, fname, &line, &linesz, &lineno);
-    unsigned int num_ops = (unsigned int)read_single_number(
-        line, UINT_MAX, fname, lineno, "number of trace operations");
-
-    get_header_line(fp, fname, &line, &linesz, &lineno);
-    size_t peak_bytes = read_single_number(line, SIZE_MAX, fname, lineno,
-                                           "peak allocation in bytes");
-
-    // We can now allocate the trace_t object.
-    trace_t *trace = malloc(sizeof(trace_t));
-    if (!trace) {
-        unix_error("read_trace: malloc/1 (%zd) failed", sizeof(trace_t));
+    if (op->count == 0) {
+        app_error("%s:%u: error: invalid trace: empty batch", fname, lineno);
     }
-    trace->filename = fname;
-    trace->data_bytes = peak_bytes;
-    trace->num_ids = num_ids;
-    trace->num_ops = num_ops;
-    trace->weight = weight_codes[iweight];
+}
 
-    // We'll store each request line in the trace in this array.
-    trace->ops = calloc(trace->num_ops, sizeof(traceop_t));
-    if (!trace->ops) {
-        unix_error("read_trace: malloc/2 (%zd) failed",
-                   trace->num_ops * sizeof(traceop_t));
+/** Account for one trace operation in the block ID and batch limits
+ *  that read_trace checks once the whole trace has been read.
+ *
+ *  @param op          The trace operation.
+ *  @param[inout] pmax_id     Largest block ID used so far.
+ *  @param[inout] pmax_batch  Largest batch count so far.
+ */
+static void note_op(const traceop_t *op, unsigned int *pmax_id,
+                    unsigned int *pmax_batch) {
+    unsigned int last_id = op->index + (op->count - 1);
+    if (last_id > *pmax_id) {
+        *pmax_id = last_id;
     }
+    if (op->type == ALLOC_BATCH || op->type == FREE_BATCH) {
+        if (op->count > *pmax_batch) {
+            *pmax_batch = op->count;
+        }
+    }
+}
 
+/** Allocate the per-block arrays of a trace whose header has been read,
+ *  and the scratch array for its batch requests.
+ *
+ *  @param trace       The trace, with num_ids set.
+ *  @param max_batch   Largest batch count in the trace.
+ */
+static void alloc_trace_arrays(trace_t *trace, unsigned int max_batch) {
     // We'll keep an array of pointers to the allocated blocks here...
     trace->blocks = calloc(trace->num_ids, sizeof(char *));
     if (!trace->blocks) {
@@ -347,39 +407,131 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
                    trace->num_ids * sizeof(size_t));
     }
 
+    // Batch requests pass their pointers to the allocator in one array
+    trace->max_batch = max_batch;
+    trace->batch = NULL;
+    if (max_batch > 0) {
+        trace->batch = calloc(max_batch, sizeof(void *));
+        if (!trace->batch) {
+            unix_error("read_trace: malloc/6 (%zd) failed",
+                       max_batch * sizeof(void *));
+        }
+    }
+}
+
+/** Read the four header lines of a text trace file into the header
+ *  fields of a trace_t object: filename, data_bytes, num_ids, num_ops
+ *  and weight.
+ *
+ *  @param fp       FILE to read from, positioned at the start.
+ *  @param fname    Name of the trace file (for error reporting).
+ *  @param[inout] pline, plinesz, plineno
+ *      Line buffer and line number, as for get_next_line.
+ *  @param trace    trace_t object whose header fields are set.
+ */
+static void read_text_header(FILE *fp, const char *fname, char **pline,
+                             size_t *plinesz, unsigned int *plineno,
+                             trace_t *trace) {
+    get_header_line(fp, fname, pline, plinesz, plineno);
+    unsigned int iweight = (unsigned int)read_single_number(
+        *pline, N_WEIGHT_CODES - 1, fname, *plineno, "trace weight");
+
+    get_header_line(fp, fname, pline, plinesz, plineno);
+    unsigned int num_ids = (unsigned int)read_single_number(
+        *pline, UINT_MAX, fname, *plineno, "number of block IDs");
+
+    get_header_line(fp, fname, pline, plinesz, plineno);
+    unsigned int num_ops = (unsigned int)read_single_number(
+        *pline, UINT_MAX, fname, *plineno, "number of trace operations");
+
+    get_header_line(fp, fname, pline, plinesz, plineno);
+    size_t peak_bytes = read_single_number(*pline, SIZE_MAX, fname, *plineno,
+                                           "peak allocation in bytes");
+
+    trace->filename = fname;
+    trace->data_bytes = peak_bytes;
+    trace->num_ids = num_ids;
+    trace->num_ops = num_ops;
+    trace->weight = weight_codes[iweight];
+}
+
+/** Parse one request line of a text trace.
+ *
+ *  @param op       traceop_t object to be initialized.
+ *  @param line     The line, as returned by get_next_line.
+ *  @param fname    Trace file name (for error reporting).
+ *  @param lineno   Trace line number (for error reporting).
+ */
+static void read_text_op(traceop_t *op, char *line, const char *fname,
+                         unsigned int lineno) {
+    switch (line[0]) {
+    case 'a':
+        read_alloc_line(op, ALLOC, line + 1, fname, lineno);
+        break;
+    case 'r':
+        op->type = REALLOC;
+        read_alloc_line(op, REALLOC, line + 1, fname, lineno);
+        break;
+    case 'f':
+        op->type = FREE;
+        read_free_line(op, line + 1, fname, lineno);
+        break;
+    case 'A':
+        read_batch_line(op, ALLOC_BATCH, line + 1, fname, lineno);
+        break;
+    case 'F':
+        read_batch_line(op, FREE_BATCH, line + 1, fname, lineno);
+        break;
+    default:
+        app_error("%s:%d: error: invalid trace: "
+                  "unrecognized trace opcode '%c'",
+                  fname, lineno, line[0]);
+    }
+}
+
+/** Parse a text trace file into a freshly allocated trace_t object.
+ *
+ *  @param fp       FILE to read from, positioned at the start.
+ *  @param fname    Name of the trace file (for error reporting).
+ *  @return         a trace_t object.
+ */
+static trace_t *read_text_trace(FILE *fp, const char *fname) {
+    char *line = NULL;
+    size_t linesz = 0;
+    unsigned int lineno = 0;
+
+    trace_t *trace = malloc(sizeof(trace_t));
+    if (!trace) {
+        unix_error("read_trace: malloc/1 (%zd) failed", sizeof(trace_t));
+    }
+
+    /* Read the trace file header */
+    read_text_header(fp, fname, &line, &linesz, &lineno, trace);
+    trace->map = NULL;
+    trace->map_bytes = 0;
+
+    // We'll store each request line in the trace in this array.
+    trace->ops = calloc(trace->num_ops, sizeof(traceop_t));
+    if (!trace->ops) {
+        unix_error("read_trace: malloc/2 (%zd) failed",
+                   trace->num_ops * sizeof(traceop_t));
+    }
+
     // Read every request line in the trace file.
     unsigned int op = 0;
     unsigned int max_id_used = 0;
+    unsigned int max_batch = 0;
 
     while (get_next_line(fp, fname, &line, &linesz, &lineno)) {
         if (op == trace->num_ops) {
             app_error("%s:%d: error: invalid trace: too many ops", fname,
                       lineno);
         }
-
-        switch (line[0]) {
-        case 'a':
-            read_alloc_line(&trace->ops[op], ALLOC, line + 1, fname, lineno);
-            break;
-        case 'r':
-            trace->ops[op].type = REALLOC;
-            read_alloc_line(&trace->ops[op], REALLOC, line + 1, fname, lineno);
-            break;
-        case 'f':
-            trace->ops[op].type = FREE;
-            read_free_line(&trace->ops[op], line + 1, fname, lineno);
-            break;
-        default:
-            app_error("%s:%d: error: invalid trace: "
-                      "unrecognized trace opcode '%c'",
-                      fname, lineno, line[0]);
-        }
-        if (trace->ops[op].index > max_id_used) {
-            max_id_used = trace->ops[op].index;
-        }
+        read_text_op(&trace->ops[op], line, fname, lineno);
+        note_op(&trace->ops[op], &max_id_used, &max_batch);
         op++;
     }
-    if (op < num_ops) {
+    if (op < trace->num_ops) {
         app_error("%s:%d: error: invalid trace: not enough ops", fname, lineno);
     }
     if (max_id_used != trace->num_ids - 1) {
@@ -388,10 +540,328 @@ trace_t *read_trace(const char *fname, unsigned int verbose) {
                   fname, lineno);
     }
 
+    alloc_trace_arrays(trace, max_batch);
+    free(line);
+    return trace;
+}
+
+/** Check the header of a binary trace file against this build, and
+ *  copy its fields into the header fields of a trace_t object.
+ *
+ *  @param hdr      Header of the trace file.
+ *  @param fname    Name of the trace file (for error reporting).
+ *  @param trace    trace_t object whose header fields are set.
+ */
+static void read_binary_header(const trace_header_t *hdr, const char *fname,
+                               trace_t *trace) {
+    if (hdr->version != TRACE_VERSION || hdr->byte_order != TRACE_BYTE_ORDER ||
+        hdr->op_size != sizeof(traceop_t)) {
+        app_error("%s: error: binary trace from another version or machine; "
+                  "convert it again with trace2bin",
+                  fname);
+    }
+    if (hdr->weight > WALL || hdr->num_ids == 0) {
+        app_error("%s: error: invalid trace: bad binary header", fname);
+    }
+    trace->filename = fname;
+    trace->data_bytes = (size_t)hdr->data_bytes;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = (weight_t)hdr->weight;
+}
+
+/** Check one op of a binary trace.  Text traces are checked as they
+ *  are parsed; a corrupt binary file must not send the driver outside
+ *  its block arrays either.
+ *
+ *  @param op       The op.
+ *  @param num      Its number in the trace (for error reporting).
+ *  @param fname    Name of the trace file (for error reporting).
+ */
+static void check_binary_op(const traceop_t *op, unsigned int num,
+                            const char *fname) {
+    if (op->type > FREE_BATCH || op->count == 0 ||
+        op->count > UINT_MAX - op->index) {
+        app_error("%s: error: invalid trace: bad op %u", fname, num);
+    }
+}
+
+/** Map a binary trace file, whose header has been read, into a freshly
+ *  allocated trace_t object.  The ops of the trace point into the
+ *  mapping instead of being copied; they are checked the same way as
+ *  those of a text trace.
+ *
+ *  @param fd       File descriptor of the trace file.
+ *  @param fname    Name of the trace file (for error reporting).
+ *  @param hdr      Header of the trace file.
+ *  @return         a trace_t object.
+ */
+static trace_t *map_binary_trace(int fd, const char *fname,
+                                 const trace_header_t *hdr) {
+    trace_t *trace = malloc(sizeof(trace_t));
+    if (!trace) {
+        unix_error("read_trace: malloc/1 (%zd) failed", sizeof(trace_t));
+    }
+    read_binary_header(hdr, fname, trace);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        unix_error("%s: fstat", fname);
+    }
+    size_t map_bytes =
+        sizeof(trace_header_t) + (size_t)hdr->num_ops * sizeof(traceop_t);
+    if ((size_t)st.st_size != map_bytes) {
+        app_error("%s: error: invalid trace: file is %zu bytes, "
+                  "expected %zu",
+                  fname, (size_t)st.st_size, map_bytes);
+    }
+
+    char *map = mmap(NULL, map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        unix_error("%s: mmap", fname);
+    }
+    trace->ops = (traceop_t *)(map + sizeof(trace_header_t));
+    trace->map = map;
+    trace->map_bytes = map_bytes;
+
+    unsigned int max_id_used = 0;
+    unsigned int max_batch = 0;
+    for (unsigned int op = 0; op < trace->num_ops; op++) {
+        check_binary_op(&trace->ops[op], op, fname);
+        note_op(&trace->ops[op], &max_id_used, &max_batch);
+    }
+    if (max_id_used != trace->num_ids - 1) {
+        app_error("%s: error: invalid trace: "
+                  "wrong number of block IDs used",
+                  fname);
+    }
+
+    alloc_trace_arrays(trace, max_batch);
+    return trace;
+}
+
+/** Read a trace file into a freshly allocated trace_t object.
+ *  The file may be a text trace or a binary one written by write_trace;
+ *  binary traces are recognized by their header and mapped, not parsed.
+ *  Caller is responsible for calling free_trace on the trace
+ *  when it's finished with it.
+ *
+ *  @param fname    Name of the trace file to be read.
+ *  @param verbose     Verbosity level.
+ *  @return            a trace_t object.
+ */
+trace_t *read_trace(const char *fname, unsigned int verbose) {
+
+    if (verbose > 1)
+        fprintf(stderr, "Reading tracefile: %s\n", fname);
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        unix_error("Could not open %s in read_trace", fname);
+    }
+
+    trace_header_t hdr;
+    ssize_t got = pread(fd, &hdr, sizeof(hdr), 0);
+    if (got < 0) {
+        unix_error("%s: read error", fname);
+    }
+    if ((size_t)got == sizeof(hdr) &&
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) == 0) {
+        trace_t *trace = map_binary_trace(fd, fname, &hdr);
+        close(fd);
+        return trace;
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) {
+        unix_error("Could not open %s in read_trace", fname);
+    }
+    trace_t *trace = read_text_trace(fp, fname);
     fclose(fp);
     return trace;
 }
 
+/** Write a trace to a file in the binary format that read_trace maps.
+ *
+ *  @param trace    The trace to write.
+ *  @param fname    Name of the file to create or replace.
+ */
+void write_trace(const trace_t *trace, const char *fname) {
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.byte_order = TRACE_BYTE_ORDER;
+    hdr.op_size = sizeof(traceop_t);
+    hdr.weight = (uint32_t)trace->weight;
+    hdr.num_ids = trace->num_ids;
+    hdr.num_ops = trace->num_ops;
+    hdr.data_bytes = trace->data_bytes;
+
+    FILE *fp = fopen(fname, "wb");
+    if (!fp) {
+        unix_error("Could not create %s in write_trace", fname);
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, fp) !=
+            trace->num_ops ||
+        fclose(fp) != 0) {
+        unix_error("%s: write error", fname);
+    }
+}
+
+/** A trace file read a window of ops at a time.  Either fp is set, for
+ *  a text trace, or fd is, for a binary one.
+ */
+struct trace_stream_t {
+    const char *fname;
+    FILE *fp;                  /* text trace, or NULL */
+    int fd;                    /* binary trace, or -1 */
+    off_t data_offset;         /* where the ops start in a binary file */
+    char *line;                /* line buffer for get_next_line */
+    size_t linesz;
+    unsigned int lineno;
+    unsigned int num_ids;      /* from the header */
+    unsigned int num_ops;
+    unsigned int op;           /* ops read so far */
+    unsigned int max_id_used;  /* checked once the last op is read */
+    unsigned int max_batch;
+};
+
+/** Open a trace file, text or binary, to read its ops in windows with
+ *  read_trace_window.  Only the header fields of *TRACE are set; the
+ *  ops are never all in memory at once.
+ *
+ *  @param fname    Name of the trace file to be read.
+ *  @param verbose  Verbosity level.
+ *  @param trace    trace_t object whose header fields are set; its
+ *                  arrays are set to NULL.
+ *  @return         the stream, for close_trace_stream to free.
+ */
+trace_stream_t *open_trace_stream(const char *fname, unsigned int verbose,
+                                  trace_t *trace) {
+    if (verbose > 1)
+        fprintf(stderr, "Streaming tracefile: %s\n", fname);
+
+    trace_stream_t *stream = calloc(1, sizeof(trace_stream_t));
+    if (!stream) {
+        unix_error("open_trace_stream: calloc (%zd) failed",
+                   sizeof(trace_stream_t));
+    }
+    stream->fname = fname;
+    stream->fd = open(fname, O_RDONLY);
+    if (stream->fd < 0) {
+        unix_error("Could not open %s in open_trace_stream", fname);
+    }
+
+    trace_header_t hdr;
+    ssize_t got = pread(stream->fd, &hdr, sizeof(hdr), 0);
+    if (got < 0) {
+        unix_error("%s: read error", fname);
+    }
+    if ((size_t)got == sizeof(hdr) &&
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) == 0) {
+        read_binary_header(&hdr, fname, trace);
+        stream->data_offset = (off_t)sizeof(trace_header_t);
+    } else {
+        stream->fp = fdopen(stream->fd, "r");
+        if (!stream->fp) {
+            unix_error("Could not open %s in open_trace_stream", fname);
+        }
+        stream->fd = -1;
+        read_text_header(stream->fp, fname, &stream->line, &stream->linesz,
+                         &stream->lineno, trace);
+    }
+
+    stream->num_ids = trace->num_ids;
+    stream->num_ops = trace->num_ops;
+    trace->ops = NULL;
+    trace->blocks = NULL;
+    trace->block_sizes = NULL;
+    trace->block_rand_base = NULL;
+    trace->batch = NULL;
+    trace->max_batch = 0;
+    trace->map = NULL;
+    trace->map_bytes = 0;
+    return stream;
+}
+
+/** Read the next window of ops from a trace stream.  The ops are checked
+ *  as read_trace checks them; the checks that need the whole trace are
+ *  made when its end is reached.
+ *
+ *  @param stream   The stream.
+ *  @param ops      Array to read the ops into.
+ *  @param max      Number of ops that fit in the array.
+ *  @return         Number of ops read; 0 once the trace has ended.
+ */
+unsigned int read_trace_window(trace_stream_t *stream, traceop_t *ops,
+                               unsigned int max) {
+    const char *fname = stream->fname;
+    unsigned int n = 0;
+
+    if (stream->fp) {
+        while (n < max && get_next_line(stream->fp, fname, &stream->line,
+                                        &stream->linesz, &stream->lineno)) {
+            if (stream->op == stream->num_ops) {
+                app_error("%s:%d: error: invalid trace: too many ops", fname,
+                          stream->lineno);
+            }
+            read_text_op(&ops[n], stream->line, fname, stream->lineno);
+            note_op(&ops[n], &stream->max_id_used, &stream->max_batch);
+            stream->op++;
+            n++;
+        }
+    } else {
+        n = stream->num_ops - stream->op;
+        if (n > max) {
+            n = max;
+        }
+        size_t bytes = (size_t)n * sizeof(traceop_t);
+        off_t offset = stream->data_offset +
+                       (off_t)((size_t)stream->op * sizeof(traceop_t));
+        ssize_t got = pread(stream->fd, ops, bytes, offset);
+        if (got < 0) {
+            unix_error("%s: read error", fname);
+        }
+        if ((size_t)got != bytes) {
+            app_error("%s: error: invalid trace: not enough ops", fname);
+        }
+        for (unsigned int i = 0; i < n; i++) {
+            check_binary_op(&ops[i], stream->op + i, fname);
+            note_op(&ops[i], &stream->max_id_used, &stream->max_batch);
+        }
+        stream->op += n;
+    }
+
+    if (n == 0 || stream->op == stream->num_ops) {
+        if (stream->op < stream->num_ops) {
+            app_error("%s:%d: error: invalid trace: not enough ops", fname,
+                      stream->lineno);
+        }
+        if (stream->max_id_used != stream->num_ids - 1) {
+            app_error("%s:%d: error: invalid trace: "
+                      "wrong number of block IDs used",
+                      fname, stream->lineno);
+        }
+    }
+    return n;
+}
+
+/** Close a trace stream and free it.
+ *
+ *  @param stream   The stream.
+ */
+void close_trace_stream(trace_stream_t *stream) {
+    if (stream->fp) {
+        fclose(stream->fp);
+    } else {
+        close(stream->fd);
+    }
+    free(stream->line);
+    free(stream);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -402,13 +872,19 @@ void reinit_trace(trace_t *trace) {
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
+ * free_trace - Free the trace record and the five arrays it points
  *              to, all of which were allocated in read_trace().
+ *              The ops of a binary trace are unmapped instead.
  */
 void free_trace(trace_t *trace) {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map) { /* free the five arrays... */
+        munmap(trace->map, trace->map_bytes);
+    } else {
+        free(trace->ops);
+    }
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch);
     free(trace); /* and the trace record itself... */
 }
@@ -26,9 +26,11 @@ typedef enum weight_t {
  *  by this trace operation.
  */
 typedef enum traceopcode_t {
-    ALLOC,   /* 'a': call malloc */
-    FREE,    /* 'f': call free */
-    REALLOC, /* 'r': call realloc */
+    ALLOC,       /* 'a': call malloc */
+    FREE,        /* 'f': call free */
+    REALLOC,     /* 'r': call realloc */
+    ALLOC_BATCH, /* 'A': call mm_malloc_batch for a run of block ids */
+    FREE_BATCH,  /* 'F': call mm_free_batch for a run of block ids */
 } traceopcode_t;
 
 /** Description of a single trace operation (allocator request).  */
@@ -36,6 +38,7 @@ typedef struct traceop_t {
     traceopcode_t type : 8;   /* type of request (8 bits) */
     unsigned int lineno : 24; /* line number in trace file */
     unsigned int index;       /* block id, to use in realloc/free */
+    unsigned int count;       /* number of ids in a batch, from index on */
     size_t size;              /* byte size of alloc/realloc request */
 } traceop_t;
 
@@ -50,6 +53,10 @@ typedef struct trace_t {
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    void **batch;            /* scratch pointers for batch requests... */
+    unsigned int max_batch;  /* ... with room for the largest batch */
+    void *map;               /* mapping of a binary trace file, or NULL... */
+    size_t map_bytes;        /* ... and its length; ops point into it */
 } trace_t;
 
 /* These functions read, allocate, and free storage for traces */
@@ -57,4 +64,16 @@ extern trace_t *read_trace(const char *filename, unsigned int verbose);
 extern void reinit_trace(trace_t *trace);
 extern void free_trace(trace_t *trace);
 
+/* Writes a trace in the binary format, which read_trace maps in place */
+extern void write_trace(const trace_t *trace, const char *fname);
+
+/* These functions read a trace, text or binary, a window of ops at a
+   time, for traces too large to hold in memory */
+typedef struct trace_stream_t trace_stream_t;
+extern trace_stream_t *open_trace_stream(const char *filename,
+                                         unsigned int verbose, trace_t *trace);
+extern unsigned int read_trace_window(trace_stream_t *stream, traceop_t *ops,
+                                      unsigned int max);
+extern void close_trace_stream(trace_stream_t *stream);
+
 #endif /* tracefile.h */